@@ -0,0 +1,70 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <sqlite3.hpp>
+
+// Multi-threaded exec throughput, run once with and once without --pooled to compare allocators.
+int main(int argc, char **argv) {
+	bool pooled = false;
+	unsigned threads = 4;
+	unsigned iterations = 20000;
+
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--pooled") == 0) {
+			pooled = true;
+		}
+		else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			threads = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			iterations = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else {
+			std::fprintf(stderr, "usage: bench [--pooled] [--threads N] [--iterations N]\n");
+			return 1;
+		}
+	}
+
+	if (pooled) {
+		sqlt3::configure_allocator();
+	}
+
+	auto worker = [&]() {
+		auto database = sqlt3::open(":memory:");
+		sqlt3::exec<void>(database, "CREATE TABLE numbers (key INTEGER PRIMARY KEY, value TEXT);");
+		for (unsigned i = 0; i < iterations; ++i) {
+			sqlt3::exec<void>(database, "INSERT OR REPLACE INTO numbers VALUES (?, ?);", i % 1024, std::to_string(i));
+			sqlt3::exec<std::string>(database, "SELECT value FROM numbers WHERE key = ?;", i % 1024);
+		}
+	};
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (unsigned i = 0; i < threads; ++i) {
+		pool.push_back(std::thread(worker));
+	}
+	for (auto& thread : pool) {
+		thread.join();
+	}
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() / 1e6;
+
+	std::printf(
+		"%s allocator, %u threads: %.0f exec/s\n",
+		pooled ? "pooled" : "system",
+		threads,
+		2.0 * threads * iterations / elapsed
+		);
+
+	if (pooled) {
+		auto status = sqlt3::allocator_status();
+		std::printf(
+			"in use %lld bytes, peak %lld bytes, %lld system allocations\n",
+			status.in_use,
+			status.peak,
+			status.system_allocations
+			);
+	}
+	return 0;
+}
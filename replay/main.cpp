@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sqlite3.hpp>
+
+int usage() {
+	std::fprintf(stderr, "usage: replay [--original-speed] [--threads N] <log> <source.db> <target.db>\n");
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	sqlt3::replay_options options;
+	const char* paths[3] = { nullptr, nullptr, nullptr };
+	int num_paths = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--original-speed") == 0) {
+			options.original_speed = true;
+		}
+		else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			options.threads = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (num_paths < 3) {
+			paths[num_paths++] = argv[i];
+		}
+		else {
+			return usage();
+		}
+	}
+
+	if (num_paths != 3) {
+		return usage();
+	}
+
+	{
+		std::ifstream source(paths[1], std::ios::binary);
+		std::ofstream target(paths[2], std::ios::binary | std::ios::trunc);
+		if (!source || !target || !(target << source.rdbuf())) {
+			std::fprintf(stderr, "cannot copy %s to %s\n", paths[1], paths[2]);
+			return 1;
+		}
+	}
+
+	try {
+		auto result = sqlt3::replay(paths[0], paths[2], options);
+		std::printf(
+			"%u statements, %u errors (%u while recording), %.3f s\n",
+			static_cast<unsigned>(result.statements),
+			static_cast<unsigned>(result.errors),
+			static_cast<unsigned>(result.recorded_errors),
+			std::chrono::duration_cast<std::chrono::microseconds>(result.elapsed).count() / 1e6
+			);
+		return result.errors == result.recorded_errors ? 0 : 2;
+	}
+	catch (const std::exception& exception) {
+		std::fprintf(stderr, "%s\n", exception.what());
+		return 1;
+	}
+}
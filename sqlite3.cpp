@@ -3,6 +3,73 @@
 #include <limits>
 #include <cstdio>
 #include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <iterator>
+#include <cstdlib>
+#include <cctype>
+#include <unordered_map>
+#include <map>
+#include <random>
+#include <cmath>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#endif
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define SQLT3_THREAD_LOCAL __declspec(thread)
+#else
+#define SQLT3_THREAD_LOCAL thread_local
+#endif
+
+// USDT probes (provider sqlt3) for perf/bpftrace, compiled out when sys/sdt.h is not available
+// or SQLT3_NO_USDT is defined. SQL pointers are only guaranteed to be readable in *__start probes.
+#if !defined(SQLT3_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SQLT3_USDT 1
+#endif
+#endif
+
+// io_uring is used through the raw system calls, liburing is not required.
+#if !defined(SQLT3_NO_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <cerrno>
+#define SQLT3_IO_URING 1
+#endif
+#endif
+
+#if defined(SQLT3_USDT)
+#define SQLT3_PROBE2(name, a1, a2) DTRACE_PROBE2(sqlt3, name, a1, a2)
+#define SQLT3_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(sqlt3, name, a1, a2, a3)
+#else
+#define SQLT3_PROBE2(name, a1, a2)
+#define SQLT3_PROBE3(name, a1, a2, a3)
+#endif
 
 namespace sqlt3 {
 namespace detail {
@@ -95,14 +162,562 @@ struct impl {
 	}
 };
 
+struct param_info;
+
+struct slow_query_buffer {
+	slow_query_buffer(std::chrono::nanoseconds threshold, size_t capacity, const char* path)
+		: threshold(threshold)
+		, capacity(capacity)
+		, file(path ? std::fopen(path, "a") : nullptr) {
+		if (path && file == nullptr) {
+			impl::throw_exception(SQLITE_CANTOPEN, path);
+		}
+	}
+
+	~slow_query_buffer() {
+		if (file) {
+			std::fclose(file);
+		}
+	}
+
+	void record(
+		statement& statement,
+		const std::vector<const param_info*>& params,
+		std::chrono::nanoseconds duration,
+		int error
+		);
+
+	const std::chrono::nanoseconds threshold;
+	const size_t capacity;
+	std::FILE* const file;
+	std::mutex mutex;
+	std::deque<slow_query> queries;
+};
+
+struct tracked_statement {
+	std::chrono::steady_clock::time_point created;
+	std::chrono::steady_clock::time_point stepped;
+};
+
+// Creation and last step times of the statements of a connection. Finalized statements are only
+// noticed and dropped when the table is compared against sqlite3_next_stmt, which happens once the
+// table has doubled since the last comparison.
+struct statement_tracker {
+	statement_tracker()
+		: handle(nullptr)
+		, live(0)
+		, watchdog(false)
+		, threshold(0)
+		, action(watchdog_log) {
+	}
+
+	sqlite3* handle;
+	std::mutex mutex;
+	std::unordered_map<sqlite3_stmt*, tracked_statement> statements;
+	size_t live;
+	bool watchdog;
+	std::chrono::nanoseconds threshold;
+	watchdog_action action;
+	string path;
+	std::chrono::steady_clock::time_point next_check;
+};
+
+// step() finds the tracker of a statement by scanning tracked_handles, connections without a
+// tracker only pay for the load of tracker_count. Trackers are never freed so a slot that is
+// given up during the scan stays safe to lock, handle is checked again under the tracker mutex.
+static const size_t max_trackers = 64;
+static std::mutex trackers_mutex;
+static std::atomic<sqlite3*> tracked_handles[max_trackers];
+static statement_tracker tracker_pool[max_trackers];
+static std::atomic<size_t> tracker_count(0);
+
+// Log layout: magic, then per statement u64 start, u64 duration, u32 thread, i32 result code,
+// u32 sql size, sql, u32 param count and params as u8 kind followed by i64, f64 or u32 size and text.
+const char record_magic[8] = { 'S', 'Q', 'L', 'T', '3', 'R', 'C', '2' };
+
+enum record_kind {
+	record_null,
+	record_integer,
+	record_real,
+	record_text
+};
+
+struct statement_recorder {
+	statement_recorder(const char* path)
+		: file(std::fopen(path, "wb"))
+		, epoch(std::chrono::steady_clock::now()) {
+		if (file == nullptr) {
+			impl::throw_exception(SQLITE_CANTOPEN, path);
+		}
+		std::fwrite(record_magic, 1, sizeof(record_magic), file);
+	}
+
+	~statement_recorder() {
+		std::fclose(file);
+	}
+
+	void record(
+		statement& statement,
+		const std::vector<const param_info*>& params,
+		std::chrono::steady_clock::time_point start,
+		std::chrono::nanoseconds duration,
+		int error
+		);
+
+	std::FILE* const file;
+	const std::chrono::steady_clock::time_point epoch;
+	std::mutex mutex;
+};
+
+struct mmap_state {
+	static const unsigned check_interval = 64;
+
+	mmap_state()
+		: policy(open_options::mmap_fixed)
+		, size(0)
+		, clamped(false)
+		, statements(0)
+		, resizes(0)
+		, errors(0) {
+	}
+
+	open_options::mmap_policy_type policy;
+	long long size;
+	bool clamped;
+	unsigned statements;
+	long long resizes;
+	long long errors;
+};
+
+#if defined(SQLITE_CHECKPOINT_TRUNCATE)
+const int checkpoint_shrink = SQLITE_CHECKPOINT_TRUNCATE;
+#else
+const int checkpoint_shrink = SQLITE_CHECKPOINT_RESTART;
+#endif
+
+// Shared by the wal_hook of the connection and the checkpoint thread, stats and pending are
+// guarded by mutex. handle is the thread's own connection, used by no one else.
+struct wal_state {
+	wal_state(const open_options& options)
+		: policy(options.checkpoint_policy)
+		, pages(options.checkpoint_pages)
+		, restart_pages(options.checkpoint_restart_pages)
+		, truncate_pages(options.checkpoint_truncate_pages)
+		, handle(nullptr)
+		, stop(false)
+		, pending(0)
+		, next(options.checkpoint_pages)
+		, page_size(0)
+		, stats()
+		, last_log(0)
+		, last_done(0) {
+	}
+
+	~wal_state() {
+		if (thread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			wake.notify_one();
+			thread.join();
+		}
+		sqlite3_close_v2(handle);
+	}
+
+	const open_options::checkpoint_policy_type policy;
+	const long long pages;
+	const long long restart_pages;
+	const long long truncate_pages;
+	sqlite3* handle;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stop;
+	long long pending;
+	long long next;
+	long long page_size;
+	wal_stats stats;
+	long long last_log;
+	long long last_done;
+	std::thread thread;
+};
+
+// disk is used only under persist_mutex and needs no mutex of its own. memory is the connection of
+// the database, opened with SQLITE_OPEN_FULLMUTEX because the thread steps a backup from it while
+// the application runs.
+struct preload_state {
+	preload_state(const open_options& options)
+		: disk(nullptr)
+		, memory(nullptr)
+		, interval(options.persist_interval)
+		, pages(options.persist_pages)
+		, stop(false)
+		, persisted_writes(0)
+		, persisted_at(std::chrono::steady_clock::now())
+		, stats() {
+	}
+
+	~preload_state() {
+		if (thread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			wake.notify_one();
+			thread.join();
+		}
+		sqlite3_close_v2(disk);
+	}
+
+	sqlite3* disk;
+	sqlite3* memory;
+	const std::chrono::milliseconds interval;
+	const long long pages;
+	std::mutex persist_mutex;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stop;
+	long long persisted_writes;
+	std::chrono::steady_clock::time_point persisted_at;
+	persist_stats stats;
+	std::thread thread;
+};
+
+struct busy_state {
+	busy_state(const busy_policy& policy, unsigned seed)
+		: policy(policy)
+		, random(seed)
+		, events(0)
+		, retries(0)
+		, timeouts(0)
+		, waited(0) {
+	}
+
+	const busy_policy policy;
+	std::minstd_rand random;
+	std::chrono::steady_clock::time_point started;
+
+	// busy_status reads these while the handler runs on the thread of the connection
+	std::atomic<long long> events;
+	std::atomic<long long> retries;
+	std::atomic<long long> timeouts;
+	std::atomic<long long> waited;
+};
+
+struct cancel_state {
+	cancel_state()
+		: cancelled(false) {
+	}
+
+	std::atomic<bool> cancelled;
+	std::mutex mutex;
+	std::vector<sqlite3*> handles;
+};
+
+struct connection;
+
+struct limit_state {
+	connection* owner;
+	sqlite3* handle;
+	std::chrono::steady_clock::time_point deadline;
+	cancel_state* token;
+	int instructions;
+	limit_state* previous;
+};
+
+struct connection {
+	connection()
+		: handle(nullptr)
+		, last_metrics()
+		, traced(false)
+		, tracker(nullptr)
+		, clones()
+		, limit(nullptr) {
+	}
+
+	sqlite3* handle;
+	metrics last_metrics;
+	std::unique_ptr<slow_query_buffer> slow_log;
+	bool traced;
+	std::unique_ptr<statement_recorder> recorder;
+	statement_tracker* tracker;
+	mmap_state mmap;
+	std::unique_ptr<wal_state> wal;
+	std::unique_ptr<preload_state> preload;
+	std::mutex clone_mutex;
+	clone_stats clones;
+	std::unique_ptr<busy_state> busy;
+	limit_state* limit;
+};
+
+struct trace_event {
+	const char* name;
+	const void* database;
+	long long begin;
+	long long duration;
+	string sql;
+};
+
+inline unsigned long long os_thread_id() {
+#if defined(_WIN32)
+	return GetCurrentThreadId();
+#elif defined(__linux__)
+	return static_cast<unsigned long long>(syscall(SYS_gettid));
+#elif defined(__APPLE__)
+	std::uint64_t id = 0;
+	pthread_threadid_np(nullptr, &id);
+	return id;
+#else
+	return std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+}
+
+// Written only by the owning thread, entries below size are immutable and published with release.
+// Events live in blocks allocated as the buffer fills up. The owner starts over when it sees that
+// trace_clear advanced the generation, until then trace_json skips the buffer. Once the owner has
+// exited the buffer is freed by the next trace_clear (right away if its events were cleared).
+struct trace_buffer {
+	static const size_t block_size = 1 << 10;
+	static const size_t capacity = 1 << 16;
+
+	trace_buffer(unsigned long long tid, unsigned generation)
+		: tid(tid)
+		, exited(false)
+		, generation(generation)
+		, size(0)
+		, dropped(0) {
+		for (auto& block : blocks) {
+			block.store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	~trace_buffer() {
+		for (auto& block : blocks) {
+			delete[] block.load(std::memory_order_relaxed);
+		}
+	}
+
+	trace_event& event(size_t index) const {
+		return blocks[index / block_size].load(std::memory_order_acquire)[index % block_size];
+	}
+
+	const unsigned long long tid;
+	bool exited;
+	std::atomic<unsigned> generation;
+	std::atomic<size_t> size;
+	std::atomic<size_t> dropped;
+	std::atomic<trace_event*> blocks[capacity / block_size];
+};
+
+// Hands the buffer of a thread back to the tracer when the thread exits.
+struct trace_buffer_owner {
+	trace_buffer_owner()
+		: buffer(nullptr) {
+	}
+
+	~trace_buffer_owner();
+
+	trace_buffer* buffer;
+};
+
+struct tracer {
+	static const size_t max_traced = 64;
+
+	static tracer& instance();
+
+	static long long now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()
+			).count();
+	}
+
+	bool traced(const void* database) const {
+		if (active.load(std::memory_order_relaxed) != 0) {
+			for (size_t i = 0; i < max_traced; ++i) {
+				if (slots[i].load(std::memory_order_relaxed) == database) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	void start(sqlite3* database) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < max_traced; ++i) {
+			const void* expected = nullptr;
+			if (slots[i].compare_exchange_strong(expected, database)) {
+				++active;
+				return;
+			}
+		}
+		throw std::length_error("too many traced connections");
+	}
+
+	void stop(sqlite3* database) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < max_traced; ++i) {
+			const void* expected = database;
+			if (slots[i].compare_exchange_strong(expected, nullptr)) {
+				--active;
+				return;
+			}
+		}
+	}
+
+	trace_buffer* add_buffer() {
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers.emplace_back(new trace_buffer(os_thread_id(), generation.load(std::memory_order_relaxed)));
+		return buffers.back().get();
+	}
+
+	// Without thread_local destructors (VS2013) the buffers of exited threads are kept.
+	trace_buffer& local() {
+#if defined(_MSC_VER) && _MSC_VER < 1900
+		static SQLT3_THREAD_LOCAL trace_buffer* buffer = nullptr;
+		if (buffer == nullptr) {
+			buffer = add_buffer();
+		}
+		return *buffer;
+#else
+		static thread_local trace_buffer_owner owner;
+		if (owner.buffer == nullptr) {
+			owner.buffer = add_buffer();
+		}
+		return *owner.buffer;
+#endif
+	}
+
+	void release(trace_buffer* buffer) {
+		std::lock_guard<std::mutex> lock(mutex);
+		buffer->exited = true;
+		if (buffer->generation.load(std::memory_order_relaxed) != generation.load(std::memory_order_relaxed)) {
+			free_exited();
+		}
+	}
+
+	// Must hold mutex.
+	void free_exited() {
+		buffers.erase(
+			std::remove_if(buffers.begin(), buffers.end(), [&](const std::unique_ptr<trace_buffer>& buffer) {
+				return buffer->exited && buffer->generation.load(std::memory_order_relaxed) != generation.load(std::memory_order_relaxed);
+			}),
+			buffers.end()
+			);
+	}
+
+	void record(const char* name, const void* database, long long begin, long long duration, string sql) {
+		auto& buffer = local();
+		auto current = generation.load(std::memory_order_acquire);
+		if (buffer.generation.load(std::memory_order_relaxed) != current) {
+			buffer.size.store(0, std::memory_order_relaxed);
+			buffer.dropped.store(0, std::memory_order_relaxed);
+			buffer.generation.store(current, std::memory_order_release);
+		}
+		auto size = buffer.size.load(std::memory_order_relaxed);
+		if (size % trace_buffer::block_size == 0 && size < trace_buffer::capacity) {
+			auto& block = buffer.blocks[size / trace_buffer::block_size];
+			if (block.load(std::memory_order_relaxed) == nullptr) {
+				block.store(new trace_event[trace_buffer::block_size], std::memory_order_release);
+			}
+		}
+		if (size < trace_buffer::capacity) {
+			auto& event = buffer.event(size);
+			event.name = name;
+			event.database = database;
+			event.begin = begin;
+			event.duration = duration;
+			event.sql = std::move(sql);
+			buffer.size.store(size + 1, std::memory_order_release);
+		}
+		else {
+			buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	std::atomic<int> active;
+	std::atomic<const void*> slots[max_traced];
+	std::atomic<unsigned> generation;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<trace_buffer> > buffers;
+
+	tracer()
+		: active(0)
+		, generation(0) {
+		for (auto& slot : slots) {
+			slot.store(nullptr);
+		}
+	}
+};
+
+static tracer tracer_instance;
+
+tracer& tracer::instance() {
+	return tracer_instance;
+}
+
+trace_buffer_owner::~trace_buffer_owner() {
+	if (buffer) {
+		tracer_instance.release(buffer);
+	}
+}
+
+struct trace_span {
+	trace_span(const char* name, sqlite3* database, const char* sql_begin, const char* sql_end)
+		: name(name)
+		, database(database)
+		, begin(0) {
+		if (tracer::instance().traced(database)) {
+			sql.assign(sql_begin, sql_end);
+			begin = tracer::now();
+		}
+	}
+
+	trace_span(const char* name, sqlite3_stmt* statement)
+		: name(name)
+		, database(sqlite3_db_handle(statement))
+		, begin(0) {
+		if (tracer::instance().traced(database)) {
+			auto text = sqlite3_sql(statement);
+			sql = text ? text : "";
+			begin = tracer::now();
+		}
+	}
+
+	~trace_span() {
+		if (begin != 0) {
+			tracer::instance().record(name, database, begin, tracer::now() - begin, std::move(sql));
+		}
+	}
+
+	const char* const name;
+	const void* const database;
+	long long begin;
+	string sql;
+};
+
+inline void trace_callback(void* database, const char* sql) {
+	tracer::instance().record("trace", database, tracer::now(), 0, sql ? sql : "");
+}
+
+inline void profile_callback(void* database, const char* sql, sqlite3_uint64 duration) {
+	auto _duration = static_cast<long long>(duration);
+	tracer::instance().record("execute", database, tracer::now() - _duration, _duration, sql ? sql : "");
+}
+
 }
 
-inline sqlite3*& impl(database& database) {
-	return reinterpret_cast<sqlite3*&>(detail::impl::get(database));
+inline detail::connection*& conn(database& database) {
+	return reinterpret_cast<detail::connection*&>(detail::impl::get(database));
+}
+
+inline sqlite3* impl(database& database) {
+	return database ? conn(database)->handle : nullptr;
 }
 
 inline const sqlite3* impl(const database& database) {
-	return reinterpret_cast<const sqlite3*>(detail::impl::get(database));
+	auto connection = reinterpret_cast<const detail::connection*>(detail::impl::get(database));
+	return connection ? connection->handle : nullptr;
 }
 
 inline sqlite3_stmt*& impl(statement& statement) {
@@ -113,6 +728,19 @@ inline const sqlite3_stmt* impl(const statement& statement) {
 	return reinterpret_cast<const sqlite3_stmt*>(detail::impl::get(statement));
 }
 
+namespace detail {
+
+struct backup_state {
+	sqlite3_backup* handle;
+	sqlite3* destination;
+};
+
+}
+
+inline detail::backup_state*& state(backup& backup) {
+	return reinterpret_cast<detail::backup_state*&>(detail::impl::get(backup));
+}
+
 inline void throw_exception(sqlite3* database) {
 	detail::impl::throw_exception(sqlite3_extended_errcode(database), sqlite3_errmsg(database));
 }
@@ -121,111 +749,5501 @@ inline void throw_exception(database& database) {
 	throw_exception(impl(database));
 }
 
-inline void throw_exception(statement& statement) {
-	throw_exception(sqlite3_db_handle(impl(statement)));
+inline void throw_exception(statement& statement) {
+	throw_exception(sqlite3_db_handle(impl(statement)));
+}
+
+template <class T, class S> inline T safe_downcast(const S& s) {
+	if (s <= static_cast<S>(std::numeric_limits<T>::max())) {
+		return static_cast<T>(s);
+	}
+	else {
+		throw std::overflow_error(std::to_string(s));
+	}
+}
+
+const unsigned open_nomutex = SQLITE_OPEN_NOMUTEX;
+const unsigned open_fullmutex = SQLITE_OPEN_FULLMUTEX;
+const unsigned open_sharedcache = SQLITE_OPEN_SHAREDCACHE;
+const unsigned open_privatecache = SQLITE_OPEN_PRIVATECACHE;
+const unsigned open_uri = SQLITE_OPEN_URI;
+const unsigned open_readonly = SQLITE_OPEN_READONLY;
+const unsigned open_readwrite = SQLITE_OPEN_READWRITE;
+const unsigned open_create = SQLITE_OPEN_CREATE;
+
+const char* const uring_vfs = "sqlt3-uring";
+const char* const readahead_vfs = "sqlt3-readahead";
+const char* const accounting_vfs = "sqlt3-accounting";
+const char* const memory_vfs = "sqlt3-memory";
+const char* const compress_vfs = "sqlt3-compress";
+const char* const direct_vfs = "sqlt3-direct";
+
+namespace detail {
+
+struct pool_allocator {
+	static const size_t max_classes = 64;
+	static const size_t no_class = ~size_t(0);
+	static const size_t refill_count = 16;
+	static const long long account_batch = 64 * 1024;
+
+	// 16 bytes, keeps the 8 byte alignment SQLite requires
+	struct header {
+		std::uint64_t size;
+		std::uint64_t size_class;
+	};
+
+	struct free_block {
+		free_block* next;
+	};
+
+	struct global_list {
+		global_list()
+			: head(nullptr) {
+		}
+
+		std::mutex mutex;
+		free_block* head;
+	};
+
+	struct thread_cache {
+		thread_cache()
+			: bytes(0)
+			, pending(0) {
+			std::fill(heads, heads + max_classes, nullptr);
+		}
+
+		~thread_cache();
+
+		free_block* heads[max_classes];
+		size_t bytes;
+		long long pending;
+	};
+
+	pool_allocator()
+		: num_classes(0)
+		, thread_cache_size(0)
+		, in_use(0)
+		, peak(0)
+		, system_allocations(0) {
+	}
+
+	void configure(const allocator_options& options) {
+		// quarter steps between powers of two bound the rounding waste to 25%
+		num_classes = 0;
+		auto limit = std::max<size_t>(options.max_pooled_size, 16);
+		for (size_t power = 16; power <= limit && num_classes < max_classes; power *= 2) {
+			for (size_t quarter = 0; quarter < 4 && num_classes < max_classes; ++quarter) {
+				auto size = power + power / 4 * quarter;
+				if (size <= limit) {
+					class_sizes[num_classes++] = size;
+				}
+			}
+		}
+		thread_cache_size = options.thread_cache_size;
+	}
+
+	size_t size_class(size_t size) const {
+		auto itr = std::lower_bound(class_sizes, class_sizes + num_classes, size);
+		return itr != class_sizes + num_classes ? itr - class_sizes : no_class;
+	}
+
+	static thread_cache* local_cache();
+
+	// Threads publish their in_use changes in batches so the shared counter does not bounce between cores.
+	void account(thread_cache* cache, long long delta) {
+		if (cache) {
+			cache->pending += delta;
+			if (cache->pending > -account_batch && cache->pending < account_batch) {
+				return;
+			}
+			delta = cache->pending;
+			cache->pending = 0;
+		}
+		auto current = in_use.fetch_add(delta, std::memory_order_relaxed) + delta;
+		auto highest = peak.load(std::memory_order_relaxed);
+		while (current > highest && !peak.compare_exchange_weak(highest, current, std::memory_order_relaxed)) {
+		}
+	}
+
+	header* system_allocate(size_t size, size_t size_class) {
+		++system_allocations;
+		auto result = static_cast<header*>(std::malloc(sizeof(header) + size));
+		if (result) {
+			result->size = size;
+			result->size_class = size_class;
+		}
+		return result;
+	}
+
+	header* allocate(size_t size) {
+		auto index = size_class(size);
+		auto cache = local_cache();
+		header* result = nullptr;
+
+		if (index == no_class) {
+			result = system_allocate(size, no_class);
+		}
+		else {
+			if (cache && cache->heads[index] == nullptr) {
+				refill(*cache, index);
+			}
+			if (cache && cache->heads[index] != nullptr) {
+				auto block = cache->heads[index];
+				cache->heads[index] = block->next;
+				cache->bytes -= class_sizes[index];
+				result = reinterpret_cast<header*>(block);
+			}
+			else if (cache == nullptr) {
+				std::lock_guard<std::mutex> lock(globals[index].mutex);
+				if (auto block = globals[index].head) {
+					globals[index].head = block->next;
+					result = reinterpret_cast<header*>(block);
+				}
+			}
+			if (result) {
+				result->size = class_sizes[index];
+				result->size_class = index;
+			}
+			else {
+				result = system_allocate(class_sizes[index], index);
+			}
+		}
+
+		if (result) {
+			account(cache, static_cast<long long>(result->size));
+		}
+		return result;
+	}
+
+	void deallocate(header* block) {
+		auto cache = local_cache();
+		account(cache, -static_cast<long long>(block->size));
+
+		auto index = static_cast<size_t>(block->size_class);
+		if (index == no_class) {
+			std::free(block);
+			return;
+		}
+
+		auto free = reinterpret_cast<free_block*>(block);
+		if (cache) {
+			free->next = cache->heads[index];
+			cache->heads[index] = free;
+			cache->bytes += class_sizes[index];
+			if (cache->bytes > thread_cache_size) {
+				release(*cache, index);
+			}
+		}
+		else {
+			std::lock_guard<std::mutex> lock(globals[index].mutex);
+			free->next = globals[index].head;
+			globals[index].head = free;
+		}
+	}
+
+	void refill(thread_cache& cache, size_t index) {
+		std::lock_guard<std::mutex> lock(globals[index].mutex);
+		for (size_t i = 0; i < refill_count && globals[index].head; ++i) {
+			auto block = globals[index].head;
+			globals[index].head = block->next;
+			block->next = cache.heads[index];
+			cache.heads[index] = block;
+			cache.bytes += class_sizes[index];
+		}
+	}
+
+	// Returns the whole free list of one class to the global pool.
+	void release(thread_cache& cache, size_t index) {
+		auto head = cache.heads[index];
+		if (head == nullptr) {
+			return;
+		}
+		auto tail = head;
+		size_t count = 1;
+		while (tail->next) {
+			tail = tail->next;
+			++count;
+		}
+		cache.heads[index] = nullptr;
+		cache.bytes -= count * class_sizes[index];
+
+		std::lock_guard<std::mutex> lock(globals[index].mutex);
+		tail->next = globals[index].head;
+		globals[index].head = head;
+	}
+
+	void shrink() {
+		for (size_t i = 0; i < num_classes; ++i) {
+			std::lock_guard<std::mutex> lock(globals[i].mutex);
+			while (auto block = globals[i].head) {
+				globals[i].head = block->next;
+				std::free(block);
+			}
+		}
+	}
+
+	static void* xMalloc(int size);
+	static void xFree(void* pointer);
+	static void* xRealloc(void* pointer, int size);
+	static int xSize(void* pointer);
+	static int xRoundup(int size);
+	static int xInit(void*);
+	static void xShutdown(void*);
+
+	size_t class_sizes[max_classes];
+	size_t num_classes;
+	size_t thread_cache_size;
+	global_list globals[max_classes];
+	std::atomic<long long> in_use;
+	std::atomic<long long> peak;
+	std::atomic<long long> system_allocations;
+};
+
+static pool_allocator allocator_instance;
+
+pool_allocator::thread_cache::~thread_cache() {
+	allocator_instance.account(nullptr, pending);
+	for (size_t i = 0; i < allocator_instance.num_classes; ++i) {
+		allocator_instance.release(*this, i);
+	}
+}
+
+// VS2013 has no thread_local with destructors, there every block goes through the global pool.
+pool_allocator::thread_cache* pool_allocator::local_cache() {
+#if defined(_MSC_VER) && _MSC_VER < 1900
+	return nullptr;
+#else
+	static thread_local thread_cache cache;
+	return &cache;
+#endif
+}
+
+void* pool_allocator::xMalloc(int size) {
+	auto block = allocator_instance.allocate(static_cast<size_t>(size));
+	return block ? block + 1 : nullptr;
+}
+
+void pool_allocator::xFree(void* pointer) {
+	if (pointer) {
+		allocator_instance.deallocate(static_cast<header*>(pointer) - 1);
+	}
+}
+
+void* pool_allocator::xRealloc(void* pointer, int size) {
+	auto block = static_cast<header*>(pointer) - 1;
+	if (static_cast<size_t>(size) <= block->size && allocator_instance.size_class(size) == block->size_class) {
+		return pointer;
+	}
+	auto result = xMalloc(size);
+	if (result) {
+		std::memcpy(result, pointer, std::min<size_t>(block->size, static_cast<size_t>(size)));
+		xFree(pointer);
+	}
+	return result;
+}
+
+int pool_allocator::xSize(void* pointer) {
+	return pointer ? static_cast<int>((static_cast<header*>(pointer) - 1)->size) : 0;
+}
+
+int pool_allocator::xRoundup(int size) {
+	auto index = allocator_instance.size_class(static_cast<size_t>(size));
+	return index != no_class ? static_cast<int>(allocator_instance.class_sizes[index]) : (size + 7) & ~7;
+}
+
+int pool_allocator::xInit(void*) {
+	return SQLITE_OK;
+}
+
+void pool_allocator::xShutdown(void*) {
+	allocator_instance.shrink();
+}
+
+}
+
+void configure_allocator(const allocator_options& options) {
+	static sqlite3_mem_methods methods = {
+		&detail::pool_allocator::xMalloc,
+		&detail::pool_allocator::xFree,
+		&detail::pool_allocator::xRealloc,
+		&detail::pool_allocator::xSize,
+		&detail::pool_allocator::xRoundup,
+		&detail::pool_allocator::xInit,
+		&detail::pool_allocator::xShutdown,
+		nullptr
+	};
+
+	detail::allocator_instance.configure(options);
+	auto result = sqlite3_config(SQLITE_CONFIG_MALLOC, &methods);
+	if (result != SQLITE_OK) {
+		detail::impl::throw_exception(result, "configure_allocator must be called before the first open");
+	}
+}
+
+namespace detail {
+
+// Buffers given to SQLite are never freed, it may still allocate from them during static
+// destruction. Only those of a configuration SQLite refused are released.
+struct reserved_memory {
+	void* reserve(size_t size) {
+		auto result = std::malloc(size);
+		if (result == nullptr) {
+			throw std::bad_alloc();
+		}
+		try {
+			buffers.push_back(result);
+		}
+		catch (...) {
+			std::free(result);
+			throw;
+		}
+		return result;
+	}
+
+	void release(size_t mark) {
+		for (auto i = mark; i < buffers.size(); ++i) {
+			std::free(buffers[i]);
+		}
+		buffers.resize(mark);
+	}
+
+	std::vector<void*> buffers;
+};
+
+static reserved_memory reserved_memory_instance;
+
+inline bool is_aligned(const void* buffer) {
+	return reinterpret_cast<std::uintptr_t>(buffer) % 8 == 0;
+}
+
+inline bool is_power_of_two(size_t value) {
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+inline void config(int result, const char* message) {
+	if (result != SQLITE_OK) {
+		impl::throw_exception(result, message);
+	}
+}
+
+// Slot limits of SQLITE_CONFIG_LOOKASIDE and SQLITE_DBCONFIG_LOOKASIDE.
+inline void check_lookaside(size_t size, size_t count) {
+	if (count != 0) {
+		if (size < 8 || size % 8 != 0 || size > 65528) {
+			throw std::invalid_argument("lookaside_size");
+		}
+		if (count > static_cast<size_t>(std::numeric_limits<int>::max()) / size) {
+			throw std::invalid_argument("lookaside_count");
+		}
+	}
+}
+
+}
+
+void configure_memory(const memory_options& options) {
+	const size_t max_int = static_cast<size_t>(std::numeric_limits<int>::max());
+
+	if (options.heap_size != 0) {
+		if (options.heap_size > max_int || options.heap_size < 64 * 1024) {
+			throw std::invalid_argument("heap_size");
+		}
+		if (!detail::is_power_of_two(options.min_allocation) || options.min_allocation > options.heap_size) {
+			throw std::invalid_argument("min_allocation");
+		}
+		if (!detail::is_aligned(options.heap)) {
+			throw std::invalid_argument("heap");
+		}
+	}
+
+	// the slot holds a page (power of two from 512 to 65536) plus the page header
+	if (options.page_count != 0) {
+		if (options.page_size < 512 + 40 || options.page_size > 65536 + 1024 || options.page_size % 8 != 0) {
+			throw std::invalid_argument("page_size");
+		}
+		if (options.page_count > max_int / options.page_size) {
+			throw std::invalid_argument("page_count");
+		}
+		if (!detail::is_aligned(options.pagecache)) {
+			throw std::invalid_argument("pagecache");
+		}
+	}
+
+	if (options.scratch_count != 0) {
+		if (options.scratch_size == 0 || options.scratch_size % 8 != 0 || options.scratch_count > max_int / options.scratch_size) {
+			throw std::invalid_argument("scratch_size");
+		}
+		if (!detail::is_aligned(options.scratch)) {
+			throw std::invalid_argument("scratch");
+		}
+	}
+
+	detail::check_lookaside(options.lookaside_size, options.lookaside_count);
+
+	// everything is reserved before the first section is configured, and the sections configured
+	// before one SQLite refuses are undone, so a failed call changes nothing
+	auto& reserved = detail::reserved_memory_instance;
+	auto mark = reserved.buffers.size();
+	void* heap = options.heap;
+	void* pagecache = options.pagecache;
+	void* scratch = options.scratch;
+	try {
+		if (options.heap_size != 0 && heap == nullptr) {
+			heap = reserved.reserve(options.heap_size);
+		}
+		if (options.page_count != 0 && pagecache == nullptr) {
+			pagecache = reserved.reserve(options.page_size * options.page_count);
+		}
+		if (options.scratch_count != 0 && scratch == nullptr) {
+			scratch = reserved.reserve(options.scratch_size * options.scratch_count);
+		}
+	}
+	catch (...) {
+		reserved.release(mark);
+		throw;
+	}
+
+	auto result = SQLITE_OK;
+	const char* section = nullptr;
+	int applied[3];
+	size_t num_applied = 0;
+	if (options.heap_size != 0) {
+		section = "SQLITE_CONFIG_HEAP";
+		result = sqlite3_config(SQLITE_CONFIG_HEAP, heap, static_cast<int>(options.heap_size), static_cast<int>(options.min_allocation));
+		if (result == SQLITE_OK) {
+			applied[num_applied++] = SQLITE_CONFIG_HEAP;
+		}
+	}
+	if (result == SQLITE_OK && options.page_count != 0) {
+		section = "SQLITE_CONFIG_PAGECACHE";
+		result = sqlite3_config(SQLITE_CONFIG_PAGECACHE, pagecache, static_cast<int>(options.page_size), static_cast<int>(options.page_count));
+		if (result == SQLITE_OK) {
+			applied[num_applied++] = SQLITE_CONFIG_PAGECACHE;
+		}
+	}
+	if (result == SQLITE_OK && options.scratch_count != 0) {
+		section = "SQLITE_CONFIG_SCRATCH";
+		result = sqlite3_config(SQLITE_CONFIG_SCRATCH, scratch, static_cast<int>(options.scratch_size), static_cast<int>(options.scratch_count));
+		if (result == SQLITE_OK) {
+			applied[num_applied++] = SQLITE_CONFIG_SCRATCH;
+		}
+	}
+	if (result == SQLITE_OK && options.lookaside_count != 0) {
+		section = "SQLITE_CONFIG_LOOKASIDE";
+		result = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, static_cast<int>(options.lookaside_size), static_cast<int>(options.lookaside_count));
+	}
+	if (result != SQLITE_OK) {
+		while (num_applied != 0) {
+			sqlite3_config(applied[--num_applied], nullptr, 0, 0);
+		}
+		reserved.release(mark);
+		detail::config(result, section);
+	}
+}
+
+memory_report memory_status(bool reset_highwater) {
+	auto get = [=](int op) {
+		int current = 0, highwater = 0;
+		detail::config(sqlite3_status(op, &current, &highwater, reset_highwater ? 1 : 0), "sqlite3_status");
+		status_value result = { current, highwater };
+		return result;
+	};
+
+	memory_report result;
+	result.memory_used = get(SQLITE_STATUS_MEMORY_USED);
+	result.malloc_size = get(SQLITE_STATUS_MALLOC_SIZE);
+	result.malloc_count = get(SQLITE_STATUS_MALLOC_COUNT);
+	result.pagecache_used = get(SQLITE_STATUS_PAGECACHE_USED);
+	result.pagecache_overflow = get(SQLITE_STATUS_PAGECACHE_OVERFLOW);
+	result.pagecache_size = get(SQLITE_STATUS_PAGECACHE_SIZE);
+	result.scratch_used = get(SQLITE_STATUS_SCRATCH_USED);
+	result.scratch_overflow = get(SQLITE_STATUS_SCRATCH_OVERFLOW);
+	result.scratch_size = get(SQLITE_STATUS_SCRATCH_SIZE);
+	return result;
+}
+
+namespace detail {
+
+// Frame word: generation << 2 | state. Every time a frame leaves its owner the generation is
+// bumped, so a cache validates its entries with a single compare and swap and never has to be
+// told about evictions that happened on other threads.
+struct page_frame {
+	enum state {
+		frame_free = 0,
+		frame_pinned = 1,
+		frame_unpinned = 2
+	};
+
+	static std::uint64_t word(std::uint64_t generation, state state) {
+		return generation << 2 | state;
+	}
+
+	sqlite3_pcache_page page;
+	std::atomic<std::uint64_t> state_word;
+	std::atomic<bool> referenced;
+	bool pooled;
+	unsigned key;
+};
+
+struct page_entry {
+	page_frame* frame;
+	std::uint64_t generation;
+};
+
+struct page_pool {
+	page_pool()
+		: frames(nullptr)
+		, stride(0)
+		, frame_size(0)
+		, count(0)
+		, hand(0)
+		, hits(0)
+		, misses(0)
+		, evictions(0)
+		, private_pages(0) {
+	}
+
+	page_frame* frame(size_t index) const {
+		return reinterpret_cast<page_frame*>(frames + index * stride);
+	}
+
+	void configure(const page_cache_options& options) {
+		if (options.page_count == 0) {
+			throw std::invalid_argument("page_count");
+		}
+		if (options.frame_size < 512) {
+			throw std::invalid_argument("frame_size");
+		}
+		frame_size = (options.frame_size + 7) & ~size_t(7);
+		stride = (sizeof(page_frame) + 7) / 8 * 8 + frame_size;
+		count = options.page_count;
+		frames = static_cast<char*>(std::malloc(stride * count));
+		if (frames == nullptr) {
+			throw std::bad_alloc();
+		}
+		for (size_t i = 0; i < count; ++i) {
+			auto frame = new (this->frame(i)) page_frame();
+			frame->state_word.store(page_frame::word(0, page_frame::frame_free));
+			frame->referenced.store(false);
+			frame->pooled = true;
+		}
+	}
+
+	// CLOCK sweep, at most two turns so every referenced bit gets a second chance.
+	page_frame* claim(std::uint64_t& generation) {
+		for (size_t i = 0; i < 2 * count; ++i) {
+			auto frame = this->frame(hand.fetch_add(1, std::memory_order_relaxed) % count);
+			auto current = frame->state_word.load(std::memory_order_acquire);
+			auto current_generation = current >> 2;
+
+			switch (current & 3) {
+			case page_frame::frame_free:
+				if (frame->state_word.compare_exchange_strong(current, page_frame::word(current_generation, page_frame::frame_pinned))) {
+					generation = current_generation;
+					return frame;
+				}
+				break;
+			case page_frame::frame_unpinned:
+				if (frame->referenced.exchange(false, std::memory_order_relaxed)) {
+					break;
+				}
+				if (frame->state_word.compare_exchange_strong(current, page_frame::word(current_generation + 1, page_frame::frame_pinned))) {
+					evictions.fetch_add(1, std::memory_order_relaxed);
+					generation = current_generation + 1;
+					return frame;
+				}
+				break;
+			}
+		}
+		return nullptr;
+	}
+
+	char* frames;
+	size_t stride;
+	size_t frame_size;
+	size_t count;
+	std::atomic<size_t> hand;
+	std::atomic<long long> hits;
+	std::atomic<long long> misses;
+	std::atomic<long long> evictions;
+	std::atomic<long long> private_pages;
+};
+
+static page_pool page_pool_instance;
+
+// One instance per pager, SQLite never uses it from two threads at once.
+struct shared_page_cache {
+	static const long long fold_interval = 1024;
+
+	shared_page_cache(int page_size, int extra_size, bool purgeable)
+		: page_size(page_size)
+		, extra_size(extra_size)
+		, purgeable(purgeable)
+		, pooled(purgeable && static_cast<size_t>(page_size + extra_size) <= page_pool_instance.frame_size)
+		, max_private(100)
+		, num_private(0)
+		, hits(0)
+		, misses(0) {
+	}
+
+	~shared_page_cache() {
+		truncate(0);
+		fold();
+	}
+
+	void fold() {
+		page_pool_instance.hits.fetch_add(hits, std::memory_order_relaxed);
+		page_pool_instance.misses.fetch_add(misses, std::memory_order_relaxed);
+		hits = misses = 0;
+	}
+
+	void count(long long& counter) {
+		if (++counter == fold_interval) {
+			fold();
+		}
+	}
+
+	page_frame* private_frame() {
+		auto frame = static_cast<page_frame*>(std::malloc((sizeof(page_frame) + 7) / 8 * 8 + page_size + extra_size));
+		if (frame) {
+			new (frame) page_frame();
+			frame->state_word.store(page_frame::word(0, page_frame::frame_pinned));
+			frame->referenced.store(false);
+			frame->pooled = false;
+			++num_private;
+			page_pool_instance.private_pages.fetch_add(1, std::memory_order_relaxed);
+		}
+		return frame;
+	}
+
+	void release(const page_entry& entry) {
+		auto frame = entry.frame;
+		if (!frame->pooled) {
+			frame->~page_frame();
+			std::free(frame);
+			--num_private;
+			page_pool_instance.private_pages.fetch_sub(1, std::memory_order_relaxed);
+			return;
+		}
+		auto free = page_frame::word(entry.generation + 1, page_frame::frame_free);
+		auto pinned = page_frame::word(entry.generation, page_frame::frame_pinned);
+		auto unpinned = page_frame::word(entry.generation, page_frame::frame_unpinned);
+		// a failed exchange means the frame was already evicted by another cache
+		if (!frame->state_word.compare_exchange_strong(pinned, free)) {
+			frame->state_word.compare_exchange_strong(unpinned, free);
+		}
+	}
+
+	sqlite3_pcache_page* fetch(unsigned key, int create) {
+		auto itr = pages.find(key);
+		if (itr != pages.end()) {
+			auto& entry = itr->second;
+			auto frame = entry.frame;
+			if (!frame->pooled) {
+				count(hits);
+				return &frame->page;
+			}
+			auto pinned = page_frame::word(entry.generation, page_frame::frame_pinned);
+			auto unpinned = page_frame::word(entry.generation, page_frame::frame_unpinned);
+			if (frame->state_word.load(std::memory_order_acquire) == pinned
+				|| frame->state_word.compare_exchange_strong(unpinned, pinned, std::memory_order_acquire)) {
+				count(hits);
+				return &frame->page;
+			}
+			pages.erase(itr);
+		}
+
+		count(misses);
+		if (create == 0) {
+			return nullptr;
+		}
+
+		page_entry entry = { nullptr, 0 };
+		if (pooled) {
+			entry.frame = page_pool_instance.claim(entry.generation);
+			if (entry.frame == nullptr && create == 1) {
+				return nullptr;
+			}
+		}
+		if (entry.frame == nullptr) {
+			entry.frame = private_frame();
+			if (entry.frame == nullptr) {
+				return nullptr;
+			}
+		}
+
+		auto data = reinterpret_cast<char*>(entry.frame) + (sizeof(page_frame) + 7) / 8 * 8;
+		entry.frame->page.pBuf = data;
+		entry.frame->page.pExtra = data + page_size;
+		entry.frame->key = key;
+		entry.frame->referenced.store(true, std::memory_order_relaxed);
+		std::memset(entry.frame->page.pExtra, 0, extra_size);
+		pages[key] = entry;
+		return &entry.frame->page;
+	}
+
+	void unpin(sqlite3_pcache_page* page, bool discard) {
+		auto frame = reinterpret_cast<page_frame*>(page);
+		auto itr = pages.find(frame->key);
+		if (itr == pages.end()) {
+			return;
+		}
+		// private pages of purgeable caches are bounded by cache_size since the pool cannot evict them
+		if (discard || (!frame->pooled && purgeable && num_private > max_private)) {
+			release(itr->second);
+			pages.erase(itr);
+		}
+		else if (frame->pooled) {
+			frame->referenced.store(true, std::memory_order_relaxed);
+			frame->state_word.store(page_frame::word(itr->second.generation, page_frame::frame_unpinned), std::memory_order_release);
+		}
+	}
+
+	void rekey(sqlite3_pcache_page* page, unsigned old_key, unsigned new_key) {
+		auto itr = pages.find(old_key);
+		if (itr == pages.end()) {
+			return;
+		}
+		auto entry = itr->second;
+		pages.erase(itr);
+
+		auto existing = pages.find(new_key);
+		if (existing != pages.end()) {
+			release(existing->second);
+			pages.erase(existing);
+		}
+		reinterpret_cast<page_frame*>(page)->key = new_key;
+		pages[new_key] = entry;
+	}
+
+	void truncate(unsigned limit) {
+		for (auto itr = pages.begin(); itr != pages.end();) {
+			if (itr->first >= limit) {
+				release(itr->second);
+				itr = pages.erase(itr);
+			}
+			else {
+				++itr;
+			}
+		}
+	}
+
+	// Entries whose frame another cache evicted are only noticed on fetch, they are dropped here
+	// so SQLite is told about live pages only.
+	int pagecount() {
+		for (auto itr = pages.begin(); itr != pages.end();) {
+			auto frame = itr->second.frame;
+			if (frame->pooled && frame->state_word.load(std::memory_order_acquire) >> 2 != itr->second.generation) {
+				itr = pages.erase(itr);
+			}
+			else {
+				++itr;
+			}
+		}
+		return static_cast<int>(pages.size());
+	}
+
+	void shrink() {
+		for (auto itr = pages.begin(); itr != pages.end();) {
+			auto unpinned = page_frame::word(itr->second.generation, page_frame::frame_unpinned);
+			auto free = page_frame::word(itr->second.generation + 1, page_frame::frame_free);
+			if (itr->second.frame->pooled && itr->second.frame->state_word.compare_exchange_strong(unpinned, free)) {
+				itr = pages.erase(itr);
+			}
+			else {
+				++itr;
+			}
+		}
+	}
+
+	static int xInit(void*) {
+		return SQLITE_OK;
+	}
+
+	static void xShutdown(void*) {
+	}
+
+	static sqlite3_pcache* xCreate(int page_size, int extra_size, int purgeable) {
+		return reinterpret_cast<sqlite3_pcache*>(new (std::nothrow) shared_page_cache(page_size, extra_size, purgeable != 0));
+	}
+
+	static void xCachesize(sqlite3_pcache* cache, int size) {
+		reinterpret_cast<shared_page_cache*>(cache)->max_private = size > 0 ? size : 0;
+	}
+
+	static int xPagecount(sqlite3_pcache* cache) {
+		return reinterpret_cast<shared_page_cache*>(cache)->pagecount();
+	}
+
+	static sqlite3_pcache_page* xFetch(sqlite3_pcache* cache, unsigned key, int create) {
+		return reinterpret_cast<shared_page_cache*>(cache)->fetch(key, create);
+	}
+
+	static void xUnpin(sqlite3_pcache* cache, sqlite3_pcache_page* page, int discard) {
+		reinterpret_cast<shared_page_cache*>(cache)->unpin(page, discard != 0);
+	}
+
+	static void xRekey(sqlite3_pcache* cache, sqlite3_pcache_page* page, unsigned old_key, unsigned new_key) {
+		reinterpret_cast<shared_page_cache*>(cache)->rekey(page, old_key, new_key);
+	}
+
+	static void xTruncate(sqlite3_pcache* cache, unsigned limit) {
+		reinterpret_cast<shared_page_cache*>(cache)->truncate(limit);
+	}
+
+	static void xDestroy(sqlite3_pcache* cache) {
+		delete reinterpret_cast<shared_page_cache*>(cache);
+	}
+
+	static void xShrink(sqlite3_pcache* cache) {
+		reinterpret_cast<shared_page_cache*>(cache)->shrink();
+	}
+
+	const int page_size;
+	const int extra_size;
+	const bool purgeable;
+	const bool pooled;
+	int max_private;
+	int num_private;
+	std::unordered_map<unsigned, page_entry> pages;
+	long long hits;
+	long long misses;
+};
+
+}
+
+void configure_page_cache(const page_cache_options& options) {
+	static sqlite3_pcache_methods2 methods = {
+		1,
+		nullptr,
+		&detail::shared_page_cache::xInit,
+		&detail::shared_page_cache::xShutdown,
+		&detail::shared_page_cache::xCreate,
+		&detail::shared_page_cache::xCachesize,
+		&detail::shared_page_cache::xPagecount,
+		&detail::shared_page_cache::xFetch,
+		&detail::shared_page_cache::xUnpin,
+		&detail::shared_page_cache::xRekey,
+		&detail::shared_page_cache::xTruncate,
+		&detail::shared_page_cache::xDestroy,
+		&detail::shared_page_cache::xShrink
+	};
+
+	if (detail::page_pool_instance.frames != nullptr) {
+		throw std::logic_error("configure_page_cache");
+	}
+	detail::page_pool_instance.configure(options);
+	auto result = sqlite3_config(SQLITE_CONFIG_PCACHE2, &methods);
+	if (result != SQLITE_OK) {
+		std::free(detail::page_pool_instance.frames);
+		detail::page_pool_instance.frames = nullptr;
+		detail::impl::throw_exception(result, "configure_page_cache must be called before the first open");
+	}
+}
+
+page_cache_stats page_cache_status() {
+	auto& pool = detail::page_pool_instance;
+	page_cache_stats result;
+	result.hits = pool.hits.load();
+	result.misses = pool.misses.load();
+	result.evictions = pool.evictions.load();
+	result.private_pages = pool.private_pages.load();
+	result.frames = static_cast<long long>(pool.count);
+	result.frames_in_use = 0;
+	for (size_t i = 0; i < pool.count; ++i) {
+		if ((pool.frame(i)->state_word.load(std::memory_order_relaxed) & 3) != detail::page_frame::frame_free) {
+			++result.frames_in_use;
+		}
+	}
+	return result;
+}
+
+allocator_stats allocator_status() {
+	allocator_stats result;
+	result.in_use = detail::allocator_instance.in_use.load();
+	result.peak = detail::allocator_instance.peak.load();
+	result.system_allocations = detail::allocator_instance.system_allocations.load();
+	return result;
+}
+
+namespace detail {
+
+// A shim VFS forwards every call to the VFS it wraps (pAppData). Each shim file starts with a
+// shim_file and is followed in memory by the file of the wrapped VFS, shims replace the methods
+// they implement and forward the rest.
+struct shim_file {
+	sqlite3_file file;
+	sqlite3_file* real;
+};
+
+struct shim {
+	typedef void (*symbol)(void);
+	typedef int (*open_function)(sqlite3_vfs*, const char*, sqlite3_file*, int, int*);
+
+	static sqlite3_file* real(sqlite3_file* file) {
+		return reinterpret_cast<shim_file*>(file)->real;
+	}
+
+	static sqlite3_vfs* real(sqlite3_vfs* vfs) {
+		return static_cast<sqlite3_vfs*>(vfs->pAppData);
+	}
+
+	static int xClose(sqlite3_file* file) {
+		auto real = shim::real(file);
+		return real->pMethods ? real->pMethods->xClose(real) : SQLITE_OK;
+	}
+
+	static int xRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+		auto real = shim::real(file);
+		return real->pMethods->xRead(real, buffer, amount, offset);
+	}
+
+	static int xWrite(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset) {
+		auto real = shim::real(file);
+		return real->pMethods->xWrite(real, buffer, amount, offset);
+	}
+
+	static int xTruncate(sqlite3_file* file, sqlite3_int64 size) {
+		auto real = shim::real(file);
+		return real->pMethods->xTruncate(real, size);
+	}
+
+	static int xSync(sqlite3_file* file, int flags) {
+		auto real = shim::real(file);
+		return real->pMethods->xSync(real, flags);
+	}
+
+	static int xFileSize(sqlite3_file* file, sqlite3_int64* size) {
+		auto real = shim::real(file);
+		return real->pMethods->xFileSize(real, size);
+	}
+
+	static int xLock(sqlite3_file* file, int lock) {
+		auto real = shim::real(file);
+		return real->pMethods->xLock(real, lock);
+	}
+
+	static int xUnlock(sqlite3_file* file, int lock) {
+		auto real = shim::real(file);
+		return real->pMethods->xUnlock(real, lock);
+	}
+
+	static int xCheckReservedLock(sqlite3_file* file, int* result) {
+		auto real = shim::real(file);
+		return real->pMethods->xCheckReservedLock(real, result);
+	}
+
+	static int xFileControl(sqlite3_file* file, int op, void* argument) {
+		auto real = shim::real(file);
+		return real->pMethods->xFileControl(real, op, argument);
+	}
+
+	static int xSectorSize(sqlite3_file* file) {
+		auto real = shim::real(file);
+		return real->pMethods->xSectorSize(real);
+	}
+
+	static int xDeviceCharacteristics(sqlite3_file* file) {
+		auto real = shim::real(file);
+		return real->pMethods->xDeviceCharacteristics(real);
+	}
+
+	static int xShmMap(sqlite3_file* file, int region, int size, int extend, void volatile** memory) {
+		auto real = shim::real(file);
+		return real->pMethods->xShmMap(real, region, size, extend, memory);
+	}
+
+	static int xShmLock(sqlite3_file* file, int offset, int count, int flags) {
+		auto real = shim::real(file);
+		return real->pMethods->xShmLock(real, offset, count, flags);
+	}
+
+	static void xShmBarrier(sqlite3_file* file) {
+		auto real = shim::real(file);
+		real->pMethods->xShmBarrier(real);
+	}
+
+	static int xShmUnmap(sqlite3_file* file, int remove) {
+		auto real = shim::real(file);
+		return real->pMethods->xShmUnmap(real, remove);
+	}
+
+	static int xFetch(sqlite3_file* file, sqlite3_int64 offset, int amount, void** pointer) {
+		auto real = shim::real(file);
+		if (real->pMethods->iVersion < 3) {
+			*pointer = nullptr;
+			return SQLITE_OK;
+		}
+		return real->pMethods->xFetch(real, offset, amount, pointer);
+	}
+
+	static int xUnfetch(sqlite3_file* file, sqlite3_int64 offset, void* pointer) {
+		auto real = shim::real(file);
+		return real->pMethods->iVersion < 3 ? SQLITE_OK : real->pMethods->xUnfetch(real, offset, pointer);
+	}
+
+	// methods[i] has iVersion i + 1, the file gets the version of the file it wraps
+	static void io_methods(sqlite3_io_methods (&methods)[3]) {
+		for (int i = 0; i < 3; ++i) {
+			auto& m = methods[i];
+			m.iVersion = i + 1;
+			m.xClose = &xClose;
+			m.xRead = &xRead;
+			m.xWrite = &xWrite;
+			m.xTruncate = &xTruncate;
+			m.xSync = &xSync;
+			m.xFileSize = &xFileSize;
+			m.xLock = &xLock;
+			m.xUnlock = &xUnlock;
+			m.xCheckReservedLock = &xCheckReservedLock;
+			m.xFileControl = &xFileControl;
+			m.xSectorSize = &xSectorSize;
+			m.xDeviceCharacteristics = &xDeviceCharacteristics;
+			m.xShmMap = i >= 1 ? &xShmMap : nullptr;
+			m.xShmLock = i >= 1 ? &xShmLock : nullptr;
+			m.xShmBarrier = i >= 1 ? &xShmBarrier : nullptr;
+			m.xShmUnmap = i >= 1 ? &xShmUnmap : nullptr;
+			m.xFetch = i >= 2 ? &xFetch : nullptr;
+			m.xUnfetch = i >= 2 ? &xUnfetch : nullptr;
+		}
+	}
+
+	// Opens the wrapped file behind the shim file of file_size bytes, pMethods is set whenever the
+	// wrapped file needs an xClose, even if the open failed.
+	static int open(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out_flags, size_t file_size, const sqlite3_io_methods (&methods)[3]) {
+		auto shim_file = reinterpret_cast<detail::shim_file*>(file);
+		shim_file->file.pMethods = nullptr;
+		shim_file->real = reinterpret_cast<sqlite3_file*>(reinterpret_cast<char*>(file) + file_size);
+		shim_file->real->pMethods = nullptr;
+		auto result = real(vfs)->xOpen(real(vfs), name, shim_file->real, flags, out_flags);
+		if (shim_file->real->pMethods) {
+			file->pMethods = &methods[std::min(shim_file->real->pMethods->iVersion, 3) - 1];
+		}
+		return result;
+	}
+
+	static int xDelete(sqlite3_vfs* vfs, const char* name, int sync_directory) {
+		return real(vfs)->xDelete(real(vfs), name, sync_directory);
+	}
+
+	static int xAccess(sqlite3_vfs* vfs, const char* name, int flags, int* result) {
+		return real(vfs)->xAccess(real(vfs), name, flags, result);
+	}
+
+	static int xFullPathname(sqlite3_vfs* vfs, const char* name, int size, char* output) {
+		return real(vfs)->xFullPathname(real(vfs), name, size, output);
+	}
+
+	static void* xDlOpen(sqlite3_vfs* vfs, const char* filename) {
+		return real(vfs)->xDlOpen(real(vfs), filename);
+	}
+
+	static void xDlError(sqlite3_vfs* vfs, int size, char* message) {
+		real(vfs)->xDlError(real(vfs), size, message);
+	}
+
+	static symbol xDlSym(sqlite3_vfs* vfs, void* handle, const char* name) {
+		return real(vfs)->xDlSym(real(vfs), handle, name);
+	}
+
+	static void xDlClose(sqlite3_vfs* vfs, void* handle) {
+		real(vfs)->xDlClose(real(vfs), handle);
+	}
+
+	static int xRandomness(sqlite3_vfs* vfs, int size, char* output) {
+		return real(vfs)->xRandomness(real(vfs), size, output);
+	}
+
+	static int xSleep(sqlite3_vfs* vfs, int microseconds) {
+		return real(vfs)->xSleep(real(vfs), microseconds);
+	}
+
+	static int xCurrentTime(sqlite3_vfs* vfs, double* time) {
+		return real(vfs)->xCurrentTime(real(vfs), time);
+	}
+
+	static int xGetLastError(sqlite3_vfs* vfs, int size, char* message) {
+		return real(vfs)->xGetLastError(real(vfs), size, message);
+	}
+
+	static int xCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* time) {
+		return real(vfs)->xCurrentTimeInt64(real(vfs), time);
+	}
+
+	static int xSetSystemCall(sqlite3_vfs* vfs, const char* name, sqlite3_syscall_ptr call) {
+		return real(vfs)->xSetSystemCall(real(vfs), name, call);
+	}
+
+	static sqlite3_syscall_ptr xGetSystemCall(sqlite3_vfs* vfs, const char* name) {
+		return real(vfs)->xGetSystemCall(real(vfs), name);
+	}
+
+	static const char* xNextSystemCall(sqlite3_vfs* vfs, const char* name) {
+		return real(vfs)->xNextSystemCall(real(vfs), name);
+	}
+
+	static void make_vfs(sqlite3_vfs& vfs, sqlite3_vfs* real, const char* name, size_t file_size, open_function open) {
+		std::memset(&vfs, 0, sizeof(vfs));
+		vfs.iVersion = std::min(real->iVersion, 3);
+		vfs.szOsFile = static_cast<int>(file_size) + real->szOsFile;
+		vfs.mxPathname = real->mxPathname;
+		vfs.zName = name;
+		vfs.pAppData = real;
+		vfs.xOpen = open;
+		vfs.xDelete = &xDelete;
+		vfs.xAccess = &xAccess;
+		vfs.xFullPathname = &xFullPathname;
+		vfs.xDlOpen = &xDlOpen;
+		vfs.xDlError = &xDlError;
+		vfs.xDlSym = &xDlSym;
+		vfs.xDlClose = &xDlClose;
+		vfs.xRandomness = &xRandomness;
+		vfs.xSleep = &xSleep;
+		vfs.xCurrentTime = &xCurrentTime;
+		vfs.xGetLastError = &xGetLastError;
+		if (vfs.iVersion >= 2) {
+			vfs.xCurrentTimeInt64 = &xCurrentTimeInt64;
+		}
+		if (vfs.iVersion >= 3) {
+			vfs.xSetSystemCall = &xSetSystemCall;
+			vfs.xGetSystemCall = &xGetSystemCall;
+			vfs.xNextSystemCall = &xNextSystemCall;
+		}
+	}
+
+	// size of a shim file struct, keeping the wrapped file 8 byte aligned
+	template <typename File>
+	static size_t file_size() {
+		return (sizeof(File) + 7) / 8 * 8;
+	}
+};
+
+#if !defined(_WIN32)
+
+// Leading members of unixFile, stable across SQLite releases. The descriptor is only used after
+// it was checked to refer to the opened file.
+struct unix_file_prefix {
+	const sqlite3_io_methods* methods;
+	sqlite3_vfs* vfs;
+	void* inode;
+	int fd;
+};
+
+// Returns the descriptor of a file opened by a unix VFS or -1.
+inline int unix_descriptor(sqlite3_vfs* real, const char* name, sqlite3_file* file) {
+	struct stat opened;
+	struct stat named;
+	if (name == nullptr || std::strncmp(real->zName, "unix", 4) != 0) {
+		return -1;
+	}
+	auto fd = reinterpret_cast<unix_file_prefix*>(file)->fd;
+	if (fstat(fd, &opened) != 0 || stat(name, &named) != 0 || opened.st_dev != named.st_dev || opened.st_ino != named.st_ino) {
+		return -1;
+	}
+	return fd;
+}
+
+#else
+
+inline int unix_descriptor(sqlite3_vfs*, const char*, sqlite3_file*) {
+	return -1;
+}
+
+#endif
+
+struct uring_counters {
+	uring_counters()
+		: enters(0)
+		, submissions(0)
+		, reads(0)
+		, writes(0)
+		, fallback_calls(0) {
+	}
+
+	std::atomic<long long> enters;
+	std::atomic<long long> submissions;
+	std::atomic<long long> reads;
+	std::atomic<long long> writes;
+	std::atomic<long long> fallback_calls;
+};
+
+static uring_counters uring_counters_instance;
+
+struct uring_write {
+	sqlite3_int64 offset;
+	std::vector<char> data;
+};
+
+struct uring_queue;
+
+// The files of one database (main file, journal and WAL) of every connection in the process.
+struct uring_group {
+	string key;
+	std::mutex mutex;
+	std::vector<uring_queue*> queues;
+};
+
+// Writes of one file that were not submitted yet, guarded by mutex. They are submitted before any
+// other call reaches the file, whichever thread makes it, and before locks, syncs and wal-index
+// changes of any file of the same database, so no connection can observe the file without them.
+struct uring_queue {
+	static const unsigned limit = 64;
+
+	uring_queue(int fd, uring_group* group)
+		: fd(fd)
+		, error(SQLITE_OK)
+		, count(0)
+		, writes(limit)
+		, group(group) {
+	}
+
+	std::mutex mutex;
+	const int fd;
+	int error;
+	unsigned count;
+	std::vector<uring_write> writes;
+	uring_group* const group;
+};
+
+struct uring_file {
+	shim_file shim;
+	int fd;
+	uring_queue* queue;
+};
+
+#if defined(SQLT3_IO_URING)
+
+struct io_ring {
+	io_ring()
+		: fd(-1)
+		, sq_ring(MAP_FAILED)
+		, cq_ring(MAP_FAILED)
+		, sqe_memory(MAP_FAILED)
+		, sq_size(0)
+		, cq_size(0)
+		, sqe_size(0)
+		, entries(0)
+		, queued(0) {
+	}
+
+	~io_ring() {
+		if (sqe_memory != MAP_FAILED) {
+			munmap(sqe_memory, sqe_size);
+		}
+		if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+			munmap(cq_ring, cq_size);
+		}
+		if (sq_ring != MAP_FAILED) {
+			munmap(sq_ring, sq_size);
+		}
+		if (fd >= 0) {
+			::close(fd);
+		}
+	}
+
+	bool setup(unsigned count) {
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		fd = static_cast<int>(syscall(__NR_io_uring_setup, count, &params));
+		if (fd < 0) {
+			return false;
+		}
+		sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single) {
+			sq_size = cq_size = std::max(sq_size, cq_size);
+		}
+		sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sq_ring == MAP_FAILED) {
+			return false;
+		}
+		cq_ring = single ? sq_ring : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		sqe_size = params.sq_entries * sizeof(io_uring_sqe);
+		sqe_memory = mmap(nullptr, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (cq_ring == MAP_FAILED || sqe_memory == MAP_FAILED) {
+			return false;
+		}
+		auto sq = static_cast<char*>(sq_ring);
+		auto cq = static_cast<char*>(cq_ring);
+		sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		sqes = static_cast<io_uring_sqe*>(sqe_memory);
+		entries = params.sq_entries;
+		return true;
+	}
+
+	void push(std::uint8_t opcode, int file, const iovec* vector, sqlite3_int64 offset, std::uint64_t user_data) {
+		auto tail = *sq_tail;
+		auto index = tail & sq_mask;
+		auto& sqe = sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = opcode;
+		sqe.fd = file;
+		sqe.addr = reinterpret_cast<std::uint64_t>(vector);
+		sqe.len = 1;
+		sqe.off = static_cast<std::uint64_t>(offset);
+		sqe.user_data = user_data;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++queued;
+	}
+
+	// Submits the queued entries and waits for all of them, results[user_data] receives the
+	// result of each. Returns false if the ring failed, it must not be used any more then.
+	bool submit(int* results) {
+		unsigned submitted = 0;
+		unsigned completed = 0;
+		uring_counters_instance.submissions.fetch_add(queued, std::memory_order_relaxed);
+		while (completed < queued) {
+			auto result = syscall(__NR_io_uring_enter, fd, queued - submitted, queued - completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+			uring_counters_instance.enters.fetch_add(1, std::memory_order_relaxed);
+			if (result < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				queued = 0;
+				return false;
+			}
+			submitted += static_cast<unsigned>(result);
+			auto head = *cq_head;
+			auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head) {
+				auto& cqe = cqes[head & cq_mask];
+				results[cqe.user_data] = cqe.res;
+				++completed;
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+		queued = 0;
+		return true;
+	}
+
+	int fd;
+	void* sq_ring;
+	void* cq_ring;
+	void* sqe_memory;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqe_size;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe* cqes;
+	io_uring_sqe* sqes;
+	unsigned entries;
+	unsigned queued;
+};
+
+// The ring of one thread. Every submission is waited for before the call returns, so a ring holds
+// nothing between calls and any thread may submit the writes of any file.
+struct uring_thread {
+	uring_thread()
+		: ready(false) {
+		ready = ring.setup(uring_queue::limit) && ring.entries >= uring_queue::limit;
+	}
+
+	void write(int fd, const uring_write* writes, unsigned count, int* results) {
+		iovec vectors[uring_queue::limit];
+		for (unsigned i = 0; i < count; ++i) {
+			vectors[i].iov_base = const_cast<char*>(writes[i].data.data());
+			vectors[i].iov_len = writes[i].data.size();
+			ring.push(IORING_OP_WRITEV, fd, &vectors[i], writes[i].offset, i);
+		}
+		ready = ring.submit(results);
+		uring_counters_instance.writes.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	// Returns the number of bytes read or -errno.
+	int read(int fd, void* buffer, int amount, sqlite3_int64 offset) {
+		iovec vector;
+		vector.iov_base = buffer;
+		vector.iov_len = static_cast<size_t>(amount);
+		int result = -EIO;
+		ring.push(IORING_OP_READV, fd, &vector, offset, 0);
+		ready = ring.submit(&result);
+		uring_counters_instance.reads.fetch_add(1, std::memory_order_relaxed);
+		return result;
+	}
+
+	io_ring ring;
+	bool ready;
+};
+
+inline uring_thread* local_uring() {
+	static thread_local uring_thread thread;
+	return thread.ready ? &thread : nullptr;
+}
+
+inline int uring_descriptor(sqlite3_vfs* real, const char* name, sqlite3_file* file) {
+	return local_uring() ? unix_descriptor(real, name, file) : -1;
+}
+
+// Writes that io_uring could not complete are retried with pwrite, a failure there sticks to the
+// file and is returned by each of its later calls. Must hold queue.mutex.
+inline int flush_queue(uring_queue& queue) {
+	if (queue.count != 0) {
+		int results[uring_queue::limit];
+		std::fill(results, results + queue.count, -EIO);
+		if (auto thread = local_uring()) {
+			thread->write(queue.fd, queue.writes.data(), queue.count, results);
+		}
+		for (unsigned i = 0; i < queue.count && queue.error == SQLITE_OK; ++i) {
+			auto& write = queue.writes[i];
+			size_t done = results[i] > 0 ? static_cast<size_t>(results[i]) : 0;
+			if (done == write.data.size()) {
+				continue;
+			}
+			uring_counters_instance.fallback_calls.fetch_add(1, std::memory_order_relaxed);
+			while (done < write.data.size()) {
+				auto result = pwrite(queue.fd, write.data.data() + done, write.data.size() - done, write.offset + static_cast<sqlite3_int64>(done));
+				if (result < 0 && errno == EINTR) {
+					continue;
+				}
+				if (result <= 0) {
+					queue.error = result < 0 && errno == ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+					break;
+				}
+				done += static_cast<size_t>(result);
+			}
+		}
+		queue.count = 0;
+	}
+	return queue.error;
+}
+
+#else
+
+struct uring_thread {
+	int read(int, void*, int, sqlite3_int64) {
+		return -1;
+	}
+};
+
+inline uring_thread* local_uring() {
+	return nullptr;
+}
+
+inline int uring_descriptor(sqlite3_vfs*, const char*, sqlite3_file*) {
+	return -1;
+}
+
+inline int flush_queue(uring_queue& queue) {
+	return queue.error;
+}
+
+#endif
+
+struct uring {
+	static sqlite3_io_methods methods[3];
+	static sqlite3_vfs vfs;
+	static std::mutex groups_mutex;
+	static std::map<string, std::unique_ptr<uring_group>> groups;
+
+	static uring_file* cast(sqlite3_file* file) {
+		return reinterpret_cast<uring_file*>(file);
+	}
+
+	static int flush(sqlite3_file* file) {
+		auto queue = cast(file)->queue;
+		if (queue == nullptr) {
+			return SQLITE_OK;
+		}
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		return flush_queue(*queue);
+	}
+
+	// WAL frames are written to the WAL file but published through the wal-index of the main file,
+	// and other connections read what a checkpoint wrote once they take their locks.
+	static int flush_group(sqlite3_file* file) {
+		auto queue = cast(file)->queue;
+		if (queue == nullptr || queue->group == nullptr) {
+			return flush(file);
+		}
+		auto result = SQLITE_OK;
+		std::lock_guard<std::mutex> lock(queue->group->mutex);
+		for (auto other : queue->group->queues) {
+			std::lock_guard<std::mutex> other_lock(other->mutex);
+			auto flushed = flush_queue(*other);
+			if (other == queue) {
+				result = flushed;
+			}
+		}
+		return result;
+	}
+
+	// Journals and WAL files are named after their database.
+	static uring_queue* open_queue(int fd, const char* name, int flags) {
+		if (name == nullptr || (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL)) == 0) {
+			return new (std::nothrow) uring_queue(fd, nullptr);
+		}
+		string key = name;
+		if ((flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL)) != 0) {
+			key.erase(std::min(key.size(), key.rfind('-')));
+		}
+		std::lock_guard<std::mutex> lock(groups_mutex);
+		auto& group = groups[key];
+		if (!group) {
+			group.reset(new uring_group());
+			group->key = key;
+		}
+		auto queue = new (std::nothrow) uring_queue(fd, group.get());
+		if (queue == nullptr) {
+			if (group->queues.empty()) {
+				groups.erase(key);
+			}
+			return nullptr;
+		}
+		std::lock_guard<std::mutex> group_lock(group->mutex);
+		group->queues.push_back(queue);
+		return queue;
+	}
+
+	static void leave(uring_queue* queue) {
+		if (queue->group != nullptr) {
+			std::lock_guard<std::mutex> lock(groups_mutex);
+			bool empty;
+			{
+				std::lock_guard<std::mutex> group_lock(queue->group->mutex);
+				auto& queues = queue->group->queues;
+				queues.erase(std::find(queues.begin(), queues.end(), queue));
+				empty = queues.empty();
+			}
+			if (empty) {
+				groups.erase(queue->group->key);
+			}
+		}
+	}
+
+	static int xOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+		auto result = shim::open(vfs, name, file, flags, out_flags, shim::file_size<uring_file>(), methods);
+		cast(file)->fd = result == SQLITE_OK ? uring_descriptor(shim::real(vfs), name, shim::real(file)) : -1;
+		cast(file)->queue = cast(file)->fd >= 0 ? open_queue(cast(file)->fd, name, flags) : nullptr;
+		return result;
+	}
+
+	static int xClose(sqlite3_file* file) {
+		auto result = flush(file);
+		if (auto queue = cast(file)->queue) {
+			leave(queue);
+			delete queue;
+			cast(file)->queue = nullptr;
+		}
+		auto closed = shim::xClose(file);
+		return result != SQLITE_OK ? result : closed;
+	}
+
+	static int xRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+		auto result = flush(file);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		auto thread = local_uring();
+		if (thread == nullptr || cast(file)->fd < 0) {
+			uring_counters_instance.fallback_calls.fetch_add(1, std::memory_order_relaxed);
+			return shim::xRead(file, buffer, amount, offset);
+		}
+		auto read = thread->read(cast(file)->fd, buffer, amount, offset);
+		if (read == amount) {
+			return SQLITE_OK;
+		}
+		if (read < 0) {
+			uring_counters_instance.fallback_calls.fetch_add(1, std::memory_order_relaxed);
+			return shim::xRead(file, buffer, amount, offset);
+		}
+		std::memset(static_cast<char*>(buffer) + read, 0, static_cast<size_t>(amount - read));
+		return SQLITE_IOERR_SHORT_READ;
+	}
+
+	static int xWrite(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset) {
+		auto queue = cast(file)->queue;
+		if (queue == nullptr || local_uring() == nullptr) {
+			auto result = flush(file);
+			uring_counters_instance.fallback_calls.fetch_add(1, std::memory_order_relaxed);
+			return result != SQLITE_OK ? result : shim::xWrite(file, buffer, amount, offset);
+		}
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		auto flush = queue->count == uring_queue::limit;
+		for (unsigned i = 0; i < queue->count && !flush; ++i) {
+			auto& write = queue->writes[i];
+			flush = offset < write.offset + static_cast<sqlite3_int64>(write.data.size()) && write.offset < offset + amount;
+		}
+		auto result = flush ? flush_queue(*queue) : queue->error;
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		auto& write = queue->writes[queue->count++];
+		write.offset = offset;
+		write.data.assign(static_cast<const char*>(buffer), static_cast<const char*>(buffer) + amount);
+		return SQLITE_OK;
+	}
+
+	static int xTruncate(sqlite3_file* file, sqlite3_int64 size) {
+		auto result = flush(file);
+		return result != SQLITE_OK ? result : shim::xTruncate(file, size);
+	}
+
+	static int xSync(sqlite3_file* file, int flags) {
+		auto result = flush_group(file);
+		return result != SQLITE_OK ? result : shim::xSync(file, flags);
+	}
+
+	static int xFileSize(sqlite3_file* file, sqlite3_int64* size) {
+		auto result = flush(file);
+		return result != SQLITE_OK ? result : shim::xFileSize(file, size);
+	}
+
+	static int xLock(sqlite3_file* file, int lock) {
+		auto result = flush_group(file);
+		return result != SQLITE_OK ? result : shim::xLock(file, lock);
+	}
+
+	static int xUnlock(sqlite3_file* file, int lock) {
+		auto result = flush_group(file);
+		return result != SQLITE_OK ? result : shim::xUnlock(file, lock);
+	}
+
+	static int xCheckReservedLock(sqlite3_file* file, int* result) {
+		auto flushed = flush_group(file);
+		return flushed != SQLITE_OK ? flushed : shim::xCheckReservedLock(file, result);
+	}
+
+	static int xFileControl(sqlite3_file* file, int op, void* argument) {
+		auto result = flush_group(file);
+		return result != SQLITE_OK ? result : shim::xFileControl(file, op, argument);
+	}
+
+	static int xShmMap(sqlite3_file* file, int region, int size, int extend, void volatile** memory) {
+		auto result = flush_group(file);
+		return result != SQLITE_OK ? result : shim::xShmMap(file, region, size, extend, memory);
+	}
+
+	static int xShmLock(sqlite3_file* file, int offset, int count, int flags) {
+		auto result = flush_group(file);
+		return result != SQLITE_OK ? result : shim::xShmLock(file, offset, count, flags);
+	}
+
+	static void xShmBarrier(sqlite3_file* file) {
+		flush_group(file);
+		shim::xShmBarrier(file);
+	}
+
+	static int xShmUnmap(sqlite3_file* file, int remove) {
+		auto result = flush_group(file);
+		return result != SQLITE_OK ? result : shim::xShmUnmap(file, remove);
+	}
+
+	static int xFetch(sqlite3_file* file, sqlite3_int64 offset, int amount, void** pointer) {
+		auto result = flush(file);
+		return result != SQLITE_OK ? result : shim::xFetch(file, offset, amount, pointer);
+	}
+
+	static void init(sqlite3_vfs* real) {
+		shim::io_methods(methods);
+		for (auto& m : methods) {
+			m.xClose = &xClose;
+			m.xRead = &xRead;
+			m.xWrite = &xWrite;
+			m.xTruncate = &xTruncate;
+			m.xSync = &xSync;
+			m.xFileSize = &xFileSize;
+			m.xLock = &xLock;
+			m.xUnlock = &xUnlock;
+			m.xCheckReservedLock = &xCheckReservedLock;
+			m.xFileControl = &xFileControl;
+			if (m.iVersion >= 2) {
+				m.xShmMap = &xShmMap;
+				m.xShmLock = &xShmLock;
+				m.xShmBarrier = &xShmBarrier;
+				m.xShmUnmap = &xShmUnmap;
+			}
+			if (m.iVersion >= 3) {
+				m.xFetch = &xFetch;
+			}
+		}
+		shim::make_vfs(vfs, real, uring_vfs, shim::file_size<uring_file>(), &xOpen);
+	}
+};
+
+sqlite3_io_methods uring::methods[3];
+sqlite3_vfs uring::vfs;
+std::mutex uring::groups_mutex;
+std::map<string, std::unique_ptr<uring_group>> uring::groups;
+
+struct readahead_settings {
+	readahead_settings()
+		: trigger_reads(4)
+		, window(256 * 1024)
+		, max_window(4 * 1024 * 1024)
+		, advices(0)
+		, prefetched_bytes(0)
+		, used_bytes(0) {
+	}
+
+	std::atomic<size_t> trigger_reads;
+	std::atomic<size_t> window;
+	std::atomic<size_t> max_window;
+	std::atomic<long long> advices;
+	std::atomic<long long> prefetched_bytes;
+	std::atomic<long long> used_bytes;
+};
+
+static readahead_settings readahead_instance;
+
+// Bytes read inside the prefetched extent are counted per file and added to the shared counter
+// with the next advice or when the file closes.
+struct readahead_file {
+	shim_file shim;
+	int fd;
+	unsigned sequential;
+	sqlite3_int64 next_offset;
+	sqlite3_int64 window;
+	sqlite3_int64 prefetch_begin;
+	sqlite3_int64 prefetch_end;
+	long long used_bytes;
+};
+
+struct readahead {
+	static sqlite3_io_methods methods[3];
+	static sqlite3_vfs vfs;
+
+	static readahead_file* cast(sqlite3_file* file) {
+		return reinterpret_cast<readahead_file*>(file);
+	}
+
+	static void fold(readahead_file* file) {
+		readahead_instance.used_bytes.fetch_add(file->used_bytes, std::memory_order_relaxed);
+		file->used_bytes = 0;
+	}
+
+	static void advise(sqlite3_file* file) {
+		auto f = cast(file);
+		sqlite3_int64 size = 0;
+		auto begin = std::max(f->next_offset, f->prefetch_end);
+		if (shim::xFileSize(file, &size) != SQLITE_OK || begin >= size) {
+			return;
+		}
+		auto length = std::min(f->window, size - begin);
+#if defined(POSIX_FADV_WILLNEED)
+		posix_fadvise(f->fd, begin, length, POSIX_FADV_WILLNEED);
+#endif
+		if (begin != f->prefetch_end) {
+			f->prefetch_begin = begin;
+		}
+		f->prefetch_end = begin + length;
+		f->window = std::min(2 * f->window, static_cast<sqlite3_int64>(readahead_instance.max_window.load(std::memory_order_relaxed)));
+		readahead_instance.advices.fetch_add(1, std::memory_order_relaxed);
+		readahead_instance.prefetched_bytes.fetch_add(length, std::memory_order_relaxed);
+		fold(f);
+	}
+
+	static int xOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+		auto result = shim::open(vfs, name, file, flags, out_flags, shim::file_size<readahead_file>(), methods);
+		auto f = cast(file);
+		f->fd = result == SQLITE_OK ? unix_descriptor(shim::real(vfs), name, shim::real(file)) : -1;
+		f->sequential = 0;
+		f->next_offset = -1;
+		f->window = static_cast<sqlite3_int64>(readahead_instance.window.load(std::memory_order_relaxed));
+		f->prefetch_begin = 0;
+		f->prefetch_end = 0;
+		f->used_bytes = 0;
+		return result;
+	}
+
+	static int xClose(sqlite3_file* file) {
+		fold(cast(file));
+		return shim::xClose(file);
+	}
+
+	static int xRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+		auto f = cast(file);
+		if (offset == f->next_offset) {
+			++f->sequential;
+		}
+		else {
+			f->sequential = 0;
+			f->window = static_cast<sqlite3_int64>(readahead_instance.window.load(std::memory_order_relaxed));
+		}
+		f->next_offset = offset + amount;
+		if (offset >= f->prefetch_begin && f->next_offset <= f->prefetch_end) {
+			f->used_bytes += amount;
+		}
+		if (f->fd >= 0
+			&& f->sequential >= readahead_instance.trigger_reads.load(std::memory_order_relaxed)
+			&& f->next_offset + f->window / 2 > f->prefetch_end) {
+			advise(file);
+		}
+		return shim::xRead(file, buffer, amount, offset);
+	}
+
+	static void init(sqlite3_vfs* real) {
+		shim::io_methods(methods);
+		for (auto& m : methods) {
+			m.xClose = &xClose;
+			m.xRead = &xRead;
+		}
+		shim::make_vfs(vfs, real, readahead_vfs, shim::file_size<readahead_file>(), &xOpen);
+	}
+};
+
+sqlite3_io_methods readahead::methods[3];
+sqlite3_vfs readahead::vfs;
+
+// io_status reads the counters while the threads using the files update them.
+struct atomic_io_counters {
+	atomic_io_counters() {
+		reset();
+	}
+
+	void reset() {
+		calls.store(0, std::memory_order_relaxed);
+		bytes.store(0, std::memory_order_relaxed);
+		time.store(0, std::memory_order_relaxed);
+	}
+
+	io_counters load() const {
+		io_counters result;
+		result.calls = calls.load(std::memory_order_relaxed);
+		result.bytes = bytes.load(std::memory_order_relaxed);
+		result.time = std::chrono::nanoseconds(time.load(std::memory_order_relaxed));
+		return result;
+	}
+
+	std::atomic<long long> calls;
+	std::atomic<long long> bytes;
+	std::atomic<long long> time;
+};
+
+struct atomic_io_file_stats {
+	void reset() {
+		read.reset();
+		write.reset();
+		sync.reset();
+		truncate.reset();
+	}
+
+	io_file_stats load() const {
+		io_file_stats result;
+		result.read = read.load();
+		result.write = write.load();
+		result.sync = sync.load();
+		result.truncate = truncate.load();
+		return result;
+	}
+
+	atomic_io_counters read;
+	atomic_io_counters write;
+	atomic_io_counters sync;
+	atomic_io_counters truncate;
+};
+
+struct atomic_io_stats {
+	void reset() {
+		main.reset();
+		journal.reset();
+		wal.reset();
+		temp.reset();
+	}
+
+	io_stats load() const {
+		io_stats result;
+		result.main = main.load();
+		result.journal = journal.load();
+		result.wal = wal.load();
+		result.temp = temp.load();
+		return result;
+	}
+
+	atomic_io_file_stats main;
+	atomic_io_file_stats journal;
+	atomic_io_file_stats wal;
+	atomic_io_file_stats temp;
+};
+
+// Accounts are pooled and never freed, so a stale current_account can only charge the wrong
+// connection, acquire fails once the last file of an account is closed.
+struct io_account {
+	io_account()
+		: refs(0) {
+	}
+
+	bool acquire() {
+		auto count = refs.load();
+		while (count > 0) {
+			if (refs.compare_exchange_weak(count, count + 1)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	atomic_io_stats stats;
+	std::atomic<int> refs;
+};
+
+struct io_account_pool {
+	io_account* allocate() {
+		std::lock_guard<std::mutex> lock(mutex);
+		io_account* account;
+		if (free.empty()) {
+			accounts.emplace_back();
+			account = &accounts.back();
+		}
+		else {
+			account = free.back();
+			free.pop_back();
+		}
+		account->stats.reset();
+		account->refs.store(1);
+		return account;
+	}
+
+	void release(io_account* account) {
+		if (account->refs.fetch_sub(1) == 1) {
+			std::lock_guard<std::mutex> lock(mutex);
+			free.push_back(account);
+		}
+	}
+
+	std::mutex mutex;
+	std::deque<io_account> accounts;
+	std::vector<io_account*> free;
+};
+
+static io_account_pool io_account_pool_instance;
+
+// the account of the main database file the thread used last
+static SQLT3_THREAD_LOCAL io_account* current_account = nullptr;
+
+struct accounting_file {
+	shim_file shim;
+	io_account* account;
+	atomic_io_file_stats* stats;
+	bool main;
+};
+
+struct accounting {
+	static sqlite3_io_methods methods[3];
+	static sqlite3_vfs vfs;
+
+	struct timer {
+		timer(accounting_file* file, atomic_io_counters atomic_io_file_stats::* counters, long long bytes)
+			: counters(file->stats ? &(file->stats->*counters) : nullptr)
+			, start(counters ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point()) {
+			if (this->counters) {
+				this->counters->calls.fetch_add(1, std::memory_order_relaxed);
+				this->counters->bytes.fetch_add(bytes, std::memory_order_relaxed);
+			}
+			if (file->main) {
+				current_account = file->account;
+			}
+		}
+
+		~timer() {
+			if (counters) {
+				auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+				counters->time.fetch_add(elapsed.count(), std::memory_order_relaxed);
+			}
+		}
+
+		atomic_io_counters* counters;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	static accounting_file* cast(sqlite3_file* file) {
+		return reinterpret_cast<accounting_file*>(file);
+	}
+
+	static bool owns(sqlite3_file* file) {
+		return file->pMethods >= methods && file->pMethods < methods + 3;
+	}
+
+	static int xOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+		auto f = cast(file);
+		f->main = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+		f->account = nullptr;
+		if (f->main) {
+			f->account = io_account_pool_instance.allocate();
+		}
+		else if (current_account != nullptr && current_account->acquire()) {
+			f->account = current_account;
+		}
+		f->stats = nullptr;
+		if (f->account != nullptr) {
+			auto& stats = f->account->stats;
+			f->stats = f->main ? &stats.main
+				: (flags & SQLITE_OPEN_MAIN_JOURNAL) != 0 ? &stats.journal
+				: (flags & SQLITE_OPEN_WAL) != 0 ? &stats.wal
+				: &stats.temp;
+		}
+		auto result = shim::open(vfs, name, file, flags, out_flags, shim::file_size<accounting_file>(), methods);
+		if (file->pMethods == nullptr && f->account != nullptr) {
+			io_account_pool_instance.release(f->account);
+		}
+		return result;
+	}
+
+	static int xClose(sqlite3_file* file) {
+		auto f = cast(file);
+		auto result = shim::xClose(file);
+		if (f->account != nullptr) {
+			if (current_account == f->account && f->main) {
+				current_account = nullptr;
+			}
+			io_account_pool_instance.release(f->account);
+		}
+		return result;
+	}
+
+	static int xRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+		timer timer(cast(file), &atomic_io_file_stats::read, amount);
+		return shim::xRead(file, buffer, amount, offset);
+	}
+
+	static int xWrite(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset) {
+		timer timer(cast(file), &atomic_io_file_stats::write, amount);
+		return shim::xWrite(file, buffer, amount, offset);
+	}
+
+	static int xTruncate(sqlite3_file* file, sqlite3_int64 size) {
+		timer timer(cast(file), &atomic_io_file_stats::truncate, 0);
+		return shim::xTruncate(file, size);
+	}
+
+	static int xSync(sqlite3_file* file, int flags) {
+		timer timer(cast(file), &atomic_io_file_stats::sync, 0);
+		return shim::xSync(file, flags);
+	}
+
+	static int xLock(sqlite3_file* file, int lock) {
+		if (cast(file)->main) {
+			current_account = cast(file)->account;
+		}
+		return shim::xLock(file, lock);
+	}
+
+	static int xShmLock(sqlite3_file* file, int offset, int count, int flags) {
+		if (cast(file)->main) {
+			current_account = cast(file)->account;
+		}
+		return shim::xShmLock(file, offset, count, flags);
+	}
+
+	static void init(sqlite3_vfs* real) {
+		shim::io_methods(methods);
+		for (auto& m : methods) {
+			m.xClose = &xClose;
+			m.xRead = &xRead;
+			m.xWrite = &xWrite;
+			m.xTruncate = &xTruncate;
+			m.xSync = &xSync;
+			m.xLock = &xLock;
+			if (m.iVersion >= 2) {
+				m.xShmLock = &xShmLock;
+			}
+		}
+		shim::make_vfs(vfs, real, accounting_vfs, shim::file_size<accounting_file>(), &xOpen);
+	}
+};
+
+sqlite3_io_methods accounting::methods[3];
+sqlite3_vfs accounting::vfs;
+
+struct memory_counters {
+	memory_counters()
+		: files(0)
+		, bytes(0) {
+	}
+
+	std::atomic<long long> files;
+	std::atomic<long long> bytes;
+};
+
+static memory_counters memory_counters_instance;
+
+// File contents live in 64 KiB chunks found through a two level directory whose entries are
+// published with release stores, so readers copy pages without taking the mutex. Writers hold it,
+// SQLite's locks keep readers away from the ranges being written. Truncation may still race with
+// a reader that loaded the old size, so it only unlinks chunks and frees them once no read is in
+// progress, the tail of the last chunk is zeroed when a write extends the file over it.
+struct memory_data {
+	static const size_t chunk_size = 64 * 1024;
+	static const size_t table_size = 1024;
+	static const size_t max_tables = 256;
+
+	struct chunk_table {
+		chunk_table() {
+			for (auto& chunk : chunks) {
+				chunk.store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		std::atomic<char*> chunks[table_size];
+	};
+
+	memory_data()
+		: size(0)
+		, readers(0)
+		, handles(0)
+		, shared(0)
+		, reserved(false)
+		, pending(false)
+		, exclusive(false) {
+		for (auto& table : tables) {
+			table.store(nullptr, std::memory_order_relaxed);
+		}
+		std::fill(shm_shared, shm_shared + SQLITE_SHM_NLOCK, 0);
+		std::fill(shm_exclusive, shm_exclusive + SQLITE_SHM_NLOCK, false);
+		memory_counters_instance.files.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	~memory_data() {
+		truncate(0);
+		for (auto memory : retired) {
+			release_chunk(memory);
+		}
+		for (auto& table : tables) {
+			delete table.load(std::memory_order_relaxed);
+		}
+		for (auto region : shm_regions) {
+			std::free(region);
+		}
+		memory_counters_instance.files.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	char* chunk(size_t index) const {
+		auto table = tables[index / table_size].load(std::memory_order_acquire);
+		return table ? table->chunks[index % table_size].load(std::memory_order_acquire) : nullptr;
+	}
+
+	// requires mutex
+	char* allocate_chunk(size_t index) {
+		auto& table = tables[index / table_size];
+		if (table.load(std::memory_order_relaxed) == nullptr) {
+			table.store(new chunk_table(), std::memory_order_release);
+		}
+		auto& chunk = table.load(std::memory_order_relaxed)->chunks[index % table_size];
+		if (chunk.load(std::memory_order_relaxed) == nullptr) {
+			auto memory = static_cast<char*>(std::calloc(1, chunk_size));
+			if (memory == nullptr) {
+				return nullptr;
+			}
+			memory_counters_instance.bytes.fetch_add(chunk_size, std::memory_order_relaxed);
+			chunk.store(memory, std::memory_order_release);
+		}
+		return chunk.load(std::memory_order_relaxed);
+	}
+
+	static void release_chunk(char* memory) {
+		std::free(memory);
+		memory_counters_instance.bytes.fetch_sub(chunk_size, std::memory_order_relaxed);
+	}
+
+	// requires mutex, a read that starts after the chunks were unlinked cannot reach them
+	void reclaim() {
+		if (!retired.empty() && readers.load() == 0) {
+			for (auto memory : retired) {
+				release_chunk(memory);
+			}
+			retired.clear();
+		}
+	}
+
+	int read(void* buffer, int amount, sqlite3_int64 offset) const {
+		readers.fetch_add(1);
+		auto result = copy(buffer, amount, offset);
+		readers.fetch_sub(1);
+		return result;
+	}
+
+	int copy(void* buffer, int amount, sqlite3_int64 offset) const {
+		auto output = static_cast<char*>(buffer);
+		auto end = size.load(std::memory_order_acquire);
+		auto available = offset < end ? static_cast<int>(std::min<sqlite3_int64>(amount, end - offset)) : 0;
+		for (int done = 0; done < available;) {
+			auto position = static_cast<size_t>(offset + done);
+			auto length = std::min(static_cast<size_t>(available - done), chunk_size - position % chunk_size);
+			auto memory = chunk(position / chunk_size);
+			if (memory) {
+				std::memcpy(output + done, memory + position % chunk_size, length);
+			}
+			else {
+				std::memset(output + done, 0, length);
+			}
+			done += static_cast<int>(length);
+		}
+		if (available < amount) {
+			std::memset(output + available, 0, static_cast<size_t>(amount - available));
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+
+	int write(const void* buffer, int amount, sqlite3_int64 offset) {
+		std::lock_guard<std::mutex> lock(mutex);
+		reclaim();
+		if (static_cast<unsigned long long>(offset + amount) > chunk_size * table_size * max_tables) {
+			return SQLITE_FULL;
+		}
+		// bytes past the end of the last chunk may be left over from a truncation
+		auto end = size.load(std::memory_order_relaxed);
+		if (offset > end && end % chunk_size != 0) {
+			if (auto memory = chunk(static_cast<size_t>(end / chunk_size))) {
+				auto gap = std::min<sqlite3_int64>(offset, end - end % chunk_size + chunk_size) - end;
+				std::memset(memory + end % chunk_size, 0, static_cast<size_t>(gap));
+			}
+		}
+		auto input = static_cast<const char*>(buffer);
+		for (int done = 0; done < amount;) {
+			auto position = static_cast<size_t>(offset + done);
+			auto length = std::min(static_cast<size_t>(amount - done), chunk_size - position % chunk_size);
+			auto memory = allocate_chunk(position / chunk_size);
+			if (memory == nullptr) {
+				return SQLITE_IOERR_NOMEM;
+			}
+			std::memcpy(memory + position % chunk_size, input + done, length);
+			done += static_cast<int>(length);
+		}
+		if (offset + amount > end) {
+			size.store(offset + amount, std::memory_order_release);
+		}
+		return SQLITE_OK;
+	}
+
+	void truncate(sqlite3_int64 new_size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (new_size >= size.load(std::memory_order_relaxed)) {
+			return;
+		}
+		size.store(new_size, std::memory_order_release);
+		auto first = static_cast<size_t>((new_size + chunk_size - 1) / chunk_size);
+		for (size_t t = first / table_size; t < max_tables; ++t) {
+			auto table = tables[t].load(std::memory_order_relaxed);
+			if (table == nullptr) {
+				continue;
+			}
+			for (size_t i = t == first / table_size ? first % table_size : 0; i < table_size; ++i) {
+				if (auto memory = table->chunks[i].exchange(nullptr)) {
+					retired.push_back(memory);
+				}
+			}
+		}
+		reclaim();
+	}
+
+	std::mutex mutex;
+	std::atomic<chunk_table*> tables[max_tables];
+	std::atomic<sqlite3_int64> size;
+	mutable std::atomic<int> readers;
+	std::vector<char*> retired;
+	int handles;
+	int shared;
+	bool reserved;
+	bool pending;
+	bool exclusive;
+	std::vector<char*> shm_regions;
+	int shm_shared[SQLITE_SHM_NLOCK];
+	bool shm_exclusive[SQLITE_SHM_NLOCK];
+};
+
+struct memory_handle {
+	memory_handle()
+		: lock(SQLITE_LOCK_NONE)
+		, reserved(false)
+		, main(false)
+		, delete_on_close(false)
+		, shm_shared(0)
+		, shm_exclusive(0) {
+	}
+
+	std::shared_ptr<memory_data> data;
+	std::string name;
+	int lock;
+	bool reserved;
+	bool main;
+	bool delete_on_close;
+	unsigned shm_shared;
+	unsigned shm_exclusive;
+};
+
+struct memory_file {
+	sqlite3_file file;
+	memory_handle* handle;
+};
+
+// Files with a name stay in the registry until they are deleted or, for a main database with its
+// journal and WAL, until the last connection closes it. Temporary files are private.
+struct memory {
+	static const int sector_size = 4096;
+
+	static sqlite3_io_methods methods;
+	static sqlite3_vfs vfs;
+	static std::mutex mutex;
+	static std::unordered_map<std::string, std::shared_ptr<memory_data>> files;
+
+	static memory_handle& handle(sqlite3_file* file) {
+		return *reinterpret_cast<memory_file*>(file)->handle;
+	}
+
+	static int xOpen(sqlite3_vfs*, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+		auto f = reinterpret_cast<memory_file*>(file);
+		file->pMethods = nullptr;
+		std::unique_ptr<memory_handle> handle(new memory_handle());
+		handle->main = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+		handle->delete_on_close = (flags & SQLITE_OPEN_DELETEONCLOSE) != 0;
+		if (name == nullptr) {
+			handle->data = std::make_shared<memory_data>();
+		}
+		else {
+			handle->name = name;
+			std::lock_guard<std::mutex> lock(mutex);
+			auto& data = files[handle->name];
+			if (data && (flags & SQLITE_OPEN_EXCLUSIVE) != 0) {
+				return SQLITE_CANTOPEN;
+			}
+			if (!data) {
+				if ((flags & SQLITE_OPEN_CREATE) == 0) {
+					files.erase(handle->name);
+					return SQLITE_CANTOPEN;
+				}
+				data = std::make_shared<memory_data>();
+			}
+			handle->data = data;
+			++data->handles;
+		}
+		if (out_flags) {
+			*out_flags = flags;
+		}
+		f->handle = handle.release();
+		file->pMethods = &methods;
+		return SQLITE_OK;
+	}
+
+	static int xClose(sqlite3_file* file) {
+		std::unique_ptr<memory_handle> handle(&memory::handle(file));
+		xShmUnmap(file, 0);
+		xUnlock(file, SQLITE_LOCK_NONE);
+		if (!handle->name.empty()) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--handle->data->handles == 0 && handle->main) {
+				files.erase(handle->name + "-journal");
+				files.erase(handle->name + "-wal");
+				files.erase(handle->name);
+			}
+			else if (handle->delete_on_close) {
+				auto itr = files.find(handle->name);
+				if (itr != files.end() && itr->second == handle->data) {
+					files.erase(itr);
+				}
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	static int xRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+		return handle(file).data->read(buffer, amount, offset);
+	}
+
+	static int xWrite(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset) {
+		return handle(file).data->write(buffer, amount, offset);
+	}
+
+	static int xTruncate(sqlite3_file* file, sqlite3_int64 size) {
+		handle(file).data->truncate(size);
+		return SQLITE_OK;
+	}
+
+	static int xSync(sqlite3_file*, int) {
+		return SQLITE_OK;
+	}
+
+	static int xFileSize(sqlite3_file* file, sqlite3_int64* size) {
+		*size = handle(file).data->size.load(std::memory_order_acquire);
+		return SQLITE_OK;
+	}
+
+	// the locking protocol of the unix VFS, held by handles of this process only
+	static int xLock(sqlite3_file* file, int level) {
+		auto& handle = memory::handle(file);
+		auto& data = *handle.data;
+		if (handle.lock >= level) {
+			return SQLITE_OK;
+		}
+		std::lock_guard<std::mutex> lock(data.mutex);
+		if (level == SQLITE_LOCK_SHARED) {
+			if (data.pending || data.exclusive) {
+				return SQLITE_BUSY;
+			}
+			++data.shared;
+		}
+		else if (level == SQLITE_LOCK_RESERVED) {
+			if (data.reserved) {
+				return SQLITE_BUSY;
+			}
+			data.reserved = handle.reserved = true;
+		}
+		else {
+			if (handle.lock < SQLITE_LOCK_PENDING) {
+				if (data.pending) {
+					return SQLITE_BUSY;
+				}
+				data.pending = true;
+				handle.lock = SQLITE_LOCK_PENDING;
+			}
+			if (level == SQLITE_LOCK_EXCLUSIVE) {
+				if (data.shared > 1) {
+					return SQLITE_BUSY;
+				}
+				data.exclusive = true;
+			}
+		}
+		handle.lock = level;
+		return SQLITE_OK;
+	}
+
+	static int xUnlock(sqlite3_file* file, int level) {
+		auto& handle = memory::handle(file);
+		auto& data = *handle.data;
+		if (handle.lock <= level) {
+			return SQLITE_OK;
+		}
+		std::lock_guard<std::mutex> lock(data.mutex);
+		if (handle.reserved && level < SQLITE_LOCK_RESERVED) {
+			data.reserved = handle.reserved = false;
+		}
+		if (handle.lock >= SQLITE_LOCK_PENDING) {
+			data.pending = false;
+		}
+		if (handle.lock == SQLITE_LOCK_EXCLUSIVE) {
+			data.exclusive = false;
+		}
+		if (level == SQLITE_LOCK_NONE) {
+			--data.shared;
+		}
+		handle.lock = level;
+		return SQLITE_OK;
+	}
+
+	static int xCheckReservedLock(sqlite3_file* file, int* result) {
+		auto& data = *handle(file).data;
+		std::lock_guard<std::mutex> lock(data.mutex);
+		*result = data.reserved || data.pending || data.exclusive;
+		return SQLITE_OK;
+	}
+
+	static int xFileControl(sqlite3_file*, int, void*) {
+		return SQLITE_NOTFOUND;
+	}
+
+	static int xSectorSize(sqlite3_file*) {
+		return sector_size;
+	}
+
+	static int xDeviceCharacteristics(sqlite3_file*) {
+		return SQLITE_IOCAP_SAFE_APPEND | SQLITE_IOCAP_SEQUENTIAL | SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+	}
+
+	static int xShmMap(sqlite3_file* file, int region, int size, int extend, void volatile** memory) {
+		auto& data = *handle(file).data;
+		std::lock_guard<std::mutex> lock(data.mutex);
+		*memory = nullptr;
+		while (static_cast<int>(data.shm_regions.size()) <= region) {
+			if (!extend) {
+				return SQLITE_OK;
+			}
+			auto memory = static_cast<char*>(std::calloc(1, static_cast<size_t>(size)));
+			if (memory == nullptr) {
+				return SQLITE_IOERR_NOMEM;
+			}
+			data.shm_regions.push_back(memory);
+		}
+		*memory = data.shm_regions[region];
+		return SQLITE_OK;
+	}
+
+	static int xShmLock(sqlite3_file* file, int offset, int count, int flags) {
+		auto& handle = memory::handle(file);
+		auto& data = *handle.data;
+		unsigned mask = ((1u << count) - 1) << offset;
+		std::lock_guard<std::mutex> lock(data.mutex);
+		if (flags & SQLITE_SHM_UNLOCK) {
+			for (int i = offset; i < offset + count; ++i) {
+				if (handle.shm_shared & (1u << i)) {
+					--data.shm_shared[i];
+				}
+				if (handle.shm_exclusive & (1u << i)) {
+					data.shm_exclusive[i] = false;
+				}
+			}
+			handle.shm_shared &= ~mask;
+			handle.shm_exclusive &= ~mask;
+		}
+		else if (flags & SQLITE_SHM_SHARED) {
+			if ((handle.shm_shared & mask) == 0) {
+				if (data.shm_exclusive[offset]) {
+					return SQLITE_BUSY;
+				}
+				++data.shm_shared[offset];
+				handle.shm_shared |= mask;
+			}
+		}
+		else {
+			for (int i = offset; i < offset + count; ++i) {
+				if ((data.shm_exclusive[i] && (handle.shm_exclusive & (1u << i)) == 0)
+					|| data.shm_shared[i] > ((handle.shm_shared & (1u << i)) ? 1 : 0)) {
+					return SQLITE_BUSY;
+				}
+			}
+			for (int i = offset; i < offset + count; ++i) {
+				data.shm_exclusive[i] = true;
+			}
+			handle.shm_exclusive |= mask;
+		}
+		return SQLITE_OK;
+	}
+
+	static void xShmBarrier(sqlite3_file*) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	// shared memory regions live as long as the file data, only the locks are released here
+	static int xShmUnmap(sqlite3_file* file, int) {
+		auto& handle = memory::handle(file);
+		if (handle.shm_shared | handle.shm_exclusive) {
+			xShmLock(file, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED);
+		}
+		return SQLITE_OK;
+	}
+
+	static int xDelete(sqlite3_vfs*, const char* name, int) {
+		std::lock_guard<std::mutex> lock(mutex);
+		files.erase(name);
+		return SQLITE_OK;
+	}
+
+	static int xAccess(sqlite3_vfs*, const char* name, int, int* result) {
+		std::lock_guard<std::mutex> lock(mutex);
+		*result = files.count(name) != 0;
+		return SQLITE_OK;
+	}
+
+	static int xFullPathname(sqlite3_vfs*, const char* name, int size, char* output) {
+		auto length = std::strlen(name);
+		if (length >= static_cast<size_t>(size)) {
+			return SQLITE_CANTOPEN;
+		}
+		std::memcpy(output, name, length + 1);
+		return SQLITE_OK;
+	}
+
+	static void init(sqlite3_vfs* real) {
+		methods.iVersion = 2;
+		methods.xClose = &xClose;
+		methods.xRead = &xRead;
+		methods.xWrite = &xWrite;
+		methods.xTruncate = &xTruncate;
+		methods.xSync = &xSync;
+		methods.xFileSize = &xFileSize;
+		methods.xLock = &xLock;
+		methods.xUnlock = &xUnlock;
+		methods.xCheckReservedLock = &xCheckReservedLock;
+		methods.xFileControl = &xFileControl;
+		methods.xSectorSize = &xSectorSize;
+		methods.xDeviceCharacteristics = &xDeviceCharacteristics;
+		methods.xShmMap = &xShmMap;
+		methods.xShmLock = &xShmLock;
+		methods.xShmBarrier = &xShmBarrier;
+		methods.xShmUnmap = &xShmUnmap;
+		methods.xFetch = nullptr;
+		methods.xUnfetch = nullptr;
+		shim::make_vfs(vfs, real, memory_vfs, sizeof(memory_file), &xOpen);
+		vfs.szOsFile = sizeof(memory_file);
+		vfs.mxPathname = 512;
+		vfs.xDelete = &xDelete;
+		vfs.xAccess = &xAccess;
+		vfs.xFullPathname = &xFullPathname;
+	}
+};
+
+sqlite3_io_methods memory::methods;
+sqlite3_vfs memory::vfs;
+std::mutex memory::mutex;
+std::unordered_map<std::string, std::shared_ptr<memory_data>> memory::files;
+
+inline void put_u32(unsigned char* output, std::uint32_t value) {
+	for (int i = 0; i < 4; ++i) {
+		output[i] = static_cast<unsigned char>(value >> (8 * i));
+	}
+}
+
+inline void put_u64(unsigned char* output, std::uint64_t value) {
+	for (int i = 0; i < 8; ++i) {
+		output[i] = static_cast<unsigned char>(value >> (8 * i));
+	}
+}
+
+inline std::uint32_t get_u32(const unsigned char* input) {
+	std::uint32_t value = 0;
+	for (int i = 3; i >= 0; --i) {
+		value = value << 8 | input[i];
+	}
+	return value;
+}
+
+inline std::uint64_t get_u64(const unsigned char* input) {
+	std::uint64_t value = 0;
+	for (int i = 7; i >= 0; --i) {
+		value = value << 8 | input[i];
+	}
+	return value;
+}
+
+inline std::uint64_t fnv1a(const unsigned char* data, size_t size) {
+	std::uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// LZ77 with LZ4 style sequences: a token of 4 bit literal and match lengths (15 continues in the
+// following bytes), the literals, a 16 bit offset and the match of at least 4 bytes. The last
+// sequence has no match.
+inline bool lz_sequence(unsigned char* output, size_t& position, size_t capacity, const unsigned char* literals, size_t count, size_t offset, size_t length) {
+	size_t extra = length != 0 ? length - 4 : 0;
+	size_t needed = 1 + count / 255 + 1 + count + (length != 0 ? 2 + extra / 255 + 1 : 0);
+	if (capacity - position < needed) {
+		return false;
+	}
+	output[position++] = static_cast<unsigned char>((std::min<size_t>(count, 15) << 4) | std::min<size_t>(extra, 15));
+	if (count >= 15) {
+		size_t rest = count - 15;
+		for (; rest >= 255; rest -= 255) {
+			output[position++] = 255;
+		}
+		output[position++] = static_cast<unsigned char>(rest);
+	}
+	std::memcpy(output + position, literals, count);
+	position += count;
+	if (length != 0) {
+		output[position++] = static_cast<unsigned char>(offset);
+		output[position++] = static_cast<unsigned char>(offset >> 8);
+		if (extra >= 15) {
+			size_t rest = extra - 15;
+			for (; rest >= 255; rest -= 255) {
+				output[position++] = 255;
+			}
+			output[position++] = static_cast<unsigned char>(rest);
+		}
+	}
+	return true;
+}
+
+// Returns the compressed size or 0 if it does not fit into capacity.
+inline size_t lz_compress(const unsigned char* input, size_t size, unsigned char* output, size_t capacity) {
+	static const unsigned hash_bits = 12;
+	std::uint32_t table[1 << hash_bits];
+	std::fill(table, table + (1 << hash_bits), 0u);
+	size_t position = 0;
+	size_t anchor = 0;
+	size_t current = 0;
+	while (current + 4 <= size) {
+		std::uint32_t sequence;
+		std::memcpy(&sequence, input + current, 4);
+		auto& entry = table[(sequence * 2654435761u) >> (32 - hash_bits)];
+		size_t candidate = entry;
+		entry = static_cast<std::uint32_t>(current + 1);
+		if (candidate == 0 || current - (candidate - 1) > 65535 || std::memcmp(input + candidate - 1, input + current, 4) != 0) {
+			++current;
+			continue;
+		}
+		size_t match = candidate - 1;
+		size_t length = 4;
+		while (current + length < size && input[match + length] == input[current + length]) {
+			++length;
+		}
+		if (!lz_sequence(output, position, capacity, input + anchor, current - anchor, current - match, length)) {
+			return 0;
+		}
+		current += length;
+		anchor = current;
+	}
+	return lz_sequence(output, position, capacity, input + anchor, size - anchor, 0, 0) ? position : 0;
+}
+
+inline bool lz_length(const unsigned char* input, size_t size, size_t& position, size_t& length) {
+	unsigned char byte;
+	do {
+		if (position >= size) {
+			return false;
+		}
+		byte = input[position++];
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+inline bool lz_decompress(const unsigned char* input, size_t size, unsigned char* output, size_t expected) {
+	size_t position = 0;
+	size_t written = 0;
+	while (position < size) {
+		unsigned token = input[position++];
+		size_t count = token >> 4;
+		if ((count == 15 && !lz_length(input, size, position, count)) || count > size - position || count > expected - written) {
+			return false;
+		}
+		std::memcpy(output + written, input + position, count);
+		position += count;
+		written += count;
+		if (position == size) {
+			break;
+		}
+		if (size - position < 2) {
+			return false;
+		}
+		size_t offset = input[position] | input[position + 1] << 8;
+		position += 2;
+		size_t length = token & 15;
+		if (length == 15 && !lz_length(input, size, position, length)) {
+			return false;
+		}
+		length += 4;
+		if (offset == 0 || offset > written || length > expected - written) {
+			return false;
+		}
+		for (size_t i = 0; i < length; ++i, ++written) {
+			output[written] = output[written - offset];
+		}
+	}
+	return written == expected;
+}
+
+struct compression_counters {
+	compression_counters()
+		: pages_compressed(0)
+		, pages_decompressed(0)
+		, compress_time(0)
+		, decompress_time(0) {
+	}
+
+	std::atomic<long long> pages_compressed;
+	std::atomic<long long> pages_decompressed;
+	std::atomic<long long> compress_time;
+	std::atomic<long long> decompress_time;
+};
+
+static compression_counters compression_counters_instance;
+
+// A compressed database file: a header at offset 0 pointing to the block map, a table of
+// (offset, length, kind) per block, and the blocks in 512 byte units anywhere after data_begin.
+// Replaced blocks are reused only after the next commit, so the map on disk always references
+// intact data, and the header is written after the map is synced. Free space is merged with its
+// neighbours and, once it reaches the end of the file, cut off at the next commit.
+struct compressed_store {
+	static const std::uint32_t unit = 512;
+	static const sqlite3_int64 data_begin = 4096;
+	static const sqlite3_int64 locking_page = 0x40000000;
+	static const size_t header_size = 64;
+	static const size_t map_entry_size = 16;
+	static const std::uint32_t version = 1;
+
+	enum kind_type {
+		block_zero,
+		block_compressed,
+		block_raw
+	};
+
+	struct extent {
+		sqlite3_int64 offset;
+		std::uint32_t length;
+		std::uint32_t kind;
+	};
+
+	struct header {
+		std::uint32_t block_size;
+		sqlite3_int64 logical_size;
+		std::uint64_t generation;
+		sqlite3_int64 map_offset;
+		sqlite3_int64 map_length;
+		std::uint64_t map_checksum;
+	};
+
+	explicit compressed_store(sqlite3_file* real)
+		: real(real) {
+		reset();
+	}
+
+	static sqlite3_int64 rounded(sqlite3_int64 length) {
+		return (length + unit - 1) / unit * unit;
+	}
+
+	void reset() {
+		block_size = 0;
+		logical_size = 0;
+		generation = 0;
+		map.offset = 0;
+		map.length = 0;
+		map.kind = block_zero;
+		blocks.clear();
+		free_extents.clear();
+		free_offsets.clear();
+		pending.clear();
+		end = data_begin;
+		dirty = false;
+		cached = -1;
+	}
+
+	int read_header(header& result) {
+		unsigned char bytes[header_size];
+		auto rc = real->pMethods->xRead(real, bytes, header_size, 0);
+		if (rc != SQLITE_OK) {
+			return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_NOTADB : rc;
+		}
+		if (std::memcmp(bytes, "SQLT3CZ1", 8) != 0 || get_u32(bytes + 12) != version || get_u64(bytes + 56) != fnv1a(bytes, 56)) {
+			return SQLITE_NOTADB;
+		}
+		result.block_size = get_u32(bytes + 8);
+		result.logical_size = static_cast<sqlite3_int64>(get_u64(bytes + 16));
+		result.generation = get_u64(bytes + 24);
+		result.map_offset = static_cast<sqlite3_int64>(get_u64(bytes + 32));
+		result.map_length = static_cast<sqlite3_int64>(get_u64(bytes + 40));
+		result.map_checksum = get_u64(bytes + 48);
+		return SQLITE_OK;
+	}
+
+	int write_header(int sync_flags) {
+		unsigned char bytes[header_size];
+		std::memcpy(bytes, "SQLT3CZ1", 8);
+		put_u32(bytes + 8, block_size);
+		put_u32(bytes + 12, version);
+		put_u64(bytes + 16, static_cast<std::uint64_t>(logical_size));
+		put_u64(bytes + 24, generation);
+		put_u64(bytes + 32, static_cast<std::uint64_t>(map.offset));
+		put_u64(bytes + 40, map.length);
+		put_u64(bytes + 48, map_checksum);
+		put_u64(bytes + 56, fnv1a(bytes, 56));
+		auto rc = real->pMethods->xWrite(real, bytes, header_size, 0);
+		return rc == SQLITE_OK && sync_flags != 0 ? real->pMethods->xSync(real, sync_flags) : rc;
+	}
+
+	int load() {
+		sqlite3_int64 size = 0;
+		auto rc = real->pMethods->xFileSize(real, &size);
+		reset();
+		if (rc != SQLITE_OK || size == 0) {
+			return rc;
+		}
+		header h;
+		rc = read_header(h);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+		std::vector<unsigned char> bytes(static_cast<size_t>(h.map_length));
+		if (h.map_length % map_entry_size != 0
+			|| (!bytes.empty() && real->pMethods->xRead(real, bytes.data(), static_cast<int>(bytes.size()), h.map_offset) != SQLITE_OK)
+			|| fnv1a(bytes.data(), bytes.size()) != h.map_checksum) {
+			return SQLITE_CORRUPT;
+		}
+		block_size = h.block_size;
+		logical_size = h.logical_size;
+		generation = h.generation;
+		map.offset = h.map_offset;
+		map.length = static_cast<std::uint32_t>(h.map_length);
+		map.kind = block_raw;
+		map_checksum = h.map_checksum;
+
+		std::vector<extent> used;
+		if (map.length != 0) {
+			used.push_back(map);
+		}
+		blocks.resize(bytes.size() / map_entry_size);
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			auto& block = blocks[i];
+			block.offset = static_cast<sqlite3_int64>(get_u64(&bytes[i * map_entry_size]));
+			block.length = get_u32(&bytes[i * map_entry_size + 8]);
+			block.kind = get_u32(&bytes[i * map_entry_size + 12]);
+			if (block.kind != block_zero) {
+				used.push_back(block);
+			}
+		}
+		for (auto& e : used) {
+			end = std::max(end, e.offset + rounded(e.length));
+		}
+		if (end > locking_page) {
+			extent locking = { locking_page, unit, block_raw };
+			used.push_back(locking);
+		}
+		std::sort(used.begin(), used.end(), [](const extent& a, const extent& b) {
+			return a.offset < b.offset;
+		});
+		auto position = data_begin;
+		for (auto& e : used) {
+			if (e.offset > position) {
+				add_free(position, e.offset - position);
+			}
+			position = std::max(position, e.offset + rounded(e.length));
+		}
+		return SQLITE_OK;
+	}
+
+	// another connection may have committed while this one held no lock
+	int refresh() {
+		sqlite3_int64 size = 0;
+		auto rc = real->pMethods->xFileSize(real, &size);
+		if (rc != SQLITE_OK || dirty || size == 0) {
+			return rc;
+		}
+		header h;
+		rc = read_header(h);
+		return rc != SQLITE_OK || h.generation == generation ? rc : load();
+	}
+
+	void remove_free(sqlite3_int64 offset, sqlite3_int64 size) {
+		auto range = free_extents.equal_range(size);
+		for (auto itr = range.first; itr != range.second; ++itr) {
+			if (itr->second == offset) {
+				free_extents.erase(itr);
+				break;
+			}
+		}
+		free_offsets.erase(offset);
+	}
+
+	void add_free(sqlite3_int64 offset, sqlite3_int64 size) {
+		auto next = free_offsets.lower_bound(offset);
+		if (next != free_offsets.end() && next->first == offset + size) {
+			auto merged = *next;
+			remove_free(merged.first, merged.second);
+			size += merged.second;
+		}
+		auto previous = free_offsets.lower_bound(offset);
+		if (previous != free_offsets.begin() && std::prev(previous)->first + std::prev(previous)->second == offset) {
+			auto merged = *std::prev(previous);
+			remove_free(merged.first, merged.second);
+			offset = merged.first;
+			size += merged.second;
+		}
+		free_extents.insert(std::make_pair(size, offset));
+		free_offsets[offset] = size;
+	}
+
+	// the locking page is never used, the end may move back across it
+	void trim() {
+		for (;;) {
+			if (end == locking_page + unit) {
+				end = locking_page;
+			}
+			if (free_offsets.empty()) {
+				break;
+			}
+			auto last = *free_offsets.rbegin();
+			if (last.first + last.second != end) {
+				break;
+			}
+			remove_free(last.first, last.second);
+			end = last.first;
+		}
+	}
+
+	sqlite3_int64 allocate(sqlite3_int64 length) {
+		auto bytes = rounded(length);
+		auto itr = free_extents.lower_bound(bytes);
+		if (itr != free_extents.end()) {
+			auto offset = itr->second;
+			auto size = itr->first;
+			remove_free(offset, size);
+			if (size > bytes) {
+				add_free(offset + bytes, size - bytes);
+			}
+			return offset;
+		}
+		auto offset = end;
+		if (offset < locking_page + unit && offset + bytes > locking_page) {
+			if (locking_page > offset) {
+				add_free(offset, locking_page - offset);
+			}
+			offset = locking_page + unit;
+		}
+		end = offset + bytes;
+		return offset;
+	}
+
+	void release(const extent& e) {
+		if (e.kind != block_zero) {
+			pending.push_back(e);
+		}
+	}
+
+	int read_block(size_t index, unsigned char* output) {
+		if (index >= blocks.size() || blocks[index].kind == block_zero) {
+			std::memset(output, 0, block_size);
+			return SQLITE_OK;
+		}
+		auto& e = blocks[index];
+		if (e.kind == block_raw) {
+			auto rc = real->pMethods->xRead(real, output, static_cast<int>(block_size), e.offset);
+			return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_CORRUPT : rc;
+		}
+		buffer.resize(e.length);
+		auto rc = real->pMethods->xRead(real, buffer.data(), static_cast<int>(e.length), e.offset);
+		if (rc != SQLITE_OK) {
+			return rc == SQLITE_IOERR_SHORT_READ ? SQLITE_CORRUPT : rc;
+		}
+		auto start = std::chrono::steady_clock::now();
+		auto valid = lz_decompress(buffer.data(), e.length, output, block_size);
+		compression_counters_instance.decompress_time.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+		compression_counters_instance.pages_decompressed.fetch_add(1, std::memory_order_relaxed);
+		return valid ? SQLITE_OK : SQLITE_CORRUPT;
+	}
+
+	int write_block(size_t index, const unsigned char* data) {
+		extent e = { 0, 0, block_zero };
+		if (std::any_of(data, data + block_size, [](unsigned char c) { return c != 0; })) {
+			buffer.resize(block_size);
+			auto start = std::chrono::steady_clock::now();
+			auto length = lz_compress(data, block_size, buffer.data(), block_size);
+			compression_counters_instance.compress_time.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+			compression_counters_instance.pages_compressed.fetch_add(1, std::memory_order_relaxed);
+			auto payload = data;
+			e.kind = block_raw;
+			e.length = block_size;
+			if (length != 0 && rounded(length) < rounded(block_size)) {
+				payload = buffer.data();
+				e.kind = block_compressed;
+				e.length = static_cast<std::uint32_t>(length);
+			}
+			e.offset = allocate(e.length);
+			auto rc = real->pMethods->xWrite(real, payload, static_cast<int>(e.length), e.offset);
+			if (rc != SQLITE_OK) {
+				return rc;
+			}
+		}
+		if (index >= blocks.size()) {
+			extent zero = { 0, 0, block_zero };
+			blocks.resize(index + 1, zero);
+		}
+		release(blocks[index]);
+		blocks[index] = e;
+		if (cached == static_cast<sqlite3_int64>(index) && data != block.data()) {
+			std::memcpy(block.data(), data, block_size);
+		}
+		dirty = true;
+		return SQLITE_OK;
+	}
+
+	int cache(size_t index) {
+		if (cached != static_cast<sqlite3_int64>(index)) {
+			block.resize(block_size);
+			cached = -1;
+			auto rc = read_block(index, block.data());
+			if (rc != SQLITE_OK) {
+				return rc;
+			}
+			cached = static_cast<sqlite3_int64>(index);
+		}
+		return SQLITE_OK;
+	}
+
+	int read(void* buffer, int amount, sqlite3_int64 offset) {
+		auto output = static_cast<unsigned char*>(buffer);
+		auto available = offset < logical_size ? static_cast<int>(std::min<sqlite3_int64>(amount, logical_size - offset)) : 0;
+		for (int done = 0; done < available;) {
+			auto position = offset + done;
+			auto index = static_cast<size_t>(position / block_size);
+			auto within = static_cast<size_t>(position % block_size);
+			auto length = std::min(static_cast<size_t>(available - done), block_size - within);
+			if (within == 0 && length == block_size) {
+				auto rc = read_block(index, output + done);
+				if (rc != SQLITE_OK) {
+					return rc;
+				}
+			}
+			else {
+				auto rc = cache(index);
+				if (rc != SQLITE_OK) {
+					return rc;
+				}
+				std::memcpy(output + done, block.data() + within, length);
+			}
+			done += static_cast<int>(length);
+		}
+		if (available < amount) {
+			std::memset(output + available, 0, static_cast<size_t>(amount - available));
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+
+	int write(const void* buffer, int amount, sqlite3_int64 offset) {
+		if (block_size == 0) {
+			bool page = offset == 0 && amount >= 512 && amount <= 65536 && (amount & (amount - 1)) == 0;
+			block_size = page ? static_cast<std::uint32_t>(amount) : 4096;
+		}
+		auto input = static_cast<const unsigned char*>(buffer);
+		for (int done = 0; done < amount;) {
+			auto position = offset + done;
+			auto index = static_cast<size_t>(position / block_size);
+			auto within = static_cast<size_t>(position % block_size);
+			auto length = std::min(static_cast<size_t>(amount - done), block_size - within);
+			int rc;
+			if (within == 0 && length == block_size) {
+				rc = write_block(index, input + done);
+			}
+			else {
+				rc = cache(index);
+				if (rc == SQLITE_OK) {
+					std::memcpy(block.data() + within, input + done, length);
+					rc = write_block(index, block.data());
+				}
+			}
+			if (rc != SQLITE_OK) {
+				return rc;
+			}
+			done += static_cast<int>(length);
+		}
+		logical_size = std::max(logical_size, offset + amount);
+		return SQLITE_OK;
+	}
+
+	int truncate(sqlite3_int64 size) {
+		if (size >= logical_size) {
+			return SQLITE_OK;
+		}
+		if (block_size != 0) {
+			auto keep = static_cast<size_t>((size + block_size - 1) / block_size);
+			for (size_t i = keep; i < blocks.size(); ++i) {
+				release(blocks[i]);
+			}
+			if (keep < blocks.size()) {
+				blocks.resize(keep);
+			}
+			if (cached >= static_cast<sqlite3_int64>(keep)) {
+				cached = -1;
+			}
+			if (size % block_size != 0) {
+				auto rc = cache(keep - 1);
+				if (rc != SQLITE_OK) {
+					return rc;
+				}
+				std::memset(block.data() + size % block_size, 0, block_size - size % block_size);
+				rc = write_block(keep - 1, block.data());
+				if (rc != SQLITE_OK) {
+					return rc;
+				}
+			}
+		}
+		logical_size = size;
+		dirty = true;
+		return SQLITE_OK;
+	}
+
+	// Writes the map and then the header, with a sync after each if sync_flags is not zero.
+	int commit(int sync_flags) {
+		if (!dirty) {
+			return SQLITE_OK;
+		}
+		std::vector<unsigned char> bytes(blocks.size() * map_entry_size);
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			put_u64(&bytes[i * map_entry_size], static_cast<std::uint64_t>(blocks[i].offset));
+			put_u32(&bytes[i * map_entry_size + 8], blocks[i].length);
+			put_u32(&bytes[i * map_entry_size + 12], blocks[i].kind);
+		}
+		extent next = { 0, static_cast<std::uint32_t>(bytes.size()), bytes.empty() ? block_zero : block_raw };
+		if (!bytes.empty()) {
+			next.offset = allocate(next.length);
+			auto rc = real->pMethods->xWrite(real, bytes.data(), static_cast<int>(bytes.size()), next.offset);
+			if (rc == SQLITE_OK && sync_flags != 0) {
+				rc = real->pMethods->xSync(real, sync_flags);
+			}
+			if (rc != SQLITE_OK) {
+				return rc;
+			}
+		}
+		release(map);
+		map = next;
+		map_checksum = fnv1a(bytes.data(), bytes.size());
+		++generation;
+		auto rc = write_header(sync_flags);
+		if (rc != SQLITE_OK) {
+			return rc;
+		}
+		for (auto& e : pending) {
+			add_free(e.offset, rounded(e.length));
+		}
+		pending.clear();
+		dirty = false;
+
+		// nothing the header references lies past end any more
+		trim();
+		sqlite3_int64 size = 0;
+		rc = real->pMethods->xFileSize(real, &size);
+		if (rc == SQLITE_OK && size > end) {
+			rc = real->pMethods->xTruncate(real, end);
+		}
+		return rc;
+	}
+
+	long long stored_bytes() const {
+		long long result = 0;
+		for (auto& e : blocks) {
+			result += e.length;
+		}
+		return result;
+	}
+
+	sqlite3_file* real;
+	std::uint32_t block_size;
+	sqlite3_int64 logical_size;
+	std::uint64_t generation;
+	extent map;
+	std::uint64_t map_checksum;
+	std::vector<extent> blocks;
+	std::multimap<sqlite3_int64, sqlite3_int64> free_extents;
+	std::map<sqlite3_int64, sqlite3_int64> free_offsets;
+	std::vector<extent> pending;
+	sqlite3_int64 end;
+	bool dirty;
+	std::vector<unsigned char> buffer;
+	std::vector<unsigned char> block;
+	sqlite3_int64 cached;
+};
+
+struct compressed_file {
+	shim_file shim;
+	compressed_store* store;
+	int lock;
+};
+
+// Only main databases are compressed. Their methods have iVersion 1: without xShmMap and xFetch
+// SQLite neither maps the compressed file nor shares a WAL index between connections, whose
+// block maps would go stale while another connection checkpoints.
+struct compressed {
+	static sqlite3_io_methods methods[3];
+	static sqlite3_io_methods main_methods;
+	static sqlite3_vfs vfs;
+
+	static compressed_store& store(sqlite3_file* file) {
+		return *reinterpret_cast<compressed_file*>(file)->store;
+	}
+
+	static bool owns(sqlite3_file* file) {
+		return file->pMethods == &main_methods;
+	}
+
+	template <typename Function>
+	static int guarded(Function function) {
+		try {
+			return function();
+		}
+		catch (const std::bad_alloc&) {
+			return SQLITE_IOERR_NOMEM;
+		}
+	}
+
+	static int xOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+		auto f = reinterpret_cast<compressed_file*>(file);
+		f->store = nullptr;
+		f->lock = SQLITE_LOCK_NONE;
+		auto result = shim::open(vfs, name, file, flags, out_flags, shim::file_size<compressed_file>(), methods);
+		if (result == SQLITE_OK && (flags & SQLITE_OPEN_MAIN_DB) != 0) {
+			f->store = new (std::nothrow) compressed_store(shim::real(file));
+			result = f->store ? guarded([&] { return f->store->load(); }) : SQLITE_NOMEM;
+			if (result != SQLITE_OK) {
+				delete f->store;
+				f->store = nullptr;
+				shim::xClose(file);
+				file->pMethods = nullptr;
+				return result;
+			}
+			file->pMethods = &main_methods;
+		}
+		return result;
+	}
+
+	static int xClose(sqlite3_file* file) {
+		auto f = reinterpret_cast<compressed_file*>(file);
+		auto result = guarded([&] { return f->store->commit(0); });
+		delete f->store;
+		auto closed = shim::xClose(file);
+		return result != SQLITE_OK ? result : closed;
+	}
+
+	static int xRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+		return guarded([&] { return store(file).read(buffer, amount, offset); });
+	}
+
+	static int xWrite(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset) {
+		return guarded([&] { return store(file).write(buffer, amount, offset); });
+	}
+
+	static int xTruncate(sqlite3_file* file, sqlite3_int64 size) {
+		return guarded([&] { return store(file).truncate(size); });
+	}
+
+	static int xSync(sqlite3_file* file, int flags) {
+		auto committed = store(file).dirty;
+		auto result = guarded([&] { return store(file).commit(flags); });
+		return result != SQLITE_OK || committed ? result : shim::xSync(file, flags);
+	}
+
+	static int xFileSize(sqlite3_file* file, sqlite3_int64* size) {
+		*size = store(file).logical_size;
+		return SQLITE_OK;
+	}
+
+	static int xLock(sqlite3_file* file, int level) {
+		auto f = reinterpret_cast<compressed_file*>(file);
+		auto result = shim::xLock(file, level);
+		if (result == SQLITE_OK && f->lock == SQLITE_LOCK_NONE) {
+			result = guarded([&] { return f->store->refresh(); });
+			if (result != SQLITE_OK) {
+				shim::xUnlock(file, SQLITE_LOCK_NONE);
+				return result;
+			}
+		}
+		if (result == SQLITE_OK) {
+			f->lock = level;
+		}
+		return result;
+	}
+
+	// without synchronous commits the map is written when the write lock is released
+	static int xUnlock(sqlite3_file* file, int level) {
+		auto f = reinterpret_cast<compressed_file*>(file);
+		auto result = level <= SQLITE_LOCK_SHARED ? guarded([&] { return f->store->commit(0); }) : SQLITE_OK;
+		auto unlocked = shim::xUnlock(file, level);
+		if (unlocked == SQLITE_OK) {
+			f->lock = level;
+		}
+		return result != SQLITE_OK ? result : unlocked;
+	}
+
+	static int xFileControl(sqlite3_file* file, int op, void* argument) {
+		if (op == SQLITE_FCNTL_SIZE_HINT || op == SQLITE_FCNTL_CHUNK_SIZE) {
+			return SQLITE_OK;
+		}
+		return shim::xFileControl(file, op, argument);
+	}
+
+	static int xDeviceCharacteristics(sqlite3_file* file) {
+		return shim::xDeviceCharacteristics(file) & (SQLITE_IOCAP_POWERSAFE_OVERWRITE | SQLITE_IOCAP_UNDELETABLE_WHEN_OPEN);
+	}
+
+	static void init(sqlite3_vfs* real) {
+		shim::io_methods(methods);
+		main_methods = methods[0];
+		main_methods.xClose = &xClose;
+		main_methods.xRead = &xRead;
+		main_methods.xWrite = &xWrite;
+		main_methods.xTruncate = &xTruncate;
+		main_methods.xSync = &xSync;
+		main_methods.xFileSize = &xFileSize;
+		main_methods.xLock = &xLock;
+		main_methods.xUnlock = &xUnlock;
+		main_methods.xFileControl = &xFileControl;
+		main_methods.xDeviceCharacteristics = &xDeviceCharacteristics;
+		shim::make_vfs(vfs, real, compress_vfs, shim::file_size<compressed_file>(), &xOpen);
+	}
+};
+
+sqlite3_io_methods compressed::methods[3];
+sqlite3_io_methods compressed::main_methods;
+sqlite3_vfs compressed::vfs;
+
+#if !defined(_WIN32) && (defined(O_DIRECT) || defined(F_NOCACHE))
+#define SQLT3_DIRECT_IO 1
+#endif
+
+struct direct_key {
+	std::uint64_t file;
+	std::uint64_t block;
+
+	bool operator==(const direct_key& that) const {
+		return file == that.file && block == that.block;
+	}
+};
+
+struct direct_key_hash {
+	size_t operator()(const direct_key& key) const {
+		return std::hash<std::uint64_t>()(key.file * 0x9e3779b97f4a7c15ull ^ key.block);
+	}
+};
+
+// Blocks of direct files cached in aligned frames, split into shards with their own mutex, CLOCK
+// hand and index. Files get a new id whenever their cached blocks become invalid.
+struct direct_pool {
+	static const size_t block_size = 4096;
+	static const size_t shard_count = 16;
+
+	struct frame {
+		direct_key key;
+		bool used;
+		bool referenced;
+	};
+
+	struct shard {
+		shard()
+			: first(0)
+			, hand(0) {
+		}
+
+		std::mutex mutex;
+		std::unordered_map<direct_key, size_t, direct_key_hash> index;
+		std::vector<frame> frames;
+		size_t first;
+		size_t hand;
+	};
+
+	direct_pool()
+		: raw(nullptr)
+		, memory(nullptr)
+		, count(0)
+		, next_id(1)
+		, hits(0)
+		, misses(0)
+		, evictions(0)
+		, reads(0)
+		, writes(0)
+		, fallback_files(0) {
+	}
+
+	~direct_pool() {
+		std::free(raw);
+	}
+
+	void configure(size_t size) {
+		auto per_shard = std::max<size_t>(1, size / block_size / shard_count);
+		auto bytes = per_shard * shard_count * block_size;
+		raw = std::malloc(bytes + block_size);
+		if (raw == nullptr) {
+			throw std::bad_alloc();
+		}
+		memory = reinterpret_cast<unsigned char*>((reinterpret_cast<std::uintptr_t>(raw) + block_size - 1) / block_size * block_size);
+		count = per_shard * shard_count;
+		for (size_t i = 0; i < shard_count; ++i) {
+			frame empty = { { 0, 0 }, false, false };
+			shards[i].frames.assign(per_shard, empty);
+			shards[i].first = i * per_shard;
+		}
+	}
+
+	shard& shard_of(const direct_key& key) {
+		return shards[direct_key_hash()(key) % shard_count];
+	}
+
+	unsigned char* data(const shard& s, size_t frame) {
+		return memory + (s.first + frame) * block_size;
+	}
+
+	bool lookup(const direct_key& key, unsigned char* output, size_t from, size_t length) {
+		auto& s = shard_of(key);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto itr = s.index.find(key);
+		if (itr == s.index.end()) {
+			return false;
+		}
+		s.frames[itr->second].referenced = true;
+		std::memcpy(output, data(s, itr->second) + from, length);
+		return true;
+	}
+
+	// blocks read from disk are kept only if no write to the file began or ended meanwhile
+	void store(const direct_key& key, const unsigned char* input, const std::atomic<std::uint64_t>* writes = nullptr, std::uint64_t seen = 0) {
+		auto& s = shard_of(key);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		if (writes != nullptr && ((seen & 1) != 0 || writes->load() != seen)) {
+			return;
+		}
+		auto itr = s.index.find(key);
+		size_t victim;
+		if (itr != s.index.end()) {
+			victim = itr->second;
+		}
+		else {
+			for (;; s.hand = (s.hand + 1) % s.frames.size()) {
+				auto& f = s.frames[s.hand];
+				if (!f.used || !f.referenced) {
+					break;
+				}
+				f.referenced = false;
+			}
+			victim = s.hand;
+			s.hand = (s.hand + 1) % s.frames.size();
+			auto& f = s.frames[victim];
+			if (f.used) {
+				s.index.erase(f.key);
+				evictions.fetch_add(1, std::memory_order_relaxed);
+			}
+			f.key = key;
+			f.used = true;
+			s.index[key] = victim;
+		}
+		s.frames[victim].referenced = true;
+		std::memcpy(data(s, victim), input, block_size);
+	}
+
+	void* raw;
+	unsigned char* memory;
+	size_t count;
+	shard shards[shard_count];
+	std::atomic<std::uint64_t> next_id;
+	std::atomic<long long> hits;
+	std::atomic<long long> misses;
+	std::atomic<long long> evictions;
+	std::atomic<long long> reads;
+	std::atomic<long long> writes;
+	std::atomic<long long> fallback_files;
+};
+
+static direct_pool direct_pool_instance;
+
+struct direct_inode {
+	direct_inode()
+		: opens(0)
+		, id(0)
+		, size(0)
+		, writes(0)
+		, known(false) {
+	}
+
+	int opens;
+	std::atomic<std::uint64_t> id;
+	std::atomic<sqlite3_int64> size;
+	std::atomic<std::uint64_t> writes;
+	// the first block as of the last validation or write of this process, guarded by mutex
+	std::mutex mutex;
+	bool known;
+	unsigned char first[direct_pool::block_size];
+};
+
+struct direct_file {
+	shim_file shim;
+	int fd;
+	int lock;
+	direct_inode* inode;
+	std::pair<std::uint64_t, std::uint64_t> inode_key;
+	unsigned char* scratch;
+	void* scratch_raw;
+	size_t scratch_size;
+};
+
+// Only main databases are opened for direct I/O, their methods have iVersion 2 so SQLite never
+// memory-maps them. The unix VFS may hand a closed descriptor to a later open, direct mode is
+// switched off again before a file is closed.
+struct direct {
+	static const size_t block_size = direct_pool::block_size;
+
+	static sqlite3_io_methods methods[3];
+	static sqlite3_io_methods main_methods;
+	static sqlite3_vfs vfs;
+	static std::mutex mutex;
+	static std::map<std::pair<std::uint64_t, std::uint64_t>, direct_inode> inodes;
+
+	static direct_file* cast(sqlite3_file* file) {
+		return reinterpret_cast<direct_file*>(file);
+	}
+
+	static void renew(direct_inode* inode) {
+		inode->id.store(direct_pool_instance.next_id.fetch_add(1));
+	}
+
+	static unsigned char* scratch(direct_file* f, size_t size) {
+		if (f->scratch_size < size) {
+			std::free(f->scratch_raw);
+			f->scratch_size = 0;
+			f->scratch_raw = std::malloc(size + block_size);
+			if (f->scratch_raw == nullptr) {
+				return f->scratch = nullptr;
+			}
+			f->scratch = reinterpret_cast<unsigned char*>((reinterpret_cast<std::uintptr_t>(f->scratch_raw) + block_size - 1) / block_size * block_size);
+			f->scratch_size = size;
+		}
+		return f->scratch;
+	}
+
+#if defined(SQLT3_DIRECT_IO)
+	static bool set_direct(int fd, bool enable) {
+#if defined(O_DIRECT)
+		auto flags = fcntl(fd, F_GETFL);
+		return flags != -1 && fcntl(fd, F_SETFL, enable ? flags | O_DIRECT : flags & ~O_DIRECT) == 0;
+#else
+		return fcntl(fd, F_NOCACHE, enable ? 1 : 0) == 0;
+#endif
+	}
+
+	// reads the aligned range, zero filled past the end of the file
+	static bool read_span(int fd, unsigned char* output, size_t length, sqlite3_int64 offset) {
+		size_t done = 0;
+		while (done < length) {
+			auto result = pread(fd, output + done, length - done, offset + static_cast<sqlite3_int64>(done));
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+			if (result < 0) {
+				return false;
+			}
+			if (result == 0) {
+				std::memset(output + done, 0, length - done);
+				break;
+			}
+			done += static_cast<size_t>(result);
+		}
+		direct_pool_instance.reads.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	static int write_span(int fd, const unsigned char* input, size_t length, sqlite3_int64 offset) {
+		size_t done = 0;
+		while (done < length) {
+			auto result = pwrite(fd, input + done, length - done, offset + static_cast<sqlite3_int64>(done));
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+			if (result <= 0) {
+				return result < 0 && errno == ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+			}
+			done += static_cast<size_t>(result);
+		}
+		direct_pool_instance.writes.fetch_add(1, std::memory_order_relaxed);
+		return SQLITE_OK;
+	}
+#else
+	static bool set_direct(int, bool) {
+		return false;
+	}
+
+	static bool read_span(int, unsigned char*, size_t, sqlite3_int64) {
+		return false;
+	}
+
+	static int write_span(int, const unsigned char*, size_t, sqlite3_int64) {
+		return SQLITE_IOERR_WRITE;
+	}
+#endif
+
+	static bool load_block(direct_file* f, std::uint64_t block, unsigned char* output) {
+		direct_key key = { f->inode->id.load(), block };
+		if (direct_pool_instance.lookup(key, output, 0, block_size)) {
+			return true;
+		}
+		auto seen = f->inode->writes.load();
+		if (!read_span(f->fd, output, block_size, static_cast<sqlite3_int64>(block * block_size))) {
+			return false;
+		}
+		direct_pool_instance.store(key, output, &f->inode->writes, seen);
+		return true;
+	}
+
+	static int read(direct_file* f, void* buffer, int amount, sqlite3_int64 offset) {
+		auto output = static_cast<unsigned char*>(buffer);
+		auto size = f->inode->size.load();
+		auto available = offset < size ? static_cast<size_t>(std::min<sqlite3_int64>(amount, size - offset)) : 0;
+		if (available > 0) {
+			auto id = f->inode->id.load();
+			auto first = static_cast<std::uint64_t>(offset) / block_size;
+			auto last = (static_cast<std::uint64_t>(offset) + available - 1) / block_size;
+			bool hit = true;
+			for (auto block = first; block <= last && hit; ++block) {
+				auto begin = std::max<sqlite3_int64>(offset, block * block_size);
+				auto end = std::min<sqlite3_int64>(offset + available, (block + 1) * block_size);
+				direct_key key = { id, block };
+				hit = direct_pool_instance.lookup(key, output + (begin - offset), static_cast<size_t>(begin - block * block_size), static_cast<size_t>(end - begin));
+			}
+			if (hit) {
+				direct_pool_instance.hits.fetch_add(1, std::memory_order_relaxed);
+			}
+			else {
+				direct_pool_instance.misses.fetch_add(1, std::memory_order_relaxed);
+				auto length = static_cast<size_t>(last - first + 1) * block_size;
+				auto span = scratch(f, length);
+				if (span == nullptr) {
+					return SQLITE_IOERR_NOMEM;
+				}
+				auto seen = f->inode->writes.load();
+				if (!read_span(f->fd, span, length, static_cast<sqlite3_int64>(first * block_size))) {
+					return SQLITE_IOERR_READ;
+				}
+				std::memcpy(output, span + (offset - first * block_size), available);
+				for (auto block = first; block <= last; ++block) {
+					direct_key key = { id, block };
+					direct_pool_instance.store(key, span + (block - first) * block_size, &f->inode->writes, seen);
+				}
+			}
+		}
+		if (available < static_cast<size_t>(amount)) {
+			std::memset(output + available, 0, static_cast<size_t>(amount) - available);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+
+	static int write(direct_file* f, const void* buffer, int amount, sqlite3_int64 offset) {
+		auto first = static_cast<std::uint64_t>(offset) / block_size;
+		auto last = (static_cast<std::uint64_t>(offset) + amount - 1) / block_size;
+		auto length = static_cast<size_t>(last - first + 1) * block_size;
+		auto begin = static_cast<sqlite3_int64>(first * block_size);
+		auto span = scratch(f, length);
+		if (span == nullptr) {
+			return SQLITE_IOERR_NOMEM;
+		}
+		if (offset != begin && !load_block(f, first, span)) {
+			return SQLITE_IOERR_READ;
+		}
+		if ((offset + amount) % block_size != 0 && (last != first || offset == begin) && !load_block(f, last, span + length - block_size)) {
+			return SQLITE_IOERR_READ;
+		}
+		std::memcpy(span + (offset - begin), buffer, static_cast<size_t>(amount));
+		f->inode->writes.fetch_add(1);
+		auto result = write_span(f->fd, span, length, begin);
+		auto size = std::max(f->inode->size.load(), offset + amount);
+		if (result == SQLITE_OK && begin + static_cast<sqlite3_int64>(length) > size && ftruncate(f->fd, size) != 0) {
+			result = SQLITE_IOERR_WRITE;
+		}
+		if (result == SQLITE_OK) {
+			f->inode->size.store(size);
+			auto id = f->inode->id.load();
+			for (auto block = first; block <= last; ++block) {
+				direct_key key = { id, block };
+				direct_pool_instance.store(key, span + (block - first) * block_size);
+			}
+			if (first == 0) {
+				remember(f->inode, span);
+			}
+		}
+		else {
+			renew(f->inode);
+		}
+		f->inode->writes.fetch_add(1);
+		return result;
+	}
+
+	static void attach(direct_file* f) {
+#if defined(SQLT3_DIRECT_IO)
+		struct stat status;
+		if (f->fd < 0 || fstat(f->fd, &status) != 0 || !set_direct(f->fd, true)) {
+			f->fd = -1;
+			direct_pool_instance.fallback_files.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		f->inode_key = std::make_pair(static_cast<std::uint64_t>(status.st_dev), static_cast<std::uint64_t>(status.st_ino));
+		std::lock_guard<std::mutex> lock(mutex);
+		f->inode = &inodes[f->inode_key];
+		if (f->inode->opens++ == 0) {
+			renew(f->inode);
+			f->inode->size.store(status.st_size);
+		}
+#else
+		f->fd = -1;
+		direct_pool_instance.fallback_files.fetch_add(1, std::memory_order_relaxed);
+#endif
+	}
+
+	static void detach(direct_file* f) {
+		if (f->inode != nullptr) {
+			set_direct(f->fd, false);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--f->inode->opens == 0) {
+				inodes.erase(f->inode_key);
+			}
+			f->inode = nullptr;
+		}
+	}
+
+	static void remember(direct_inode* inode, const unsigned char* block) {
+		std::lock_guard<std::mutex> lock(inode->mutex);
+		std::memcpy(inode->first, block, block_size);
+		inode->known = true;
+	}
+
+	// Another process may have changed the file while this connection held no lock. It always
+	// rewrites the header (the change counter), so the first block is compared with the copy taken
+	// the last time, whether or not the pool still holds it.
+	static void validate(direct_file* f) {
+#if defined(SQLT3_DIRECT_IO)
+		struct stat status;
+		auto span = scratch(f, block_size);
+		auto changed = fstat(f->fd, &status) != 0 || status.st_size != f->inode->size.load()
+			|| span == nullptr || !read_span(f->fd, span, block_size, 0);
+		if (!changed) {
+			std::lock_guard<std::mutex> lock(f->inode->mutex);
+			changed = !f->inode->known || std::memcmp(f->inode->first, span, block_size) != 0;
+			std::memcpy(f->inode->first, span, block_size);
+			f->inode->known = true;
+		}
+		if (changed) {
+			renew(f->inode);
+			f->inode->size.store(status.st_size);
+		}
+#else
+		(void)f;
+#endif
+	}
+
+	static int xOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+		auto f = cast(file);
+		f->fd = -1;
+		f->lock = SQLITE_LOCK_NONE;
+		f->inode = nullptr;
+		f->scratch = nullptr;
+		f->scratch_raw = nullptr;
+		f->scratch_size = 0;
+		auto result = shim::open(vfs, name, file, flags, out_flags, shim::file_size<direct_file>(), methods);
+		if (result == SQLITE_OK && (flags & SQLITE_OPEN_MAIN_DB) != 0) {
+			f->fd = unix_descriptor(shim::real(vfs), name, shim::real(file));
+			attach(f);
+			if (f->fd >= 0) {
+				file->pMethods = &main_methods;
+			}
+		}
+		return result;
+	}
+
+	static int xClose(sqlite3_file* file) {
+		auto f = cast(file);
+		detach(f);
+		std::free(f->scratch_raw);
+		return shim::xClose(file);
+	}
+
+	static int xRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+		return read(cast(file), buffer, amount, offset);
+	}
+
+	static int xWrite(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset) {
+		return write(cast(file), buffer, amount, offset);
+	}
+
+	static int xTruncate(sqlite3_file* file, sqlite3_int64 size) {
+		auto f = cast(file);
+		auto result = shim::xTruncate(file, size);
+		if (result == SQLITE_OK) {
+			renew(f->inode);
+			f->inode->size.store(size);
+		}
+		return result;
+	}
+
+	static int xLock(sqlite3_file* file, int level) {
+		auto f = cast(file);
+		auto result = shim::xLock(file, level);
+		if (result == SQLITE_OK) {
+			if (f->lock == SQLITE_LOCK_NONE) {
+				validate(f);
+			}
+			f->lock = level;
+		}
+		return result;
+	}
+
+	static int xUnlock(sqlite3_file* file, int level) {
+		auto result = shim::xUnlock(file, level);
+		if (result == SQLITE_OK) {
+			cast(file)->lock = level;
+		}
+		return result;
+	}
+
+	// hints would make the unix VFS extend the file with unaligned writes
+	static int xFileControl(sqlite3_file* file, int op, void* argument) {
+		if (op == SQLITE_FCNTL_SIZE_HINT || op == SQLITE_FCNTL_CHUNK_SIZE) {
+			return SQLITE_OK;
+		}
+		return shim::xFileControl(file, op, argument);
+	}
+
+	static void init(sqlite3_vfs* real) {
+		if (direct_pool_instance.memory == nullptr) {
+			direct_pool_instance.configure(direct_io_options().pool_size);
+		}
+		shim::io_methods(methods);
+		main_methods = methods[1];
+		main_methods.xClose = &xClose;
+		main_methods.xRead = &xRead;
+		main_methods.xWrite = &xWrite;
+		main_methods.xTruncate = &xTruncate;
+		main_methods.xLock = &xLock;
+		main_methods.xUnlock = &xUnlock;
+		main_methods.xFileControl = &xFileControl;
+		shim::make_vfs(vfs, real, direct_vfs, shim::file_size<direct_file>(), &xOpen);
+	}
+};
+
+sqlite3_io_methods direct::methods[3];
+sqlite3_io_methods direct::main_methods;
+sqlite3_vfs direct::vfs;
+std::mutex direct::mutex;
+std::map<std::pair<std::uint64_t, std::uint64_t>, direct_inode> direct::inodes;
+
+static std::mutex vfs_mutex;
+
+// Registers the wrapper VFS called name on top of the default VFS, other names are left to SQLite.
+inline void register_vfs(const char* name) {
+	struct entry {
+		const char* name;
+		sqlite3_vfs* vfs;
+		void (*init)(sqlite3_vfs*);
+	};
+	static const entry entries[] = {
+		{ uring_vfs, &uring::vfs, &uring::init },
+		{ readahead_vfs, &readahead::vfs, &readahead::init },
+		{ accounting_vfs, &accounting::vfs, &accounting::init },
+		{ memory_vfs, &memory::vfs, &memory::init },
+		{ compress_vfs, &compressed::vfs, &compressed::init },
+		{ direct_vfs, &direct::vfs, &direct::init }
+	};
+
+	if (name == nullptr) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(vfs_mutex);
+	for (auto& e : entries) {
+		if (std::strcmp(name, e.name) == 0 && sqlite3_vfs_find(name) == nullptr) {
+			auto real = sqlite3_vfs_find(nullptr);
+			if (real == nullptr) {
+				throw std::runtime_error("no default VFS");
+			}
+			e.init(real);
+			auto result = sqlite3_vfs_register(e.vfs, 0);
+			if (result != SQLITE_OK) {
+				impl::throw_exception(result, name);
+			}
+		}
+	}
+}
+
+}
+
+uring_stats uring_status() {
+	auto& counters = detail::uring_counters_instance;
+	uring_stats result;
+	result.available = detail::local_uring() != nullptr;
+	result.enters = counters.enters.load();
+	result.submissions = counters.submissions.load();
+	result.reads = counters.reads.load();
+	result.writes = counters.writes.load();
+	result.fallback_calls = counters.fallback_calls.load();
+	return result;
+}
+
+memory_vfs_stats memory_vfs_status() {
+	memory_vfs_stats result;
+	result.files = detail::memory_counters_instance.files.load();
+	result.bytes = detail::memory_counters_instance.bytes.load();
+	return result;
+}
+
+void configure_direct_io(const direct_io_options& options) {
+	std::lock_guard<std::mutex> lock(detail::vfs_mutex);
+	if (detail::direct_pool_instance.memory != nullptr) {
+		throw std::logic_error("configure_direct_io");
+	}
+	detail::direct_pool_instance.configure(options.pool_size);
+}
+
+direct_io_stats direct_io_status() {
+	auto& pool = detail::direct_pool_instance;
+	direct_io_stats result;
+	result.hits = pool.hits.load();
+	result.misses = pool.misses.load();
+	result.evictions = pool.evictions.load();
+	result.reads = pool.reads.load();
+	result.writes = pool.writes.load();
+	result.fallback_files = pool.fallback_files.load();
+	result.frames = static_cast<long long>(pool.count);
+	result.frames_in_use = 0;
+	for (auto& shard : pool.shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		result.frames_in_use += static_cast<long long>(shard.index.size());
+	}
+	return result;
+}
+
+void configure_readahead(const readahead_options& options) {
+	if (options.trigger_reads == 0 || options.window == 0 || options.max_window < options.window) {
+		throw std::invalid_argument("options");
+	}
+	detail::readahead_instance.trigger_reads.store(options.trigger_reads);
+	detail::readahead_instance.window.store(options.window);
+	detail::readahead_instance.max_window.store(options.max_window);
+}
+
+readahead_stats readahead_status() {
+	auto& settings = detail::readahead_instance;
+	readahead_stats result;
+	result.advices = settings.advices.load();
+	result.prefetched_bytes = settings.prefetched_bytes.load();
+	result.used_bytes = settings.used_bytes.load();
+	return result;
+}
+
+database::database()
+	: _impl(nullptr) {
+}
+
+database::database(database&& that)
+	: _impl(that._impl) {
+	that._impl = nullptr;
+}
+
+database::~database() {
+	try {
+		close(*this);
+	}
+	catch (...) { }
+}
+
+database& database::operator=(database&& that) {
+	if (this != &that) {
+		std::swap(_impl, that._impl);
+	}
+	return *this;
+}
+
+database::operator bool() const {
+	return _impl != nullptr;
+}
+
+statement::statement()
+	: _impl(nullptr) {
+}
+
+statement::statement(statement&& that)
+	: _impl(that._impl) {
+	that._impl = nullptr;
+}
+
+statement::~statement() {
+	try {
+		finalize(*this);
+	}
+	catch (...) { }
+}
+
+statement& statement::operator=(statement&& that) {
+	if (this != &that) {
+		std::swap(_impl, that._impl);
+	}
+	return *this;
+}
+
+statement::operator bool() const {
+	return _impl != nullptr;
+}
+
+namespace detail {
+
+int progress_handler(void* context) {
+	auto now = std::chrono::steady_clock::now();
+	for (auto limit = static_cast<limit_state*>(context); limit; limit = limit->previous) {
+		if (now >= limit->deadline || (limit->token && limit->token->cancelled.load(std::memory_order_relaxed))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+}
+
+cancel_token::cancel_token()
+	: _impl(new detail::cancel_state()) {
+}
+
+cancel_token::~cancel_token() {
+	delete static_cast<detail::cancel_state*>(_impl);
+}
+
+void cancel_token::cancel() {
+	auto state = static_cast<detail::cancel_state*>(_impl);
+	state->cancelled.store(true);
+	std::lock_guard<std::mutex> lock(state->mutex);
+	for (auto handle : state->handles) {
+		sqlite3_interrupt(handle);
+	}
+}
+
+bool cancel_token::cancelled() const {
+	return static_cast<const detail::cancel_state*>(_impl)->cancelled.load();
+}
+
+query_limit::query_limit(database& database, std::chrono::steady_clock::time_point deadline, cancel_token* token, int instructions)
+	: _impl(nullptr) {
+	if (!database) {
+		throw std::invalid_argument("database");
+	}
+	if (instructions < 1) {
+		throw std::invalid_argument("instructions");
+	}
+	auto limit = new detail::limit_state();
+	limit->owner = conn(database);
+	limit->handle = impl(database);
+	limit->deadline = deadline;
+	limit->token = token ? static_cast<detail::cancel_state*>(detail::impl::get(*token)) : nullptr;
+	limit->instructions = instructions;
+	limit->previous = conn(database)->limit;
+	conn(database)->limit = limit;
+	_impl = limit;
+	if (limit->token) {
+		std::lock_guard<std::mutex> lock(limit->token->mutex);
+		limit->token->handles.push_back(limit->handle);
+	}
+	sqlite3_progress_handler(limit->handle, instructions, &detail::progress_handler, limit);
+}
+
+query_limit::query_limit(database& database, std::chrono::nanoseconds timeout, cancel_token* token, int instructions)
+	: query_limit(database, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout), token, instructions) {
+}
+
+query_limit::~query_limit() {
+	auto limit = static_cast<detail::limit_state*>(_impl);
+	if (limit->token) {
+		std::lock_guard<std::mutex> lock(limit->token->mutex);
+		auto& handles = limit->token->handles;
+		handles.erase(std::find(handles.begin(), handles.end(), limit->handle));
+	}
+	auto previous = limit->previous;
+	limit->owner->limit = previous;
+	sqlite3_progress_handler(limit->handle, previous ? previous->instructions : 0, previous ? &detail::progress_handler : nullptr, previous);
+	delete limit;
+}
+
+backup::backup()
+	: _impl(nullptr) {
+}
+
+backup::backup(backup&& that)
+	: _impl(that._impl) {
+	that._impl = nullptr;
+}
+
+backup::~backup() {
+	try {
+		backup_finish(*this);
+	}
+	catch (...) { }
+}
+
+backup& backup::operator=(backup&& that) {
+	if (this != &that) {
+		std::swap(_impl, that._impl);
+	}
+	return *this;
+}
+
+backup::operator bool() const {
+	return _impl != nullptr;
+}
+
+busy_policy::busy_policy()
+	: max_wait(5000)
+	, initial_delay(100)
+	, max_delay(100000)
+	, multiplier(2.0)
+	, jitter(0.5) {
+}
+
+backup_options::backup_options()
+	: pages_per_step(256)
+	, pause(10)
+	, max_restarts(16) {
+}
+
+open_options::open_options()
+	: flags(open_readwrite | open_create)
+	, vfs(nullptr)
+	, lookaside_size(0)
+	, lookaside_count(0)
+	, lookaside_buffer(nullptr)
+	, journal_mode(journal_default)
+	, synchronous(synchronous_default)
+	, temp_store(temp_store_default)
+	, locking_mode(locking_default)
+	, cache_size(0)
+	, page_size(0)
+	, mmap_size(-1)
+	, mmap_policy(mmap_fixed)
+	, mmap_fraction(0.25)
+	, checkpoint_policy(checkpoint_auto)
+	, checkpoint_pages(1000)
+	, checkpoint_restart_pages(10000)
+	, checkpoint_truncate_pages(100000)
+	, journal_size_limit(-1)
+	, preload(false)
+	, persist_interval(1000)
+	, persist_pages(1000)
+	, busy_timeout(0)
+	, foreign_keys(true)
+	, automatic_index(true) {
+}
+
+inline string pragmas(const open_options& options) {
+	static const char* const journal_modes[] = { "", "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF" };
+	static const char* const synchronous[] = { "", "OFF", "NORMAL", "FULL" };
+	static const char* const temp_stores[] = { "", "FILE", "MEMORY" };
+	static const char* const locking_modes[] = { "", "NORMAL", "EXCLUSIVE" };
+
+	// page_size has to come first, it only applies before the database is written to
+	string result;
+	if (options.page_size != 0) {
+		result += "PRAGMA page_size = " + std::to_string(options.page_size) + ";";
+	}
+	if (options.locking_mode != open_options::locking_default) {
+		result += string("PRAGMA locking_mode = ") + locking_modes[options.locking_mode] + ";";
+	}
+	if (options.journal_mode != open_options::journal_default) {
+		result += string("PRAGMA journal_mode = ") + journal_modes[options.journal_mode] + ";";
+	}
+	if (options.synchronous != open_options::synchronous_default) {
+		result += string("PRAGMA synchronous = ") + synchronous[options.synchronous] + ";";
+	}
+	if (options.temp_store != open_options::temp_store_default) {
+		result += string("PRAGMA temp_store = ") + temp_stores[options.temp_store] + ";";
+	}
+	if (options.journal_size_limit >= 0) {
+		result += "PRAGMA journal_size_limit = " + std::to_string(options.journal_size_limit) + ";";
+	}
+	if (options.cache_size != 0) {
+		result += "PRAGMA cache_size = " + std::to_string(options.cache_size) + ";";
+	}
+	if (options.mmap_policy == open_options::mmap_fixed && options.mmap_size >= 0) {
+		result += "PRAGMA mmap_size = " + std::to_string(options.mmap_size) + ";";
+	}
+	if (options.foreign_keys) {
+		result += "PRAGMA foreign_keys = ON;";
+	}
+	if (!options.automatic_index) {
+		result += "PRAGMA automatic_index = OFF;";
+	}
+	return result;
+}
+
+database open(const char* filename, const open_options& options);
+database open(const char* filename, unsigned flags);
+database open(const char* filename);
+database open_snapshot(const char* path);
+void close(database& database);
+
+const long long mmap_minimum_size = 1 << 20;
+
+inline long long file_size(sqlite3* database) {
+	sqlite3_file* file = nullptr;
+	sqlite3_int64 size = 0;
+	if (sqlite3_file_control(database, "main", SQLITE_FCNTL_FILE_POINTER, &file) == SQLITE_OK
+		&& file != nullptr
+		&& file->pMethods != nullptr
+		&& file->pMethods->xFileSize(file, &size) == SQLITE_OK) {
+		return size;
+	}
+	return 0;
+}
+
+// Zero while the file holds no page yet, a new WAL database has its first pages in the WAL.
+inline long long header_page_size(sqlite3* database) {
+	sqlite3_file* file = nullptr;
+	// the whole header, as SQLite reads it, VFSs that work on pages need not handle smaller reads
+	unsigned char header[100];
+	if (sqlite3_file_control(database, "main", SQLITE_FCNTL_FILE_POINTER, &file) == SQLITE_OK
+		&& file != nullptr
+		&& file->pMethods != nullptr
+		&& file->pMethods->xRead(file, header, sizeof(header), 0) == SQLITE_OK) {
+		auto size = header[16] << 8 | header[17];
+		return size == 1 ? 65536 : size;
+	}
+	return 0;
+}
+
+inline long long physical_memory() {
+#if defined(_WIN32)
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	return GlobalMemoryStatusEx(&status) ? static_cast<long long>(status.ullTotalPhys) : 0;
+#else
+	return static_cast<long long>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+#endif
+}
+
+inline int read_integer(void* result, int, char** values, char**) {
+	*static_cast<long long*>(result) = values[0] ? std::atoll(values[0]) : 0;
+	return 0;
+}
+
+// SQLite clamps the request to SQLITE_MAX_MMAP_SIZE, the effective size is read back and a
+// clamped one is kept for good. The pragma bypasses exec, so it is neither logged nor recorded.
+inline void set_mmap_size(database& database, long long size) {
+	auto& mmap = conn(database)->mmap;
+	long long result = 0;
+	auto sql = "PRAGMA mmap_size = " + std::to_string(size) + ";";
+	if (sqlite3_exec(sqlt3::impl(database), sql.c_str(), &read_integer, &result, nullptr) != SQLITE_OK) {
+		throw_exception(database);
+	}
+	mmap.size = result;
+	mmap.clamped = result < size;
+	++mmap.resizes;
+}
+
+namespace detail {
+
+inline void refresh_mmap(database& database) {
+	auto& mmap = conn(database)->mmap;
+	if (mmap.policy == open_options::mmap_file_size && !mmap.clamped && ++mmap.statements % mmap_state::check_interval == 0) {
+		auto size = file_size(sqlt3::impl(database));
+		if (size > mmap.size) {
+			set_mmap_size(database, 2 * size);
+		}
+	}
+}
+
+inline void mmap_fallback(database& database) {
+	auto& mmap = conn(database)->mmap;
+	++mmap.errors;
+	mmap.policy = open_options::mmap_fixed;
+	try {
+		set_mmap_size(database, 0);
+	}
+	catch (const sqlite_error&) {
+	}
+}
+
+}
+
+namespace detail {
+
+void checkpoint(wal_state& wal, sqlite3* handle, const char* name, long long frames) {
+	auto mode = SQLITE_CHECKPOINT_PASSIVE;
+	if (wal.truncate_pages > 0 && frames >= wal.truncate_pages) {
+		mode = checkpoint_shrink;
+	}
+	else if (wal.restart_pages > 0 && frames >= wal.restart_pages) {
+		mode = SQLITE_CHECKPOINT_RESTART;
+	}
+
+	int log = 0, done = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto result = sqlite3_wal_checkpoint_v2(handle, name, mode, &log, &done);
+	auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+	// the pages of a new database reach its file with the first checkpoint
+	auto page_size = std::strcmp(name, "main") == 0 && done > 0 ? header_page_size(handle) : 0;
+
+	std::lock_guard<std::mutex> lock(wal.mutex);
+	if (page_size > 0) {
+		wal.page_size = page_size;
+	}
+	auto& stats = wal.stats;
+	++stats.checkpoints;
+	if (mode == SQLITE_CHECKPOINT_RESTART) {
+		++stats.restarts;
+	}
+	else if (mode != SQLITE_CHECKPOINT_PASSIVE) {
+		++stats.truncates;
+	}
+	auto complete = result == SQLITE_OK && done >= log;
+	if (!complete) {
+		++stats.busy;
+	}
+	stats.last_duration = duration;
+	stats.max_duration = std::max(stats.max_duration, duration);
+	stats.total_duration += duration;
+	if (result == SQLITE_OK && log >= 0 && std::strcmp(name, "main") == 0) {
+		// done counts from the start of the WAL, which begins anew after a reset
+		stats.frames_checkpointed += log >= wal.last_log && done >= wal.last_done ? done - wal.last_done : done;
+		wal.last_log = log;
+		wal.last_done = done;
+		stats.wal_frames = log;
+	}
+	if (std::strcmp(name, "main") == 0) {
+		// readers that pinned the WAL would fail the next attempt as well, wait for more frames
+		wal.next = complete ? wal.pages : frames + wal.pages;
+	}
+}
+
+int wal_hook(void* context, sqlite3* handle, const char* name, int frames) {
+	auto& wal = *static_cast<wal_state*>(context);
+	auto main = std::strcmp(name, "main") == 0;
+	auto threshold = wal.pages;
+	if (main) {
+		std::lock_guard<std::mutex> lock(wal.mutex);
+		wal.stats.wal_frames = frames;
+		threshold = wal.next;
+	}
+	if (frames >= threshold) {
+		if (main && wal.thread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(wal.mutex);
+				wal.pending = frames;
+			}
+			wal.wake.notify_one();
+		}
+		else {
+			checkpoint(wal, handle, name, frames);
+		}
+	}
+	return SQLITE_OK;
+}
+
+void checkpoint_thread(wal_state* wal) {
+	std::unique_lock<std::mutex> lock(wal->mutex);
+	for (;;) {
+		while (!wal->stop && wal->pending == 0) {
+			wal->wake.wait(lock);
+		}
+		if (wal->stop) {
+			break;
+		}
+		auto frames = wal->pending;
+		wal->pending = 0;
+		lock.unlock();
+		// a connection only notices that the database switched to WAL when it reads it
+		sqlite3_exec(wal->handle, "PRAGMA schema_version;", nullptr, nullptr, nullptr);
+		checkpoint(*wal, wal->handle, "main", frames);
+		lock.lock();
+	}
+}
+
+void start_checkpoints(database& database, const open_options& options) {
+	auto& wal = conn(database)->wal;
+	wal.reset(new wal_state(options));
+	// until the first checkpoint of a new database the page size it will be created with is used
+	wal->page_size = header_page_size(sqlt3::impl(database));
+	if (wal->page_size == 0 && sqlite3_exec(sqlt3::impl(database), "PRAGMA page_size;", &read_integer, &wal->page_size, nullptr) != SQLITE_OK) {
+		throw_exception(database);
+	}
+	if (options.checkpoint_policy == open_options::checkpoint_background) {
+		auto filename = sqlite3_db_filename(sqlt3::impl(database), "main");
+		if (filename != nullptr && filename[0] != '\0') {
+			auto result = sqlite3_open_v2(filename, &wal->handle, SQLITE_OPEN_READWRITE, options.vfs);
+			if (result != SQLITE_OK) {
+				std::string message = sqlite3_errmsg(wal->handle);
+				wal.reset();
+				detail::impl::throw_exception(result, message.c_str());
+			}
+			// bounds how long a RESTART waits for readers before it reports busy
+			sqlite3_busy_timeout(wal->handle, 100);
+			wal->thread = std::thread(&checkpoint_thread, wal.get());
+		}
+	}
+	sqlite3_wal_hook(sqlt3::impl(database), &wal_hook, wal.get());
+}
+
+}
+
+namespace detail {
+
+inline long long pages_written(sqlite3* handle) {
+	int current = 0, highwater = 0;
+	sqlite3_db_status(handle, SQLITE_DBSTATUS_CACHE_WRITE, &current, &highwater, 0);
+	return current;
+}
+
+// Copies in steps so the application only waits for one step at a time, its own changes during
+// the copy are applied to the destination by SQLite. Must hold persist_mutex.
+int persist(preload_state& preload) {
+	auto written = pages_written(preload.memory);
+	auto start = std::chrono::steady_clock::now();
+	auto backup = sqlite3_backup_init(preload.disk, "main", preload.memory, "main");
+	if (backup == nullptr) {
+		return sqlite3_extended_errcode(preload.disk);
+	}
+	int result;
+	while ((result = sqlite3_backup_step(backup, 256)) == SQLITE_OK) {
+		std::this_thread::yield();
+	}
+	auto finished = sqlite3_backup_finish(backup);
+	if (result == SQLITE_DONE) {
+		result = finished;
+	}
+	auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+	std::lock_guard<std::mutex> lock(preload.mutex);
+	if (result == SQLITE_OK) {
+		++preload.stats.persists;
+		preload.persisted_writes = written;
+		preload.persisted_at = std::chrono::steady_clock::now();
+	}
+	preload.stats.last_duration = duration;
+	return result;
+}
+
+void persist_thread(preload_state* preload) {
+	auto check = std::chrono::milliseconds(100);
+	if (preload->interval > std::chrono::milliseconds::zero()) {
+		check = std::min(check, preload->interval);
+	}
+	std::unique_lock<std::mutex> lock(preload->mutex);
+	while (!preload->stop) {
+		preload->wake.wait_for(lock, check);
+		if (preload->stop) {
+			break;
+		}
+		auto dirty = pages_written(preload->memory) - preload->persisted_writes;
+		auto due = (preload->pages > 0 && dirty >= preload->pages)
+			|| (preload->interval > std::chrono::milliseconds::zero() && std::chrono::steady_clock::now() - preload->persisted_at >= preload->interval);
+		if (dirty > 0 && due) {
+			lock.unlock();
+			int result;
+			{
+				std::lock_guard<std::mutex> persisting(preload->persist_mutex);
+				result = persist(*preload);
+			}
+			lock.lock();
+			if (result != SQLITE_OK) {
+				++preload->stats.failures;
+				// retries with the next check instead of right away
+				preload->persisted_at = std::chrono::steady_clock::now();
+			}
+		}
+	}
+}
+
+void open_preloaded(database& database, const char* filename, const open_options& options) {
+	static std::atomic<unsigned> copies(0);
+
+	auto& preload = conn(database)->preload;
+	preload.reset(new preload_state(options));
+	auto result = sqlite3_open_v2(filename, &preload->disk, (options.flags & ~SQLITE_OPEN_FULLMUTEX) | SQLITE_OPEN_NOMUTEX, options.vfs);
+	if (result == SQLITE_OK) {
+		sqlite3_busy_timeout(preload->disk, 5000);
+	}
+	else {
+		std::string message = sqlite3_errmsg(preload->disk);
+		preload.reset();
+		detail::impl::throw_exception(result, message.c_str());
+	}
+
+	register_vfs(memory_vfs);
+	auto name = "preload/" + std::to_string(++copies) + "/" + filename;
+	auto flags = (options.flags | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX) & ~(SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI);
+	result = sqlite3_open_v2(name.c_str(), &conn(database)->handle, flags, memory_vfs);
+	if (result != SQLITE_OK) {
+		throw_exception(database);
+	}
+	preload->memory = conn(database)->handle;
+
+	auto backup = sqlite3_backup_init(preload->memory, "main", preload->disk, "main");
+	if (backup == nullptr) {
+		throw_exception(database);
+	}
+	result = sqlite3_backup_step(backup, -1);
+	sqlite3_backup_finish(backup);
+	if (result != SQLITE_DONE) {
+		detail::impl::throw_exception(result, sqlite3_errmsg(preload->disk));
+	}
+	preload->persisted_writes = pages_written(preload->memory);
+
+	if ((options.flags & SQLITE_OPEN_READONLY) != 0) {
+		sqlt3::exec<void>(database, "PRAGMA query_only = ON;");
+	}
+}
+
+void start_persisting(database& database) {
+	auto preload = conn(database)->preload.get();
+	if (sqlite3_db_readonly(preload->disk, "main") == 0) {
+		preload->persisted_writes = pages_written(preload->memory);
+		preload->thread = std::thread(&persist_thread, preload);
+	}
+}
+
+}
+
+database open(const char* filename, const open_options& options) {
+	detail::check_lookaside(options.lookaside_size, options.lookaside_count);
+	if (options.lookaside_count != 0 && !detail::is_aligned(options.lookaside_buffer)) {
+		throw std::invalid_argument("lookaside_buffer");
+	}
+
+	detail::register_vfs(options.vfs);
+
+	database database;
+	conn(database) = new detail::connection();
+
+	auto result = SQLITE_OK;
+	if (options.preload) {
+		detail::open_preloaded(database, filename, options);
+	}
+	else {
+		result = sqlite3_open_v2(filename, &conn(database)->handle, options.flags, options.vfs);
+		if (result != SQLITE_OK) {
+			throw_exception(database);
+		}
+	}
+
+	// lookaside can only be replaced while no slot is in use, that is before the first statement
+	if (options.lookaside_count != 0) {
+		result = sqlite3_db_config(
+			impl(database),
+			SQLITE_DBCONFIG_LOOKASIDE,
+			options.lookaside_buffer,
+			static_cast<int>(options.lookaside_size),
+			static_cast<int>(options.lookaside_count)
+			);
+		if (result != SQLITE_OK) {
+			detail::impl::throw_exception(result, "SQLITE_DBCONFIG_LOOKASIDE");
+		}
+	}
+
+	if (options.busy_timeout > 0) {
+		sqlite3_busy_timeout(impl(database), options.busy_timeout);
+	}
+
+	auto batch = pragmas(options);
+	if (!batch.empty()) {
+		sqlt3::exec<void>(
+			database,
+			batch
+			);
+	}
+
+	auto& mmap = conn(database)->mmap;
+	mmap.policy = options.mmap_policy;
+	if (options.mmap_policy == open_options::mmap_file_size) {
+		set_mmap_size(database, std::max(2 * file_size(sqlt3::impl(database)), mmap_minimum_size));
+	}
+	else if (options.mmap_policy == open_options::mmap_ram_fraction) {
+		set_mmap_size(database, static_cast<long long>(physical_memory() * options.mmap_fraction));
+	}
+	mmap.resizes = 0;
+
+	if (options.checkpoint_policy != open_options::checkpoint_auto) {
+		detail::start_checkpoints(database, options);
+	}
+	if (options.preload) {
+		detail::start_persisting(database);
+	}
+
+	return database;
+}
+
+database open(const char* filename, unsigned flags) {
+	open_options options;
+	options.flags = flags;
+	return open(filename, options);
+}
+
+database open(const char* filename) {
+	return open(filename, open_readwrite | open_create);
+}
+
+namespace detail {
+
+std::string file_uri(const char* path) {
+	std::string uri = "file:";
+#if defined(_WIN32)
+	if (std::isalpha(static_cast<unsigned char>(path[0])) && path[1] == ':') {
+		uri += '/';
+	}
+#endif
+	for (const char* itr = path; *itr != '\0'; ++itr) {
+		char c = *itr;
+#if defined(_WIN32)
+		if (c == '\\') {
+			c = '/';
+		}
+#endif
+		if (c == '%' || c == '?' || c == '#') {
+			char escaped[4];
+			std::sprintf(escaped, "%%%02X", static_cast<unsigned char>(c));
+			uri += escaped;
+		}
+		else {
+			uri += c;
+		}
+	}
+	return uri;
+}
+
+}
+
+database open_snapshot(const char* path) {
+	if (path == nullptr) {
+		throw std::invalid_argument("path");
+	}
+
+	open_options options;
+	options.flags = open_readonly | open_uri;
+	options.cache_size = -262144;
+	options.mmap_policy = open_options::mmap_file_size;
+	options.foreign_keys = false;
+	auto database = open((detail::file_uri(path) + "?mode=ro&immutable=1").c_str(), options);
+
+	sqlt3::exec<void>(
+		database,
+		"PRAGMA query_only = ON;"
+		);
+
+	return database;
+}
+
+void close(database& database) {
+	if (database) {
+		if (conn(database)->traced) {
+			trace_stop(database);
+		}
+		statement_tracking_off(database);
+		if (conn(database)->wal) {
+			sqlite3_wal_hook(impl(database), nullptr, nullptr);
+			conn(database)->wal.reset();
+		}
+		auto result = SQLITE_OK;
+		string message;
+		if (auto preload = conn(database)->preload.get()) {
+			if (preload->thread.joinable()) {
+				std::lock_guard<std::mutex> lock(preload->persist_mutex);
+				result = detail::persist(*preload);
+				message = sqlite3_errmsg(preload->disk);
+			}
+			conn(database)->preload.reset();
+		}
+		sqlite3_close_v2(impl(database));
+		delete conn(database);
+		conn(database) = nullptr;
+		if (result != SQLITE_OK) {
+			detail::impl::throw_exception(result, message.c_str());
+		}
+	}
+}
+
+inline void db_status(sqlite3* database, int op, long long& current, long long& highwater) {
+	int _current = 0, _highwater = 0;
+	auto result = sqlite3_db_status(database, op, &_current, &_highwater, 0);
+	if (result != SQLITE_OK) {
+		detail::impl::throw_exception(result, sqlite3_errstr(result));
+	}
+	current = _current;
+	highwater = _highwater;
+}
+
+inline void status(int op, long long& current, long long& highwater) {
+	int _current = 0, _highwater = 0;
+	auto result = sqlite3_status(op, &_current, &_highwater, 0);
+	if (result != SQLITE_OK) {
+		detail::impl::throw_exception(result, sqlite3_errstr(result));
+	}
+	current = _current;
+	highwater = _highwater;
+}
+
+metrics db_status(database& database) {
+	if (database) {
+		auto handle = impl(database);
+		long long ignored = 0;
+		metrics result;
+		db_status(handle, SQLITE_DBSTATUS_CACHE_USED, result.cache_used, ignored);
+		db_status(handle, SQLITE_DBSTATUS_CACHE_HIT, result.cache_hit, ignored);
+		db_status(handle, SQLITE_DBSTATUS_CACHE_MISS, result.cache_miss, ignored);
+		db_status(handle, SQLITE_DBSTATUS_CACHE_WRITE, result.cache_write, ignored);
+		db_status(handle, SQLITE_DBSTATUS_SCHEMA_USED, result.schema_used, ignored);
+		db_status(handle, SQLITE_DBSTATUS_STMT_USED, result.stmt_used, ignored);
+		db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_USED, result.lookaside_used, result.lookaside_highwater);
+		db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_HIT, ignored, result.lookaside_hit);
+		db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, ignored, result.lookaside_miss_size);
+		db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, ignored, result.lookaside_miss_full);
+		status(SQLITE_STATUS_MEMORY_USED, result.memory_used, result.memory_highwater);
+		status(SQLITE_STATUS_MALLOC_COUNT, result.malloc_count, ignored);
+		status(SQLITE_STATUS_MALLOC_SIZE, ignored, result.malloc_size);
+		status(SQLITE_STATUS_PAGECACHE_USED, result.pagecache_used, ignored);
+		status(SQLITE_STATUS_PAGECACHE_OVERFLOW, result.pagecache_overflow, result.pagecache_overflow_highwater);
+		conn(database)->last_metrics = result;
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+io_stats io_status(database& database) {
+	if (database) {
+		io_stats result = io_stats();
+		sqlite3_file* file = nullptr;
+		if (sqlite3_file_control(impl(database), "main", SQLITE_FCNTL_FILE_POINTER, &file) == SQLITE_OK
+			&& file != nullptr
+			&& detail::accounting::owns(file)) {
+			result = detail::accounting::cast(file)->account->stats.load();
+		}
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+compression_stats compression_status(database& database) {
+	if (database) {
+		auto& counters = detail::compression_counters_instance;
+		compression_stats result = compression_stats();
+		sqlite3_file* file = nullptr;
+		if (sqlite3_file_control(impl(database), "main", SQLITE_FCNTL_FILE_POINTER, &file) == SQLITE_OK
+			&& file != nullptr
+			&& detail::compressed::owns(file)) {
+			auto& store = detail::compressed::store(file);
+			result.logical_bytes = store.logical_size;
+			result.stored_bytes = store.stored_bytes();
+			sqlite3_int64 size = 0;
+			if (store.real->pMethods->xFileSize(store.real, &size) == SQLITE_OK) {
+				result.file_size = size;
+			}
+			result.ratio = result.stored_bytes > 0 ? static_cast<double>(result.logical_bytes) / result.stored_bytes : 0.0;
+		}
+		result.pages_compressed = counters.pages_compressed.load();
+		result.pages_decompressed = counters.pages_decompressed.load();
+		result.compress_time = std::chrono::nanoseconds(counters.compress_time.load());
+		result.decompress_time = std::chrono::nanoseconds(counters.decompress_time.load());
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+mmap_stats mmap_status(database& database) {
+	if (database) {
+		auto& mmap = conn(database)->mmap;
+		mmap_stats result;
+		result.size = mmap.size;
+		result.file_size = file_size(sqlt3::impl(database));
+		result.resizes = mmap.resizes;
+		result.errors = mmap.errors;
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+namespace detail {
+
+int busy_handler(void* context, int count) {
+	auto& busy = *static_cast<busy_state*>(context);
+	auto& policy = busy.policy;
+	auto now = std::chrono::steady_clock::now();
+	if (count == 0) {
+		busy.events.fetch_add(1, std::memory_order_relaxed);
+		busy.started = now;
+	}
+	auto left = std::chrono::duration_cast<std::chrono::microseconds>(busy.started + policy.max_wait - now);
+	if (left <= std::chrono::microseconds::zero()) {
+		busy.timeouts.fetch_add(1, std::memory_order_relaxed);
+		return 0;
+	}
+
+	auto delay = static_cast<double>(policy.initial_delay.count()) * std::pow(policy.multiplier, std::min(count, 64));
+	delay = std::min(delay, static_cast<double>(policy.max_delay.count()));
+	delay *= 1.0 - policy.jitter * std::uniform_real_distribution<double>(0.0, 1.0)(busy.random);
+	auto sleep = std::min(std::chrono::microseconds(static_cast<long long>(delay)), left);
+	std::this_thread::sleep_for(sleep);
+
+	busy.retries.fetch_add(1, std::memory_order_relaxed);
+	busy.waited.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - now).count(), std::memory_order_relaxed);
+	return 1;
+}
+
+}
+
+void set_busy_policy(database& database, const busy_policy& policy) {
+	if (database) {
+		if (policy.multiplier < 1.0 || policy.jitter < 0.0 || policy.jitter > 1.0) {
+			throw std::invalid_argument("policy");
+		}
+		auto seed = static_cast<unsigned>(reinterpret_cast<std::uintptr_t>(impl(database)) ^ std::chrono::steady_clock::now().time_since_epoch().count());
+		std::unique_ptr<detail::busy_state> busy(new detail::busy_state(policy, seed));
+		sqlite3_busy_handler(impl(database), &detail::busy_handler, busy.get());
+		conn(database)->busy = std::move(busy);
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+busy_stats busy_status(database& database) {
+	if (database) {
+		busy_stats result = {};
+		if (auto busy = conn(database)->busy.get()) {
+			result.events = busy->events.load(std::memory_order_relaxed);
+			result.retries = busy->retries.load(std::memory_order_relaxed);
+			result.timeouts = busy->timeouts.load(std::memory_order_relaxed);
+			result.waited = std::chrono::nanoseconds(busy->waited.load(std::memory_order_relaxed));
+		}
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+void persist_now(database& database) {
+	if (database) {
+		auto preload = conn(database)->preload.get();
+		if (preload == nullptr) {
+			throw std::logic_error("persist_now");
+		}
+		std::lock_guard<std::mutex> lock(preload->persist_mutex);
+		auto result = detail::persist(*preload);
+		if (result != SQLITE_OK) {
+			detail::impl::throw_exception(result, sqlite3_errmsg(preload->disk));
+		}
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+persist_stats persist_status(database& database) {
+	if (database) {
+		persist_stats result = {};
+		if (auto preload = conn(database)->preload.get()) {
+			std::lock_guard<std::mutex> lock(preload->mutex);
+			result = preload->stats;
+			result.dirty_pages = detail::pages_written(preload->memory) - preload->persisted_writes;
+		}
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+wal_stats wal_status(database& database) {
+	if (database) {
+		wal_stats result = {};
+		auto& wal = conn(database)->wal;
+		if (wal) {
+			std::lock_guard<std::mutex> lock(wal->mutex);
+			result = wal->stats;
+			if (result.wal_frames > 0) {
+				result.wal_bytes = 32 + result.wal_frames * (wal->page_size + 24);
+			}
+		}
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+metrics db_status_delta(database& database) {
+	if (database) {
+		auto last = conn(database)->last_metrics;
+		auto result = db_status(database);
+		result.cache_hit -= last.cache_hit;
+		result.cache_miss -= last.cache_miss;
+		result.cache_write -= last.cache_write;
+		result.lookaside_hit -= last.lookaside_hit;
+		result.lookaside_miss_size -= last.lookaside_miss_size;
+		result.lookaside_miss_full -= last.lookaside_miss_full;
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+namespace detail {
+
+inline statement_tracker& tracker(database& database) {
+	auto& tracker = conn(database)->tracker;
+	if (!tracker) {
+		auto handle = sqlt3::impl(database);
+		std::lock_guard<std::mutex> lock(trackers_mutex);
+		size_t slot = 0;
+		while (slot < max_trackers && tracked_handles[slot].load(std::memory_order_relaxed) != nullptr) {
+			++slot;
+		}
+		if (slot == max_trackers) {
+			throw std::length_error("too many tracked connections");
+		}
+		tracker = &tracker_pool[slot];
+		{
+			std::lock_guard<std::mutex> tracker_lock(tracker->mutex);
+			tracker->handle = handle;
+			tracker->watchdog = false;
+			auto now = std::chrono::steady_clock::now();
+			for (auto stmt = sqlite3_next_stmt(handle, nullptr); stmt; stmt = sqlite3_next_stmt(handle, stmt)) {
+				tracked_statement times = { now, now };
+				tracker->statements[stmt] = times;
+			}
+			tracker->live = tracker->statements.size();
+		}
+		tracked_handles[slot].store(handle, std::memory_order_release);
+		tracker_count.fetch_add(1);
+	}
+	return *tracker;
+}
+
+inline void drop_tracker(database& database) {
+	auto& tracker = conn(database)->tracker;
+	if (tracker) {
+		std::lock_guard<std::mutex> lock(trackers_mutex);
+		tracked_handles[tracker - tracker_pool].store(nullptr, std::memory_order_relaxed);
+		tracker_count.fetch_sub(1);
+		{
+			std::lock_guard<std::mutex> tracker_lock(tracker->mutex);
+			tracker->handle = nullptr;
+			tracker->watchdog = false;
+			std::unordered_map<sqlite3_stmt*, tracked_statement>().swap(tracker->statements);
+			tracker->live = 0;
+			tracker->path.clear();
+		}
+		tracker = nullptr;
+	}
+}
+
+// Must hold tracker.mutex.
+void collect_statements(
+	database& database,
+	statement_tracker& tracker,
+	std::chrono::nanoseconds older_than,
+	std::vector<std::pair<sqlite3_stmt*, live_statement>>& result
+	) {
+	auto now = std::chrono::steady_clock::now();
+	std::unordered_map<sqlite3_stmt*, tracked_statement> statements;
+	for (auto stmt = sqlite3_next_stmt(sqlt3::impl(database), nullptr); stmt; stmt = sqlite3_next_stmt(sqlt3::impl(database), stmt)) {
+		auto itr = tracker.statements.find(stmt);
+		tracked_statement times = { now, now };
+		if (itr != tracker.statements.end()) {
+			times = itr->second;
+		}
+		statements[stmt] = times;
+		if (now - times.created >= older_than) {
+			live_statement statement;
+			auto sql = sqlite3_sql(stmt);
+			statement.sql = sql ? sql : "";
+			statement.age = std::chrono::duration_cast<std::chrono::nanoseconds>(now - times.created);
+			statement.idle = std::chrono::duration_cast<std::chrono::nanoseconds>(now - times.stepped);
+			statement.stepping = sqlite3_stmt_busy(stmt) != 0;
+			result.push_back(std::make_pair(stmt, std::move(statement)));
+		}
+	}
+	tracker.statements.swap(statements);
+	tracker.live = tracker.statements.size();
+}
+
+// A statement counts as abandoned once it was not stepped for threshold, statements that are
+// stepped in a loop which prepares others (exec calls between rows) are left alone.
+void check_statements(database& database, statement_tracker& tracker) {
+	std::vector<std::pair<sqlite3_stmt*, live_statement>> statements;
+	collect_statements(database, tracker, tracker.threshold, statements);
+	statements.erase(
+		std::remove_if(statements.begin(), statements.end(), [&](const std::pair<sqlite3_stmt*, live_statement>& statement) {
+			return !statement.second.stepping || statement.second.idle < tracker.threshold;
+		}),
+		statements.end()
+		);
+	std::FILE* file = nullptr;
+	if (!statements.empty()) {
+		file = tracker.path.empty() ? stderr : std::fopen(tracker.path.c_str(), "a");
+	}
+	for (auto& statement : statements) {
+		if (file == nullptr) {
+			break;
+		}
+		std::fprintf(
+			file,
+			"-- abandoned statement: not stepped for %lld ms%s\n%s\n\n",
+			static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(statement.second.idle).count()),
+			tracker.action == watchdog_reset ? ", reset" : "",
+			statement.second.sql.c_str()
+			);
+	}
+	if (file != nullptr && file != stderr) {
+		std::fclose(file);
+	}
+	if (tracker.action == watchdog_reset) {
+		for (auto& statement : statements) {
+			sqlite3_reset(statement.first);
+		}
+	}
+}
+
+void track_statement(database& database, sqlite3_stmt* stmt) {
+	auto tracker = conn(database)->tracker;
+	if (tracker && stmt) {
+		std::lock_guard<std::mutex> lock(tracker->mutex);
+		auto now = std::chrono::steady_clock::now();
+		tracked_statement times = { now, now };
+		tracker->statements[stmt] = times;
+		if (tracker->watchdog && now >= tracker->next_check) {
+			tracker->next_check = now + tracker->threshold / 4;
+			check_statements(database, *tracker);
+		}
+		else if (tracker->statements.size() > 2 * tracker->live + 64) {
+			std::vector<std::pair<sqlite3_stmt*, live_statement>> unused;
+			collect_statements(database, *tracker, std::chrono::nanoseconds::max(), unused);
+		}
+	}
+}
+
+// Called before and after each step, a statement is never idle while it runs.
+inline void touch_statement(sqlite3_stmt* stmt) {
+	if (tracker_count.load(std::memory_order_relaxed) != 0) {
+		auto handle = sqlite3_db_handle(stmt);
+		for (size_t i = 0; i < max_trackers; ++i) {
+			if (tracked_handles[i].load(std::memory_order_acquire) == handle) {
+				auto& tracker = tracker_pool[i];
+				std::lock_guard<std::mutex> lock(tracker.mutex);
+				if (tracker.handle == handle) {
+					auto now = std::chrono::steady_clock::now();
+					auto& times = tracker.statements[stmt];
+					if (times.created == std::chrono::steady_clock::time_point()) {
+						times.created = now;
+					}
+					times.stepped = now;
+				}
+				return;
+			}
+		}
+	}
+}
+
+}
+
+std::vector<live_statement> live_statements(database& database, std::chrono::nanoseconds older_than) {
+	if (database) {
+		auto& tracker = detail::tracker(database);
+		std::lock_guard<std::mutex> lock(tracker.mutex);
+		std::vector<std::pair<sqlite3_stmt*, live_statement>> statements;
+		detail::collect_statements(database, tracker, older_than, statements);
+		std::vector<live_statement> result;
+		for (auto& statement : statements) {
+			result.push_back(std::move(statement.second));
+		}
+		return result;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+void statement_watchdog(database& database, std::chrono::nanoseconds threshold, watchdog_action action, const char* path) {
+	if (database) {
+		auto& tracker = detail::tracker(database);
+		std::lock_guard<std::mutex> lock(tracker.mutex);
+		tracker.watchdog = true;
+		tracker.threshold = threshold;
+		tracker.action = action;
+		tracker.path = path ? path : "";
+		tracker.next_check = std::chrono::steady_clock::now();
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+void statement_watchdog_off(database& database) {
+	statement_tracking_off(database);
+}
+
+void statement_tracking_off(database& database) {
+	if (database) {
+		detail::drop_tracker(database);
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+void slow_query_log(database& database, std::chrono::nanoseconds threshold, size_t capacity, const char* path) {
+	if (database) {
+		conn(database)->slow_log.reset(new detail::slow_query_buffer(threshold, capacity, path));
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+void slow_query_log_off(database& database) {
+	if (database) {
+		conn(database)->slow_log.reset();
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+std::vector<slow_query> slow_queries(database& database) {
+	if (database) {
+		auto slow_log = conn(database)->slow_log.get();
+		if (slow_log) {
+			std::lock_guard<std::mutex> lock(slow_log->mutex);
+			return std::vector<slow_query>(slow_log->queries.begin(), slow_log->queries.end());
+		}
+		return std::vector<slow_query>();
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
+void trace_start(database& database) {
+	if (database) {
+		auto connection = conn(database);
+		if (!connection->traced) {
+			detail::tracer::instance().start(connection->handle);
+			sqlite3_trace(connection->handle, &detail::trace_callback, connection->handle);
+			sqlite3_profile(connection->handle, &detail::profile_callback, connection->handle);
+			connection->traced = true;
+		}
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
 }
 
-template <class T, class S> inline T safe_downcast(const S& s) {
-	if (s <= static_cast<S>(std::numeric_limits<T>::max())) {
-		return static_cast<T>(s);
+void trace_stop(database& database) {
+	if (database) {
+		auto connection = conn(database);
+		if (connection->traced) {
+			sqlite3_trace(connection->handle, nullptr, nullptr);
+			sqlite3_profile(connection->handle, nullptr, nullptr);
+			detail::tracer::instance().stop(connection->handle);
+			connection->traced = false;
+		}
 	}
 	else {
-		throw std::overflow_error(std::to_string(s));
+		throw std::invalid_argument("database");
 	}
 }
 
-const unsigned open_nomutex = SQLITE_OPEN_NOMUTEX;
-const unsigned open_fullmutex = SQLITE_OPEN_FULLMUTEX;
-const unsigned open_sharedcache = SQLITE_OPEN_SHAREDCACHE;
-const unsigned open_privatecache = SQLITE_OPEN_PRIVATECACHE;
-const unsigned open_uri = SQLITE_OPEN_URI;
-const unsigned open_readonly = SQLITE_OPEN_READONLY;
-const unsigned open_readwrite = SQLITE_OPEN_READWRITE;
-const unsigned open_create = SQLITE_OPEN_CREATE;
+inline void json_escape(string& output, const string& input) {
+	for (auto c : input) {
+		switch (c) {
+		case '"': output += "\\\""; break;
+		case '\\': output += "\\\\"; break;
+		case '\n': output += "\\n"; break;
+		case '\r': output += "\\r"; break;
+		case '\t': output += "\\t"; break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20) {
+				char buffer[8];
+				std::sprintf(buffer, "\\u%04x", c);
+				output += buffer;
+			}
+			else {
+				output += c;
+			}
+		}
+	}
+}
 
-database::database()
-	: _impl(nullptr) {
+string trace_json() {
+	auto& tracer = detail::tracer::instance();
+	std::lock_guard<std::mutex> lock(tracer.mutex);
+
+	string result = "{\"traceEvents\":[";
+	bool first = true;
+	char line[256];
+	auto generation = tracer.generation.load(std::memory_order_relaxed);
+	for (auto& buffer : tracer.buffers) {
+		auto& thread = *buffer;
+		if (thread.generation.load(std::memory_order_acquire) != generation) {
+			continue;
+		}
+		auto size = thread.size.load(std::memory_order_acquire);
+		for (size_t i = 0; i < size; ++i) {
+			auto& event = thread.event(i);
+			std::sprintf(
+				line,
+				"%s{\"name\":\"%s\",\"cat\":\"sqlite\",\"ph\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%llu,\"args\":{\"db\":\"%p\",\"sql\":\"",
+				first ? "" : ",",
+				event.name,
+				event.duration != 0 ? "X" : "i",
+				event.begin / 1000.0,
+				event.duration / 1000.0,
+				thread.tid,
+				event.database
+				);
+			result += line;
+			json_escape(result, event.sql);
+			result += "\"}}";
+			first = false;
+		}
+		auto dropped = thread.dropped.load(std::memory_order_relaxed);
+		if (dropped != 0) {
+			std::sprintf(
+				line,
+				"%s{\"name\":\"dropped\",\"ph\":\"i\",\"ts\":0,\"pid\":1,\"tid\":%llu,\"args\":{\"count\":%u}}",
+				first ? "" : ",",
+				thread.tid,
+				static_cast<unsigned>(dropped)
+				);
+			result += line;
+			first = false;
+		}
+	}
+	result += "]}";
+	return result;
 }
 
-database::database(database&& that)
-	: _impl(that._impl) {
-	that._impl = nullptr;
+void trace_clear() {
+	auto& tracer = detail::tracer::instance();
+	std::lock_guard<std::mutex> lock(tracer.mutex);
+	tracer.generation.fetch_add(1, std::memory_order_release);
+	tracer.free_exited();
 }
 
-database::~database() {
-	try {
-		close(*this);
+void record_start(database& database, const char* path) {
+	if (database) {
+		conn(database)->recorder.reset(new detail::statement_recorder(path));
+	}
+	else {
+		throw std::invalid_argument("database");
 	}
-	catch (...) { }
 }
 
-database& database::operator=(database&& that) {
-	if (this != &that) {
-		std::swap(_impl, that._impl);
+void record_stop(database& database) {
+	if (database) {
+		conn(database)->recorder.reset();
+	}
+	else {
+		throw std::invalid_argument("database");
 	}
-	return *this;
 }
 
-database::operator bool() const {
-	return _impl != nullptr;
-}
+namespace detail {
 
-statement::statement()
-	: _impl(nullptr) {
-}
+struct replay_param {
+	record_kind kind;
+	long long integer;
+	double real;
+	string text;
+};
 
-statement::statement(statement&& that)
-	: _impl(that._impl) {
-	that._impl = nullptr;
+struct replay_record {
+	long long start;
+	unsigned thread;
+	int error;
+	string sql;
+	std::vector<replay_param> params;
+};
+
+template <class T> inline bool read(std::FILE* file, T& value) {
+	return std::fread(&value, sizeof(T), 1, file) == 1;
 }
 
-statement::~statement() {
-	try {
-		finalize(*this);
+inline bool read(std::FILE* file, string& value) {
+	std::uint32_t size = 0;
+	if (!read(file, size)) {
+		return false;
 	}
-	catch (...) { }
+	value.resize(size);
+	return size == 0 || std::fread(&value[0], 1, size, file) == size;
 }
 
-statement& statement::operator=(statement&& that) {
-	if (this != &that) {
-		std::swap(_impl, that._impl);
+inline std::vector<replay_record> read_log(const char* path) {
+	std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path, "rb"), &std::fclose);
+	if (!file) {
+		impl::throw_exception(SQLITE_CANTOPEN, path);
 	}
-	return *this;
-}
 
-statement::operator bool() const {
-	return _impl != nullptr;
+	char magic[sizeof(record_magic)];
+	if (std::fread(magic, 1, sizeof(magic), file.get()) != sizeof(magic) || std::memcmp(magic, record_magic, sizeof(magic)) != 0) {
+		impl::throw_exception(SQLITE_FORMAT, path);
+	}
+
+	std::vector<replay_record> records;
+	std::uint64_t start = 0, duration = 0;
+	while (read(file.get(), start)) {
+		replay_record record;
+		std::uint32_t thread = 0, count = 0;
+		std::int32_t error = 0;
+		bool valid = read(file.get(), duration) && read(file.get(), thread) && read(file.get(), error) && read(file.get(), record.sql) && read(file.get(), count);
+		for (std::uint32_t i = 0; valid && i < count; ++i) {
+			replay_param param;
+			std::uint8_t kind = 0;
+			valid = read(file.get(), kind);
+			param.kind = static_cast<record_kind>(kind);
+			switch (param.kind) {
+			case record_null: break;
+			case record_integer: valid = valid && read(file.get(), param.integer); break;
+			case record_real: valid = valid && read(file.get(), param.real); break;
+			case record_text: valid = valid && read(file.get(), param.text); break;
+			default: valid = false;
+			}
+			record.params.push_back(std::move(param));
+		}
+		if (!valid) {
+			impl::throw_exception(SQLITE_FORMAT, path);
+		}
+		record.start = static_cast<long long>(start);
+		record.thread = thread;
+		record.error = error;
+		records.push_back(std::move(record));
+	}
+	return records;
 }
 
-database open(const char* filename, unsigned flags);
-database open(const char* filename);
-void close(database& database);
+}
 
-database open(const char* filename, unsigned flags) {
-	database database;
+replay_result replay(const char* log, const char* filename, const replay_options& options) {
+	auto records = detail::read_log(log);
+	auto threads = options.threads != 0 ? options.threads : 1;
 
-	auto result = sqlite3_open_v2(filename, &impl(database), flags, nullptr);
-	if (result != SQLITE_OK) {
-		throw_exception(database);
+	std::vector<std::vector<const detail::replay_record*> > queues(threads);
+	size_t recorded_errors = 0;
+	for (auto& record : records) {
+		queues[record.thread % threads].push_back(&record);
+		if (record.error != SQLITE_OK) {
+			++recorded_errors;
+		}
 	}
 
-	sqlt3::exec<void>(
-		database,
-		"PRAGMA foreign_keys = ON;"
-		);
-
-	return database;
-}
+	std::atomic<size_t> statements(0);
+	std::atomic<size_t> errors(0);
+	auto begin = std::chrono::steady_clock::now();
 
-database open(const char* filename) {
-	return open(filename, open_readwrite | open_create);
-}
+	auto worker = [&](const std::vector<const detail::replay_record*>& queue) {
+		try {
+			auto database = open(filename);
+			for (auto record : queue) {
+				if (options.original_speed) {
+					std::this_thread::sleep_until(begin + std::chrono::nanoseconds(record->start));
+				}
+				try {
+					const char* tail = nullptr;
+					auto statement = prepare(database, record->sql.c_str(), tail);
+					if (statement) {
+						for (size_t i = 0; i < record->params.size(); ++i) {
+							auto& param = record->params[i];
+							switch (param.kind) {
+							case detail::record_null: bind(statement, i + 1, nullptr); break;
+							case detail::record_integer: bind(statement, i + 1, param.integer); break;
+							case detail::record_real: bind(statement, i + 1, param.real); break;
+							case detail::record_text: bind(statement, i + 1, param.text); break;
+							}
+						}
+						while (step(statement) != done) {
+						}
+					}
+				}
+				catch (const sqlite_error&) {
+					++errors;
+				}
+				++statements;
+			}
+		}
+		catch (const sqlite_error&) {
+			errors += queue.size();
+		}
+	};
 
-void close(database& database) {
-	if (database) {
-		sqlite3_close_v2(impl(database));
-		impl(database) = nullptr;
+	std::vector<std::thread> pool;
+	for (size_t i = 1; i < threads; ++i) {
+		pool.push_back(std::thread(worker, std::cref(queues[i])));
 	}
+	worker(queues[0]);
+	for (auto& thread : pool) {
+		thread.join();
+	}
+
+	replay_result result;
+	result.statements = statements;
+	result.errors = errors;
+	result.recorded_errors = recorded_errors;
+	result.elapsed = std::chrono::steady_clock::now() - begin;
+	return result;
 }
 
 statement prepare(
@@ -236,6 +6254,8 @@ statement prepare(
 	) {
 	statement statement;
 	if (database) {
+		detail::trace_span span("prepare", impl(database), sql_begin, sql_end);
+		SQLT3_PROBE2(prepare__start, impl(database), sql_begin);
 		auto result = sqlite3_prepare_v2(
 			impl(database),
 			sql_begin,
@@ -243,9 +6263,11 @@ statement prepare(
 			&impl(statement),
 			&tail
 			);
+		SQLT3_PROBE3(prepare__done, impl(statement), sql_begin, result);
 		if (result != SQLITE_OK) {
 			throw_exception(database);
 		}
+		detail::track_statement(database, impl(statement));
 	}
 	else {
 		throw std::invalid_argument("database");
@@ -289,7 +6311,13 @@ statement prepare(
 
 outcome step(statement& statement) {
 	if (statement) {
-		switch (sqlite3_step(impl(statement))) {
+		detail::trace_span span("step", impl(statement));
+		SQLT3_PROBE2(step__start, impl(statement), sqlite3_sql(impl(statement)));
+		detail::touch_statement(impl(statement));
+		auto result = sqlite3_step(impl(statement));
+		detail::touch_statement(impl(statement));
+		SQLT3_PROBE3(step__done, impl(statement), sqlite3_sql(impl(statement)), result);
+		switch (result) {
 		case SQLITE_DONE: return done;
 		case SQLITE_ROW: return row;
 		default: throw_exception(statement);
@@ -304,13 +6332,202 @@ outcome step(statement& statement) {
 void finalize(statement& statement) {
 	if (statement) {
 		sqlite3* database = sqlite3_db_handle(impl(statement));
-		if (sqlite3_finalize(impl(statement)) != SQLITE_OK) {
+		detail::trace_span span("finalize", impl(statement));
+		SQLT3_PROBE2(finalize__start, impl(statement), sqlite3_sql(impl(statement)));
+		auto result = sqlite3_finalize(impl(statement));
+		SQLT3_PROBE3(finalize__done, impl(statement), nullptr, result);
+		if (result != SQLITE_OK) {
 			throw_exception(database);
 		}
 		impl(statement) = nullptr;
 	}
 }
 
+namespace detail {
+
+backup backup_init(sqlite3* destination, const char* destination_name, sqlite3* source, const char* source_name) {
+	auto handle = sqlite3_backup_init(destination, destination_name, source, source_name);
+	if (handle == nullptr) {
+		throw_exception(destination);
+	}
+	backup backup;
+	state(backup) = new backup_state();
+	state(backup)->handle = handle;
+	state(backup)->destination = destination;
+	return backup;
+}
+
+}
+
+backup backup_init(database& destination, const char* destination_name, database& source, const char* source_name) {
+	if (!destination) {
+		throw std::invalid_argument("destination");
+	}
+	if (!source) {
+		throw std::invalid_argument("source");
+	}
+	return detail::backup_init(impl(destination), destination_name, impl(source), source_name);
+}
+
+bool backup_step(backup& backup, int pages) {
+	if (backup) {
+		auto result = sqlite3_backup_step(state(backup)->handle, pages);
+		switch (result) {
+		case SQLITE_DONE: return true;
+		case SQLITE_OK:
+		case SQLITE_BUSY:
+		case SQLITE_LOCKED: return false;
+		default: detail::impl::throw_exception(result, sqlite3_errstr(result));
+		}
+	}
+	else {
+		throw std::invalid_argument("backup");
+	}
+	return false;
+}
+
+long long backup_remaining(backup& backup) {
+	if (backup) {
+		return sqlite3_backup_remaining(state(backup)->handle);
+	}
+	else {
+		throw std::invalid_argument("backup");
+	}
+}
+
+long long backup_pagecount(backup& backup) {
+	if (backup) {
+		return sqlite3_backup_pagecount(state(backup)->handle);
+	}
+	else {
+		throw std::invalid_argument("backup");
+	}
+}
+
+void backup_finish(backup& backup) {
+	if (backup) {
+		std::unique_ptr<detail::backup_state> finished(state(backup));
+		state(backup) = nullptr;
+		auto result = sqlite3_backup_finish(finished->handle);
+		if (result != SQLITE_OK) {
+			throw_exception(finished->destination);
+		}
+	}
+}
+
+namespace detail {
+
+backup_result backup_to(sqlite3* source, const char* path, const backup_options& options) {
+	auto begin = std::chrono::steady_clock::now();
+	auto destination = open(path);
+	auto backup = backup_init(sqlt3::impl(destination), "main", source, "main");
+	backup_result result = {};
+	long long last_remaining = -1;
+	long long last_pagecount = 0;
+	for (;;) {
+		auto complete = backup_step(backup, result.restarts >= options.max_restarts ? -1 : options.pages_per_step);
+		++result.steps;
+		auto remaining = backup_remaining(backup);
+		auto pagecount = backup_pagecount(backup);
+		// growth of the source explains only pagecount - last_pagecount more remaining pages
+		if (last_remaining >= 0 && remaining - last_remaining > pagecount - last_pagecount) {
+			++result.restarts;
+		}
+		last_remaining = remaining;
+		last_pagecount = pagecount;
+		if (options.progress) {
+			options.progress(remaining, pagecount);
+		}
+		if (complete) {
+			break;
+		}
+		if (options.pause > std::chrono::milliseconds::zero()) {
+			std::this_thread::sleep_for(options.pause);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+	result.pages = last_pagecount;
+	backup_finish(backup);
+	close(destination);
+	result.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+	return result;
+}
+
+}
+
+backup_result backup_to(database& source, const char* path, const backup_options& options) {
+	if (!source) {
+		throw std::invalid_argument("database");
+	}
+	if (path == nullptr) {
+		throw std::invalid_argument("path");
+	}
+	return detail::backup_to(impl(source), path, options);
+}
+
+std::future<backup_result> backup_async(database& source, const char* path, const backup_options& options) {
+	if (!source) {
+		throw std::invalid_argument("database");
+	}
+	if (path == nullptr) {
+		throw std::invalid_argument("path");
+	}
+	auto handle = impl(source);
+	string target = path;
+	return std::async(std::launch::async, [handle, target, options]() {
+		return detail::backup_to(handle, target.c_str(), options);
+	});
+}
+
+database build_template(const char* script) {
+	if (script == nullptr) {
+		throw std::invalid_argument("script");
+	}
+	auto result = open(":memory:", open_readwrite | open_create | open_fullmutex);
+	sqlt3::exec<void>(result, script);
+	return result;
+}
+
+database clone_database(database& from, const char* path, const open_options& options) {
+	if (!from) {
+		throw std::invalid_argument("database");
+	}
+	if (path == nullptr) {
+		throw std::invalid_argument("path");
+	}
+
+	auto begin = std::chrono::steady_clock::now();
+	auto result = open(path, options);
+	auto backup = backup_init(result, "main", from, "main");
+	if (!backup_step(backup, -1)) {
+		detail::impl::throw_exception(SQLITE_BUSY, "clone_database");
+	}
+	auto pages = backup_pagecount(backup);
+	backup_finish(backup);
+	auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+
+	std::lock_guard<std::mutex> lock(conn(from)->clone_mutex);
+	auto& stats = conn(from)->clones;
+	++stats.clones;
+	stats.pages = pages;
+	stats.last_duration = duration;
+	stats.max_duration = std::max(stats.max_duration, duration);
+	stats.total_duration += duration;
+	return result;
+}
+
+clone_stats clone_status(database& database) {
+	if (database) {
+		std::lock_guard<std::mutex> lock(conn(database)->clone_mutex);
+		return conn(database)->clones;
+	}
+	else {
+		throw std::invalid_argument("database");
+	}
+}
+
 template <class T> 
 inline void bind_int(
 	statement& statement, 
@@ -733,6 +6950,211 @@ inline void bind(
 	}
 }
 
+inline string to_string(const param_info& param_info) {
+	auto quote = [](const string& value) {
+		string result = "'";
+		for (auto c : value) {
+			result += c;
+			if (c == '\'') {
+				result += c;
+			}
+		}
+		return result + "'";
+	};
+
+	switch (param_info.tag) {
+	case tag_nullptr_t: return "NULL";
+	case tag_char: return std::to_string(static_cast<int>(*static_cast<const char*>(param_info.ptr)));
+	case tag_schar: return std::to_string(static_cast<int>(*static_cast<const signed char*>(param_info.ptr)));
+	case tag_uchar: return std::to_string(static_cast<int>(*static_cast<const unsigned char*>(param_info.ptr)));
+	case tag_wchar_t: return std::to_string(static_cast<long long>(*static_cast<const wchar_t*>(param_info.ptr)));
+	case tag_char16_t: return std::to_string(static_cast<long long>(*static_cast<const char16_t*>(param_info.ptr)));
+	case tag_char32_t: return std::to_string(static_cast<long long>(*static_cast<const char32_t*>(param_info.ptr)));
+	case tag_short: return std::to_string(*static_cast<const short*>(param_info.ptr));
+	case tag_ushort: return std::to_string(*static_cast<const unsigned short*>(param_info.ptr));
+	case tag_int: return std::to_string(*static_cast<const int*>(param_info.ptr));
+	case tag_uint: return std::to_string(*static_cast<const unsigned int*>(param_info.ptr));
+	case tag_long: return std::to_string(*static_cast<const long*>(param_info.ptr));
+	case tag_ulong: return std::to_string(*static_cast<const unsigned long*>(param_info.ptr));
+	case tag_longlong: return std::to_string(*static_cast<const long long*>(param_info.ptr));
+	case tag_ulonglong: return std::to_string(*static_cast<const unsigned long long*>(param_info.ptr));
+	case tag_float: return std::to_string(*static_cast<const float*>(param_info.ptr));
+	case tag_double: return std::to_string(*static_cast<const double*>(param_info.ptr));
+	case tag_string: return quote(*static_cast<const std::string*>(param_info.ptr));
+	case tag_cstring: return quote(static_cast<const char*>(param_info.ptr));
+	default: return "?";
+	}
+}
+
+void slow_query_buffer::record(
+	statement& statement,
+	const std::vector<const param_info*>& params,
+	std::chrono::nanoseconds duration,
+	int error
+	) {
+	if (duration < threshold) {
+		return;
+	}
+
+	auto handle = sqlt3::impl(statement);
+
+	slow_query query;
+	query.sql = sqlite3_sql(handle);
+	query.duration = duration;
+	query.error = error != SQLITE_OK ? sqlite3_errstr(error) : "";
+	query.fullscan_step = sqlite3_stmt_status(handle, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+	query.sort = sqlite3_stmt_status(handle, SQLITE_STMTSTATUS_SORT, 0);
+	query.autoindex = sqlite3_stmt_status(handle, SQLITE_STMTSTATUS_AUTOINDEX, 0);
+	query.vm_step = sqlite3_stmt_status(handle, SQLITE_STMTSTATUS_VM_STEP, 0);
+
+	for (auto param : params) {
+		query.params.push_back(to_string(*param));
+	}
+
+	sqlite3_stmt* explain = nullptr;
+	auto explain_sql = "EXPLAIN QUERY PLAN " + query.sql;
+	if (sqlite3_prepare_v2(sqlite3_db_handle(handle), explain_sql.c_str(), -1, &explain, nullptr) == SQLITE_OK && explain) {
+		sqlt3::statement wrapper;
+		sqlt3::impl(wrapper) = explain;
+		try {
+			for (size_t i = 0; i < params.size(); ++i) {
+				bind(wrapper, i + 1, *params[i]);
+			}
+			while (sqlite3_step(explain) == SQLITE_ROW) {
+				auto detail = sqlite3_column_text(explain, 3);
+				query.query_plan.push_back(detail ? reinterpret_cast<const char*>(detail) : "");
+			}
+		}
+		catch (...) {
+			// the plan is best effort
+		}
+	}
+
+	// written in one piece so entries of threads sharing the connection do not interleave
+	string entry;
+	if (file) {
+		entry = "-- slow query: " + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(duration).count())
+			+ " us, fullscan_step=" + std::to_string(query.fullscan_step)
+			+ ", sort=" + std::to_string(query.sort)
+			+ ", autoindex=" + std::to_string(query.autoindex)
+			+ ", vm_step=" + std::to_string(query.vm_step) + "\n";
+		if (!query.error.empty()) {
+			entry += "-- error: " + query.error + "\n";
+		}
+		for (size_t i = 0; i < query.params.size(); ++i) {
+			entry += "-- ?" + std::to_string(i + 1) + " = " + query.params[i] + "\n";
+		}
+		for (auto& line : query.query_plan) {
+			entry += "-- plan: " + line + "\n";
+		}
+		entry += query.sql + "\n\n";
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (file) {
+		std::fwrite(entry.data(), 1, entry.size(), file);
+		std::fflush(file);
+	}
+	if (capacity != 0) {
+		if (queries.size() == capacity) {
+			queries.pop_front();
+		}
+		queries.push_back(std::move(query));
+	}
+}
+
+template <class T> inline void write(string& buffer, const T& value) {
+	buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline void write(string& buffer, const char* data, size_t size) {
+	write(buffer, static_cast<std::uint32_t>(size));
+	buffer.append(data, size);
+}
+
+inline long long integer_value(const param_info& param_info) {
+	switch (param_info.tag) {
+	case tag_char: return *static_cast<const char*>(param_info.ptr);
+	case tag_schar: return *static_cast<const signed char*>(param_info.ptr);
+	case tag_uchar: return *static_cast<const unsigned char*>(param_info.ptr);
+	case tag_wchar_t: return *static_cast<const wchar_t*>(param_info.ptr);
+	case tag_char16_t: return *static_cast<const char16_t*>(param_info.ptr);
+	case tag_char32_t: return *static_cast<const char32_t*>(param_info.ptr);
+	case tag_short: return *static_cast<const short*>(param_info.ptr);
+	case tag_ushort: return *static_cast<const unsigned short*>(param_info.ptr);
+	case tag_int: return *static_cast<const int*>(param_info.ptr);
+	case tag_uint: return *static_cast<const unsigned int*>(param_info.ptr);
+	case tag_long: return *static_cast<const long*>(param_info.ptr);
+	case tag_ulong: return static_cast<long long>(*static_cast<const unsigned long*>(param_info.ptr));
+	case tag_longlong: return *static_cast<const long long*>(param_info.ptr);
+	case tag_ulonglong: return static_cast<long long>(*static_cast<const unsigned long long*>(param_info.ptr));
+	default: return 0;
+	}
+}
+
+void statement_recorder::record(
+	statement& statement,
+	const std::vector<const param_info*>& params,
+	std::chrono::steady_clock::time_point start,
+	std::chrono::nanoseconds duration,
+	int error
+	) {
+	static std::atomic<unsigned> next_thread(0);
+	static SQLT3_THREAD_LOCAL unsigned thread = 0;
+	if (thread == 0) {
+		thread = ++next_thread;
+	}
+
+	auto sql = sqlite3_sql(sqlt3::impl(statement));
+
+	string buffer;
+	write(buffer, static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count()));
+	write(buffer, static_cast<std::uint64_t>(duration.count()));
+	write(buffer, static_cast<std::uint32_t>(thread));
+	write(buffer, static_cast<std::int32_t>(error));
+	write(buffer, sql, std::strlen(sql));
+	write(buffer, static_cast<std::uint32_t>(params.size()));
+	for (auto param : params) {
+		switch (param->tag) {
+		case tag_nullptr_t:
+			write(buffer, static_cast<std::uint8_t>(record_null));
+			break;
+		case tag_float:
+			write(buffer, static_cast<std::uint8_t>(record_real));
+			write(buffer, static_cast<double>(*static_cast<const float*>(param->ptr)));
+			break;
+		case tag_double:
+			write(buffer, static_cast<std::uint8_t>(record_real));
+			write(buffer, *static_cast<const double*>(param->ptr));
+			break;
+		case tag_string: {
+			auto& value = *static_cast<const std::string*>(param->ptr);
+			write(buffer, static_cast<std::uint8_t>(record_text));
+			write(buffer, value.data(), value.size());
+			break;
+		}
+		case tag_cstring: {
+			auto value = static_cast<const char*>(param->ptr);
+			write(buffer, static_cast<std::uint8_t>(record_text));
+			write(buffer, value, std::strlen(value));
+			break;
+		}
+		default:
+			write(buffer, static_cast<std::uint8_t>(record_integer));
+			write(buffer, integer_value(*param));
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::fwrite(buffer.data(), 1, buffer.size(), file);
+}
+
+// A callback that throws after a row leaves SQLITE_ROW or SQLITE_DONE behind, that counts as an abort.
+inline int statement_error(sqlite3* handle) {
+	auto error = sqlite3_extended_errcode(handle);
+	return error == SQLITE_OK || error == SQLITE_ROW || error == SQLITE_DONE ? SQLITE_ABORT : error;
+}
+
 void exec_base(
 	database& database,
 	const char* sql_begin,
@@ -746,27 +7168,73 @@ void exec_base(
 			va_list _va_list;
 			va_start(_va_list, num_params);
 			std::size_t param_num = 0;
+			SQLT3_PROBE2(exec__start, sqlt3::impl(database), sql_begin);
 			try {
 				const char* itr = sql_begin;
 				const char* end = sql_end;
 				while (itr < end) {
 					statement statement = prepare(database, itr, end, itr);
 					if (statement) {
+						auto slow_log = conn(database)->slow_log.get();
+						auto recorder = conn(database)->recorder.get();
+						auto start = slow_log || recorder ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+						std::vector<const detail::param_info*> bound;
+
 						std::size_t bind_count = bind_parameter_count(statement);
 						for (std::size_t i = 0; i < bind_count && param_num < num_params; ++i) {
 							auto param_info = va_arg(_va_list, detail::param_info*);
 							detail::bind(statement, i + 1, *param_info);
+							if (slow_log || recorder) {
+								bound.push_back(param_info);
+							}
 							++param_num;
 						}
 
-						callback(statement);
+						auto record = [&](int error) {
+							if (slow_log || recorder) {
+								auto duration = std::chrono::steady_clock::now() - start;
+								if (slow_log) {
+									slow_log->record(statement, bound, duration, error);
+								}
+								if (recorder) {
+									recorder->record(statement, bound, start, duration, error);
+								}
+							}
+						};
+
+						// failed and interrupted statements are recorded too, an error of the log must not replace theirs
+						try {
+							callback(statement);
+						}
+						catch (const ioerr_mmap_error&) {
+							try {
+								record(SQLITE_IOERR_MMAP);
+							}
+							catch (...) {
+							}
+							mmap_fallback(database);
+							throw;
+						}
+						catch (...) {
+							try {
+								record(detail::statement_error(sqlt3::impl(database)));
+							}
+							catch (...) {
+							}
+							throw;
+						}
+						record(SQLITE_OK);
+
+						refresh_mmap(database);
 					}
 				}
 			}
 			catch (...) {
+				SQLT3_PROBE3(exec__done, sqlt3::impl(database), sql_begin, sqlite3_extended_errcode(sqlt3::impl(database)));
 				va_end(_va_list);
 				throw;
 			}
+			SQLT3_PROBE3(exec__done, sqlt3::impl(database), sql_begin, SQLITE_OK);
 		}
 		else {
 			throw std::invalid_argument("sql");
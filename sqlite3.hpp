@@ -5,6 +5,8 @@
 
 #include <vector>
 #include <functional>
+#include <chrono>
+#include <future>
 
 namespace sqlt3 {
 
@@ -56,16 +58,622 @@ private:
 	statement& operator=(const statement&);
 };
 
+// cancel() may be called from any thread, query_limit ties the token to a connection.
+class cancel_token {
+public:
+	cancel_token();
+	~cancel_token();
+	void cancel();
+	bool cancelled() const;
+private:
+	void* _impl;
+	friend struct detail::impl;
+	cancel_token(const cancel_token&);
+	cancel_token& operator=(const cancel_token&);
+};
+
+// While a query_limit lives, statements of the connection fail with interrupt_error once the
+// deadline passed or the token was cancelled. The deadline is checked every instructions virtual
+// machine instructions, cancel() also interrupts running statements right away. An inner limit
+// can only shorten an outer one. Must not outlive the connection.
+class query_limit {
+public:
+	query_limit(database& database, std::chrono::steady_clock::time_point deadline, cancel_token* token = nullptr, int instructions = 1000);
+	query_limit(database& database, std::chrono::nanoseconds timeout, cancel_token* token = nullptr, int instructions = 1000);
+	~query_limit();
+private:
+	void* _impl;
+	friend struct detail::impl;
+	query_limit(const query_limit&);
+	query_limit& operator=(const query_limit&);
+};
+
+class backup {
+public:
+	backup();
+	backup(backup&& that);
+	~backup();
+	backup& operator=(backup&& that);
+	explicit operator bool() const;
+private:
+	void* _impl;
+	friend struct detail::impl;
+	backup(const backup&);
+	backup& operator=(const backup&);
+};
+
+// lookaside_count of zero keeps SQLite's default lookaside, a null lookaside_buffer lets SQLite
+// allocate the slots, otherwise it must hold lookaside_size * lookaside_count bytes and outlive the connection.
+// db_status and db_status_delta report how the slots are used.
+// Pragmas left at their defaults are not sent, the rest run as a single batch right after opening.
+// vfs names the VFS of the connection, the VFSs of the wrapper (uring_vfs, ...) are registered on first use.
+struct open_options {
+	enum journal_mode_type {
+		journal_default,
+		journal_delete,
+		journal_truncate,
+		journal_persist,
+		journal_memory,
+		journal_wal,
+		journal_off
+	};
+
+	enum synchronous_type {
+		synchronous_default,
+		synchronous_off,
+		synchronous_normal,
+		synchronous_full
+	};
+
+	enum temp_store_type {
+		temp_store_default,
+		temp_store_file,
+		temp_store_memory
+	};
+
+	enum locking_mode_type {
+		locking_default,
+		locking_normal,
+		locking_exclusive
+	};
+
+	// mmap_fixed uses mmap_size as is (-1 keeps SQLite's default), mmap_file_size maps twice the
+	// current file size and grows with the file, mmap_ram_fraction maps mmap_fraction of the RAM.
+	enum mmap_policy_type {
+		mmap_fixed,
+		mmap_file_size,
+		mmap_ram_fraction
+	};
+
+	// checkpoint_auto keeps SQLite's wal_autocheckpoint. The other two replace it with a wal_hook that
+	// checkpoints once the WAL holds checkpoint_pages frames, checkpoint_hook from the committing
+	// thread and checkpoint_background from a thread with its own connection, which keeps writers
+	// from paying for it. A checkpoint that readers kept from finishing is retried after another
+	// checkpoint_pages frames. PASSIVE checkpoints escalate to RESTART at checkpoint_restart_pages
+	// and to TRUNCATE at checkpoint_truncate_pages (zero disables either), these block writers
+	// while they wait for readers, so writers need a busy_timeout. SQLite before 3.8.8 has no
+	// TRUNCATE; there a RESTART is used and the next writer cuts the WAL to journal_size_limit.
+	enum checkpoint_policy_type {
+		checkpoint_auto,
+		checkpoint_hook,
+		checkpoint_background
+	};
+
+	open_options();
+
+	unsigned flags;
+	const char* vfs;
+	size_t lookaside_size;
+	size_t lookaside_count;
+	void* lookaside_buffer;
+	journal_mode_type journal_mode;
+	synchronous_type synchronous;
+	temp_store_type temp_store;
+	locking_mode_type locking_mode;
+	long long cache_size;
+	long long page_size;
+	long long mmap_size;
+	mmap_policy_type mmap_policy;
+	double mmap_fraction;
+	checkpoint_policy_type checkpoint_policy;
+	long long checkpoint_pages;
+	long long checkpoint_restart_pages;
+	long long checkpoint_truncate_pages;
+	long long journal_size_limit;
+	// With preload the file is copied into a private memory_vfs database when opened and the
+	// connection works on that copy. A background thread writes the copy back, in one transaction,
+	// once persist_interval passed or persist_pages pages were written since the last time (zero
+	// disables either), and close writes it back a last time. Changes made since the last write
+	// back are lost if the process dies. The pragmas apply to the copy.
+	bool preload;
+	std::chrono::milliseconds persist_interval;
+	long long persist_pages;
+	int busy_timeout;
+	bool foreign_keys;
+	bool automatic_index;
+};
+
+database open(const char* filename, const open_options& options);
 database open(const char* filename, unsigned flags);
 database open(const char* filename);
+// Opens a file that no process will modify while it is open: read-only, immutable=1 (no locking
+// and no journal checks), memory-mapped and with a large page cache.
+database open_snapshot(const char* path);
 void close(database& database);
 
+// After an ioerr_mmap_error the connection falls back to read() I/O, errors counts those events.
+struct mmap_stats {
+	long long size;
+	long long file_size;
+	long long resizes;
+	long long errors;
+};
+
+mmap_stats mmap_status(database& database);
+
+// Replaces busy_timeout: while a lock is busy the connection sleeps initial_delay, multiplied by
+// multiplier after every retry up to max_delay, and gives up with busy_error after max_wait.
+// jitter shortens each sleep by a random fraction up to jitter, so contending connections do not
+// retry in lockstep. multiplier 1 and jitter 0 poll at a fixed interval. SQLite reports some busy
+// states without asking the handler, a WAL write transaction started on an old snapshot for one.
+struct busy_policy {
+	busy_policy();
+
+	std::chrono::milliseconds max_wait;
+	std::chrono::microseconds initial_delay;
+	std::chrono::microseconds max_delay;
+	double multiplier;
+	double jitter;
+};
+
+// events counts the locks found busy, retries the sleeps, timeouts the events that ended in busy_error.
+struct busy_stats {
+	long long events;
+	long long retries;
+	long long timeouts;
+	std::chrono::nanoseconds waited;
+};
+
+void set_busy_policy(database& database, const busy_policy& policy);
+busy_stats busy_status(database& database);
+
+// Writes the copy of a preloaded connection back to its file now, throws std::logic_error for
+// connections opened without preload.
+void persist_now(database& database);
+
+// dirty_pages counts the pages written to the copy since the last write back, failures the
+// background write backs that did not succeed.
+struct persist_stats {
+	long long persists;
+	long long failures;
+	long long dirty_pages;
+	std::chrono::nanoseconds last_duration;
+};
+
+persist_stats persist_status(database& database);
+
+// wal_frames and wal_bytes describe the WAL after the last commit or checkpoint of the main
+// database. Checkpoints that could not finish because of readers or writers are counted in busy.
+// Everything stays zero with checkpoint_auto, SQLite does not report its own checkpoints.
+struct wal_stats {
+	long long wal_frames;
+	long long wal_bytes;
+	long long checkpoints;
+	long long restarts;
+	long long truncates;
+	long long busy;
+	long long frames_checkpointed;
+	std::chrono::nanoseconds last_duration;
+	std::chrono::nanoseconds max_duration;
+	std::chrono::nanoseconds total_duration;
+};
+
+wal_stats wal_status(database& database);
+
+struct metrics {
+	long long cache_used;
+	long long cache_hit;
+	long long cache_miss;
+	long long cache_write;
+	long long schema_used;
+	long long stmt_used;
+	long long lookaside_used;
+	long long lookaside_highwater;
+	long long lookaside_hit;
+	long long lookaside_miss_size;
+	long long lookaside_miss_full;
+	long long memory_used;
+	long long memory_highwater;
+	long long malloc_count;
+	long long malloc_size;
+	long long pagecache_used;
+	long long pagecache_overflow;
+	long long pagecache_overflow_highwater;
+};
+
+metrics db_status(database& database);
+// Counters (hits, misses, writes) are relative to the previous db_status or db_status_delta
+// call on this connection, gauges (used, highwater, count) are current values.
+metrics db_status_delta(database& database);
+
+struct slow_query {
+	string sql;
+	std::vector<string> params;
+	std::chrono::nanoseconds duration;
+	string error;
+	long long fullscan_step;
+	long long sort;
+	long long autoindex;
+	long long vm_step;
+	std::vector<string> query_plan;
+};
+
+// Statements run through exec/execf that take longer than threshold are kept in a ring buffer
+// of the given capacity and, if path is not null, appended to that file, which stays open until
+// the log is turned off (cantopen_error if it cannot be opened). Failed statements are kept as
+// well, error holds the message of their result code and is empty otherwise.
+void slow_query_log(database& database, std::chrono::nanoseconds threshold, size_t capacity, const char* path = nullptr);
+void slow_query_log_off(database& database);
+std::vector<slow_query> slow_queries(database& database);
+
+// A statement that stepped but was neither reset, run to the end nor finalized keeps its read
+// transaction open, which blocks WAL checkpoints. stepping tells those apart from statements that
+// only wait to be run. idle is the time since the statement was last stepped (since it was
+// prepared if it never was).
+struct live_statement {
+	string sql;
+	std::chrono::nanoseconds age;
+	std::chrono::nanoseconds idle;
+	bool stepping;
+};
+
+enum watchdog_action {
+	watchdog_log,
+	watchdog_reset
+};
+
+// Lists the unfinalized statements of the connection that were prepared at least older_than ago.
+// Tracking starts with the first call of live_statements or statement_watchdog, statements
+// prepared before are timed from that call. Up to 64 connections can be tracked at once, each
+// step of their statements takes the mutex of the tracker.
+std::vector<live_statement> live_statements(database& database, std::chrono::nanoseconds older_than = std::chrono::nanoseconds::zero());
+// Checks on prepare, at most every threshold / 4, for stepping statements that were not stepped
+// for threshold and appends them to the file at path (stderr if null), watchdog_reset also resets
+// them. Only meant for statements the application lost track of, a reset one starts over on the
+// next step. There is no timer, a connection that no longer prepares statements is not checked,
+// live_statements can be polled for those.
+void statement_watchdog(database& database, std::chrono::nanoseconds threshold, watchdog_action action, const char* path = nullptr);
+// Both stop tracking and free the tracker, close does the same.
+void statement_watchdog_off(database& database);
+void statement_tracking_off(database& database);
+
+// Records prepare/step/finalize spans of traced connections in per-thread buffers,
+// trace_json() renders everything recorded so far in the Chrome trace-event format.
+void trace_start(database& database);
+void trace_stop(database& database);
+string trace_json();
+// Drops everything recorded so far, also while connections are traced. The buffers of threads
+// that have exited are freed here.
+void trace_clear();
+
+// Appends every statement executed through exec/execf with its bound parameters,
+// start time, duration, thread and result code to a binary log that replay() can re-execute.
+void record_start(database& database, const char* path);
+void record_stop(database& database);
+
+struct replay_options {
+	replay_options()
+		: original_speed(false)
+		, threads(1) {
+	}
+
+	bool original_speed;
+	size_t threads;
+};
+
+// recorded_errors counts the statements that already failed while they were recorded.
+struct replay_result {
+	size_t statements;
+	size_t errors;
+	size_t recorded_errors;
+	std::chrono::nanoseconds elapsed;
+};
+
+// Statements of one recorded thread always run in order on the same replay thread.
+replay_result replay(const char* log, const char* filename, const replay_options& options = replay_options());
+
+struct allocator_options {
+	allocator_options()
+		: max_pooled_size(16384)
+		, thread_cache_size(1 << 20) {
+	}
+
+	size_t max_pooled_size;
+	size_t thread_cache_size;
+};
+
+struct allocator_stats {
+	long long in_use;
+	long long peak;
+	long long system_allocations;
+};
+
+// Installs a size-class pool allocator as SQLite's malloc, must be called before the first open.
+// Requests up to max_pooled_size are served from per-thread free lists backed by a global pool,
+// each thread keeps at most thread_cache_size bytes of free blocks. Threads publish in_use in
+// 64 KiB batches, so in_use and peak lag behind by at most that much per thread.
+void configure_allocator(const allocator_options& options = allocator_options());
+allocator_stats allocator_status();
+
+// Fixed memory budget configured through SQLITE_CONFIG_HEAP, PAGECACHE, SCRATCH and LOOKASIDE,
+// must be called before the first open. A section is skipped if its size is zero, a null buffer
+// with a non-zero size is reserved by the wrapper. HEAP needs SQLite built with SQLITE_ENABLE_MEMSYS5.
+struct memory_options {
+	memory_options()
+		: heap(nullptr)
+		, heap_size(0)
+		, min_allocation(64)
+		, pagecache(nullptr)
+		, page_size(0)
+		, page_count(0)
+		, scratch(nullptr)
+		, scratch_size(0)
+		, scratch_count(0)
+		, lookaside_size(0)
+		, lookaside_count(0) {
+	}
+
+	void* heap;
+	size_t heap_size;
+	size_t min_allocation;
+	void* pagecache;
+	size_t page_size;
+	size_t page_count;
+	void* scratch;
+	size_t scratch_size;
+	size_t scratch_count;
+	size_t lookaside_size;
+	size_t lookaside_count;
+};
+
+struct status_value {
+	long long current;
+	long long highwater;
+};
+
+struct memory_report {
+	status_value memory_used;
+	status_value malloc_size;
+	status_value malloc_count;
+	status_value pagecache_used;
+	status_value pagecache_overflow;
+	status_value pagecache_size;
+	status_value scratch_used;
+	status_value scratch_overflow;
+	status_value scratch_size;
+};
+
+void configure_memory(const memory_options& options);
+memory_report memory_status(bool reset_highwater = false);
+
+// Replaces the per-connection page caches with one bounded pool of page_count frames shared by
+// all connections and recycled with the CLOCK policy, must be called before the first open.
+// Each frame holds up to frame_size bytes of page plus per-page extra data, larger pages and
+// caches of temporary databases use private allocations, only those are bounded by cache_size.
+struct page_cache_options {
+	page_cache_options()
+		: page_count(2000)
+		, frame_size(4096 + 512) {
+	}
+
+	size_t page_count;
+	size_t frame_size;
+};
+
+struct page_cache_stats {
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long private_pages;
+	long long frames_in_use;
+	long long frames;
+};
+
+void configure_page_cache(const page_cache_options& options = page_cache_options());
+page_cache_stats page_cache_status();
+
+extern const char* const uring_vfs;
+
+// Consecutive writes to a file (the pages of a commit or a checkpoint) are queued with the file and
+// submitted to io_uring as one batch before any other call reaches the file or takes a lock on the
+// same database, from whichever thread makes it. Reads are single submissions.
+// Without io_uring (other platforms, old kernels, seccomp) files are accessed synchronously.
+struct uring_stats {
+	bool available;
+	long long enters;
+	long long submissions;
+	long long reads;
+	long long writes;
+	long long fallback_calls;
+};
+
+uring_stats uring_status();
+
+extern const char* const readahead_vfs;
+
+// A file read through readahead_vfs trigger_reads times in a row, each read continuing the last,
+// is a sequential scan, the kernel is then advised (posix_fadvise WILLNEED) to load the next
+// window bytes ahead of it. The window doubles up to max_window while the scan goes on.
+// used_bytes counts the bytes SQLite read from prefetched extents.
+struct readahead_options {
+	readahead_options()
+		: trigger_reads(4)
+		, window(256 * 1024)
+		, max_window(4 * 1024 * 1024) {
+	}
+
+	size_t trigger_reads;
+	size_t window;
+	size_t max_window;
+};
+
+struct readahead_stats {
+	long long advices;
+	long long prefetched_bytes;
+	long long used_bytes;
+};
+
+void configure_readahead(const readahead_options& options = readahead_options());
+readahead_stats readahead_status();
+
+extern const char* const accounting_vfs;
+
+struct io_counters {
+	long long calls;
+	long long bytes;
+	std::chrono::nanoseconds time;
+};
+
+struct io_file_stats {
+	io_counters read;
+	io_counters write;
+	io_counters sync;
+	io_counters truncate;
+};
+
+// I/O of the files of a connection opened through accounting_vfs, temp covers temporary databases
+// and statement journals. Files other than the main database are charged to the connection whose
+// main database the opening thread used last, that is the connection running the statement.
+struct io_stats {
+	io_file_stats main;
+	io_file_stats journal;
+	io_file_stats wal;
+	io_file_stats temp;
+};
+
+// All zero unless the connection uses accounting_vfs.
+io_stats io_status(database& database);
+
+extern const char* const memory_vfs;
+
+// Databases opened through memory_vfs live in the memory of the process and are shared by every
+// connection that opens the same name, so with journal_wal the connections of a pool read
+// concurrently. A database disappears when its last connection closes.
+struct memory_vfs_stats {
+	long long files;
+	long long bytes;
+};
+
+memory_vfs_stats memory_vfs_status();
+
+extern const char* const compress_vfs;
+
+// The main database of a connection opened through compress_vfs is stored page by page with a
+// built-in LZ77 codec and found through a page map rewritten at every commit, journals and temp
+// files are not compressed. Such databases are not memory-mapped and use WAL only with
+// locking_exclusive. The sizes are those of the connection's database, pages and times count
+// for the whole process.
+struct compression_stats {
+	long long logical_bytes;
+	long long stored_bytes;
+	long long file_size;
+	double ratio;
+	long long pages_compressed;
+	long long pages_decompressed;
+	std::chrono::nanoseconds compress_time;
+	std::chrono::nanoseconds decompress_time;
+};
+
+compression_stats compression_status(database& database);
+
+extern const char* const direct_vfs;
+
+// Main databases opened through direct_vfs bypass the kernel page cache (O_DIRECT, F_NOCACHE on
+// macOS) and are cached instead in one pool of pool_size bytes in 4 KiB frames, shared by the
+// connections of the process and recycled with the CLOCK policy. configure_direct_io must come
+// before the first open through direct_vfs. Other processes may write such a database only in
+// rollback journal mode, where a changed file is detected when the shared lock is taken.
+// Files that can not be opened for direct I/O (other platforms, file systems without O_DIRECT)
+// are counted in fallback_files and use the default VFS unchanged.
+struct direct_io_options {
+	direct_io_options()
+		: pool_size(64 * 1024 * 1024) {
+	}
+
+	size_t pool_size;
+};
+
+struct direct_io_stats {
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long reads;
+	long long writes;
+	long long fallback_files;
+	long long frames_in_use;
+	long long frames;
+};
+
+void configure_direct_io(const direct_io_options& options = direct_io_options());
+direct_io_stats direct_io_status();
+
 statement prepare(database& database, const char* sql_begin, const char* sql_end, const char*& tail);
 statement prepare(database& database, const char* sql, const char*& tail);
 statement prepare(database& database, string::const_iterator sql_begin, string::const_iterator sql_end, string::const_iterator& tail);
 outcome step(statement& statement);
 void finalize(statement& statement);
 
+// Thin wrappers of sqlite3_backup_*. backup_step copies up to pages pages (-1 for all) and returns
+// true once the copy is complete, a busy or locked source just copies nothing.
+backup backup_init(database& destination, const char* destination_name, database& source, const char* source_name);
+bool backup_step(backup& backup, int pages);
+long long backup_remaining(backup& backup);
+long long backup_pagecount(backup& backup);
+void backup_finish(backup& backup);
+
+// Copies pages_per_step pages at a time and pauses between steps (yields if pause is zero), so
+// the source is locked only briefly. Changes made through the source connection are copied as
+// they happen, changes by other connections restart the copy; after max_restarts restarts the
+// rest is copied in one step. progress gets the remaining and total page count after each step.
+struct backup_options {
+	backup_options();
+
+	int pages_per_step;
+	std::chrono::milliseconds pause;
+	int max_restarts;
+	std::function<void(long long remaining, long long pagecount)> progress;
+};
+
+struct backup_result {
+	long long pages;
+	long long steps;
+	long long restarts;
+	std::chrono::nanoseconds elapsed;
+};
+
+backup_result backup_to(database& source, const char* path, const backup_options& options = backup_options());
+// Runs backup_to on another thread. The connection of source must stay open until the result is
+// ready, and must not have been opened with open_nomutex if it is used meanwhile.
+std::future<backup_result> backup_async(database& source, const char* path, const backup_options& options = backup_options());
+
+// Runs script on a new in-memory database that serves as template for clone_database. The
+// connection is opened with open_fullmutex, so threads can clone it at the same time.
+database build_template(const char* script);
+// Opens path with options and overwrites it with a copy of the main database of from, which may be
+// any connection, on disk or in memory. Much faster than running the script again.
+database clone_database(database& from, const char* path, const open_options& options = open_options());
+
+struct clone_stats {
+	long long clones;
+	long long pages;
+	std::chrono::nanoseconds last_duration;
+	std::chrono::nanoseconds max_duration;
+	std::chrono::nanoseconds total_duration;
+};
+
+// Counts the clones made from the connection, pages is the size of the last one.
+clone_stats clone_status(database& database);
+
 void bind(statement& statement, size_t index, nullptr_t value);
 void bind(statement& statement, size_t index, char value);
 void bind(statement& statement, size_t index, signed char value);
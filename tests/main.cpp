@@ -1,6 +1,13 @@
 #include <stdio.h>
 #include "gtest/gtest.h"
+#include <sqlite3.h>
 #include <sqlite3.hpp>
+#include <thread>
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <cstdlib>
+#include <limits>
 
 struct sqlt3cpp_test : public ::testing::Test {
 	sqlt3cpp_test() {
@@ -171,6 +178,1079 @@ TEST_F(sqlt3cpp_test, exception_thrown_in_destructor_from_finalize_during_handli
 		);
 }
 
+TEST_F(sqlt3cpp_test, db_status_delta_counts_cache_hits) {
+	sqlt3::db_status(database);
+	sqlt3::exec<int>(database, "SELECT first FROM \"numbers\" WHERE fourth = ?;", "first");
+	auto delta = sqlt3::db_status_delta(database);
+
+	EXPECT_LT(0, delta.cache_used);
+	EXPECT_LT(0, delta.cache_hit + delta.cache_miss);
+	EXPECT_EQ(0, sqlt3::db_status_delta(database).cache_miss);
+}
+
+TEST_F(sqlt3cpp_test, slow_query_log_records_plan_and_params) {
+	sqlt3::slow_query_log(database, std::chrono::nanoseconds(0), 1);
+	sqlt3::exec<int>(database, "SELECT first FROM \"numbers\" WHERE fourth = ?;", "first");
+	sqlt3::exec<int>(database, "SELECT first FROM \"numbers\" WHERE second = ?;", "one");
+	auto queries = sqlt3::slow_queries(database);
+
+	ASSERT_EQ(1, queries.size());
+	EXPECT_EQ("SELECT first FROM \"numbers\" WHERE second = ?;", queries[0].sql);
+	ASSERT_EQ(1, queries[0].params.size());
+	EXPECT_EQ("'one'", queries[0].params[0]);
+	EXPECT_FALSE(queries[0].query_plan.empty());
+	EXPECT_TRUE(queries[0].error.empty());
+
+	EXPECT_THROW(sqlt3::exec<long long>(database, "SELECT abs(?);", std::numeric_limits<long long>::min()), sqlt3::sqlite_error);
+	queries = sqlt3::slow_queries(database);
+	ASSERT_EQ(1, queries.size());
+	EXPECT_EQ("SELECT abs(?);", queries[0].sql);
+	EXPECT_FALSE(queries[0].error.empty());
+}
+
+TEST_F(sqlt3cpp_test, slow_query_log_file_keeps_entries_whole) {
+	std::remove("slow.log");
+	sqlt3::open_options options;
+	options.flags = sqlt3::open_readwrite | sqlt3::open_create | sqlt3::open_fullmutex;
+	auto shared = sqlt3::open(":memory:", options);
+	sqlt3::slow_query_log(shared, std::chrono::nanoseconds(0), 0, "slow.log");
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i) {
+		threads.emplace_back([&shared, i] {
+			for (int j = 0; j < 50; ++j) {
+				sqlt3::exec<int>(shared, "SELECT ? + 1;", i);
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	sqlt3::close(shared);
+
+	std::ifstream file("slow.log");
+	std::string log((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	file.close();
+	size_t entries = 0;
+	for (size_t begin = 0; begin < log.size(); ++entries) {
+		auto end = log.find("\n\n", begin);
+		ASSERT_NE(std::string::npos, end);
+		auto entry = log.substr(begin, end - begin);
+		EXPECT_EQ(0u, entry.find("-- slow query: "));
+		EXPECT_NE(std::string::npos, entry.find("\n-- ?1 = "));
+		EXPECT_EQ(entry.size() - 13, entry.rfind("SELECT ? + 1;"));
+		begin = end + 2;
+	}
+	EXPECT_EQ(200u, entries);
+	std::remove("slow.log");
+}
+
+TEST_F(sqlt3cpp_test, trace_json_contains_statement_spans) {
+	sqlt3::trace_clear();
+	sqlt3::trace_start(database);
+	sqlt3::exec<int>(database, "SELECT first FROM \"numbers\" WHERE fourth = ?;", "first");
+	sqlt3::trace_stop(database);
+	sqlt3::exec<int>(database, "SELECT second FROM \"numbers\" WHERE fourth = ?;", "first");
+	auto json = sqlt3::trace_json();
+
+	EXPECT_EQ(0, json.find("{\"traceEvents\":["));
+	EXPECT_NE(std::string::npos, json.find("\"name\":\"prepare\""));
+	EXPECT_NE(std::string::npos, json.find("\"name\":\"step\""));
+	EXPECT_NE(std::string::npos, json.find("\"name\":\"finalize\""));
+	EXPECT_NE(std::string::npos, json.find("\"name\":\"execute\""));
+	EXPECT_EQ(std::string::npos, json.find("SELECT second"));
+}
+
+TEST_F(sqlt3cpp_test, trace_clear_while_tracing) {
+	sqlt3::trace_start(database);
+	std::atomic<bool> stop(false);
+	std::thread worker([&] {
+		while (!stop) {
+			sqlt3::exec<int>(database, "SELECT first FROM \"numbers\" WHERE fourth = ?;", "first");
+		}
+	});
+	for (int i = 0; i < 100; ++i) {
+		sqlt3::trace_clear();
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+		EXPECT_EQ(0, sqlt3::trace_json().find("{\"traceEvents\":["));
+	}
+	stop = true;
+	worker.join();
+	sqlt3::trace_stop(database);
+
+	sqlt3::trace_clear();
+	EXPECT_EQ("{\"traceEvents\":[]}", sqlt3::trace_json());
+}
+
+TEST_F(sqlt3cpp_test, trace_keeps_events_of_exited_threads_until_cleared) {
+	sqlt3::trace_clear();
+	sqlt3::trace_start(database);
+	for (int round = 0; round < 20; ++round) {
+		std::vector<std::thread> threads;
+		for (int i = 0; i < 4; ++i) {
+			threads.emplace_back([&] {
+				sqlt3::exec<int>(database, "SELECT first FROM \"numbers\" WHERE fourth = ?;", "first");
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		EXPECT_NE(std::string::npos, sqlt3::trace_json().find("\"name\":\"step\""));
+		sqlt3::trace_clear();
+		EXPECT_EQ("{\"traceEvents\":[]}", sqlt3::trace_json());
+	}
+	sqlt3::trace_stop(database);
+}
+
+TEST_F(sqlt3cpp_test, replay_executes_recorded_statements) {
+	sqlt3::record_start(database, "workload.log");
+	sqlt3::exec<int>(database, "SELECT first FROM \"numbers\" WHERE fourth = ?;", "first");
+	sqlt3::exec<std::string>(database, "SELECT second FROM \"numbers\" WHERE first = ? AND third > ?;", 1, 0.5);
+	EXPECT_THROW(sqlt3::exec<long long>(database, "SELECT abs(?);", std::numeric_limits<long long>::min()), sqlt3::sqlite_error);
+	sqlt3::record_stop(database);
+
+	sqlt3::replay_options options;
+	options.threads = 2;
+	auto result = sqlt3::replay("workload.log", "test.db", options);
+	std::remove("workload.log");
+
+	EXPECT_EQ(3, result.statements);
+	EXPECT_EQ(1, result.errors);
+	EXPECT_EQ(1, result.recorded_errors);
+}
+
+TEST_F(sqlt3cpp_test, open_with_lookaside_options) {
+	sqlt3::open_options options;
+	options.lookaside_size = 256;
+	options.lookaside_count = 64;
+	auto other = sqlt3::open("test.db", options);
+	sqlt3::exec<int>(other, "SELECT first FROM \"numbers\" WHERE fourth = ?;", "first");
+	auto stats = sqlt3::db_status(other);
+
+	EXPECT_LE(stats.lookaside_used, stats.lookaside_highwater);
+	EXPECT_GE(64, stats.lookaside_highwater);
+
+	options.lookaside_size = 100;
+	EXPECT_THROW(sqlt3::open("test.db", options), std::invalid_argument);
+}
+
+TEST_F(sqlt3cpp_test, open_applies_pragmas) {
+	sqlt3::open_options options;
+	options.journal_mode = sqlt3::open_options::journal_memory;
+	options.synchronous = sqlt3::open_options::synchronous_off;
+	options.temp_store = sqlt3::open_options::temp_store_memory;
+	options.cache_size = 123;
+	options.foreign_keys = false;
+	options.automatic_index = false;
+	auto other = sqlt3::open("test.db", options);
+
+	EXPECT_EQ("memory", sqlt3::exec<std::string>(other, "PRAGMA journal_mode;"));
+	EXPECT_EQ(0, sqlt3::exec<int>(other, "PRAGMA synchronous;"));
+	EXPECT_EQ(2, sqlt3::exec<int>(other, "PRAGMA temp_store;"));
+	EXPECT_EQ(123, sqlt3::exec<int>(other, "PRAGMA cache_size;"));
+	EXPECT_EQ(0, sqlt3::exec<int>(other, "PRAGMA foreign_keys;"));
+	EXPECT_EQ(0, sqlt3::exec<int>(other, "PRAGMA automatic_index;"));
+	EXPECT_EQ(1, sqlt3::exec<int>(database, "PRAGMA foreign_keys;"));
+}
+
+TEST_F(sqlt3cpp_test, mmap_file_size_policy_covers_file) {
+	sqlt3::open_options options;
+	options.mmap_policy = sqlt3::open_options::mmap_file_size;
+	auto other = sqlt3::open("test.db", options);
+
+	auto status = sqlt3::mmap_status(other);
+	EXPECT_GE(status.size, status.file_size);
+	EXPECT_EQ(0, status.resizes);
+	EXPECT_EQ(0, status.errors);
+	EXPECT_EQ(status.size, sqlt3::exec<long long>(other, "PRAGMA mmap_size;"));
+}
+
+// The default VFS with xFetch failing for main databases, as it does when the file can not be mapped.
+struct mmap_error_vfs {
+	static sqlite3_vfs vfs;
+	static sqlite3_io_methods methods;
+	static int fetches;
+
+	static int xFetch(sqlite3_file*, sqlite3_int64, int, void** pointer) {
+		++fetches;
+		*pointer = nullptr;
+		return SQLITE_IOERR_MMAP;
+	}
+
+	static int xOpen(sqlite3_vfs* self, const char* name, sqlite3_file* file, int flags, int* out_flags) {
+		auto real = static_cast<sqlite3_vfs*>(self->pAppData);
+		auto result = real->xOpen(real, name, file, flags, out_flags);
+		if (result == SQLITE_OK && (flags & SQLITE_OPEN_MAIN_DB) != 0 && file->pMethods->iVersion >= 3) {
+			methods = *file->pMethods;
+			methods.xFetch = &xFetch;
+			file->pMethods = &methods;
+		}
+		return result;
+	}
+
+	static const char* install() {
+		if (vfs.zName == nullptr) {
+			auto real = sqlite3_vfs_find(nullptr);
+			vfs = *real;
+			vfs.pNext = nullptr;
+			vfs.zName = "mmap_error";
+			vfs.pAppData = real;
+			vfs.xOpen = &xOpen;
+			sqlite3_vfs_register(&vfs, 0);
+		}
+		return vfs.zName;
+	}
+};
+
+sqlite3_vfs mmap_error_vfs::vfs;
+sqlite3_io_methods mmap_error_vfs::methods;
+int mmap_error_vfs::fetches = 0;
+
+TEST_F(sqlt3cpp_test, mmap_error_falls_back_to_read) {
+	std::remove("mmap.db");
+	auto setup = sqlt3::open("mmap.db");
+	sqlt3::exec<void>(setup, "CREATE TABLE mmap (value INTEGER); INSERT INTO mmap VALUES (1);");
+	sqlt3::close(setup);
+
+	sqlt3::open_options options;
+	options.vfs = mmap_error_vfs::install();
+	options.mmap_size = 1 << 20;
+	auto other = sqlt3::open("mmap.db", options);
+	EXPECT_THROW(sqlt3::exec<int>(other, "SELECT value FROM mmap;"), sqlt3::ioerr_mmap_error);
+	auto fetches = mmap_error_vfs::fetches;
+	EXPECT_LT(0, fetches);
+
+	auto status = sqlt3::mmap_status(other);
+	EXPECT_EQ(1, status.errors);
+	EXPECT_EQ(0, status.size);
+	EXPECT_EQ(1, sqlt3::exec<int>(other, "SELECT value FROM mmap;"));
+	EXPECT_EQ(fetches, mmap_error_vfs::fetches);
+	sqlt3::close(other);
+	std::remove("mmap.db");
+}
+
+TEST_F(sqlt3cpp_test, open_snapshot_is_read_only) {
+	auto snapshot = sqlt3::open_snapshot("test.db");
+
+	EXPECT_EQ(1, sqlt3::exec<int>(snapshot, "PRAGMA query_only;"));
+	EXPECT_LT(0, sqlt3::mmap_status(snapshot).size);
+	EXPECT_THROW(sqlt3::exec<void>(snapshot, "CREATE TABLE snapshot_test (id INTEGER);"), sqlt3::sqlite_error);
+}
+
+TEST_F(sqlt3cpp_test, uring_vfs_round_trip) {
+	sqlt3::open_options options;
+	options.vfs = sqlt3::uring_vfs;
+	auto other = sqlt3::open("uring.db", options);
+
+	sqlt3::exec<void>(other, "DROP TABLE IF EXISTS uring; CREATE TABLE uring (value TEXT);");
+	auto before = sqlt3::uring_status();
+	sqlt3::exec<void>(other, "BEGIN; INSERT INTO uring SELECT zeroblob(1000) FROM (WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) SELECT i FROM n); INSERT INTO uring VALUES ('x'); COMMIT;");
+	auto after = sqlt3::uring_status();
+	EXPECT_EQ(101, sqlt3::exec<int>(other, "SELECT COUNT(*) FROM uring;"));
+
+	if (after.available) {
+		EXPECT_LT(before.writes, after.writes);
+		EXPECT_GT(after.submissions - before.submissions, after.enters - before.enters);
+	}
+	else {
+		EXPECT_LT(before.fallback_calls, after.fallback_calls);
+	}
+	sqlt3::close(other);
+	std::remove("uring.db");
+}
+
+TEST_F(sqlt3cpp_test, uring_vfs_shares_connections_between_threads) {
+	std::remove("uring.db");
+	sqlt3::open_options options;
+	options.vfs = sqlt3::uring_vfs;
+	options.flags = sqlt3::open_readwrite | sqlt3::open_create | sqlt3::open_fullmutex;
+	auto other = sqlt3::open("uring.db", options);
+	sqlt3::exec<void>(other, "PRAGMA cache_size = 10; CREATE TABLE uring (value BLOB);");
+
+	// the writer spills pages and stays alive while another thread reads them
+	std::promise<void> written;
+	std::promise<void> done;
+	std::thread writer([&] {
+		sqlt3::exec<void>(other, "BEGIN; INSERT INTO uring SELECT randomblob(1000) FROM (WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 500) SELECT i FROM n);");
+		written.set_value();
+		done.get_future().wait();
+	});
+	written.get_future().wait();
+	EXPECT_NO_THROW({
+		EXPECT_EQ(500, sqlt3::exec<int>(other, "SELECT COUNT(*) FROM uring;"));
+		EXPECT_EQ("ok", sqlt3::exec<std::string>(other, "PRAGMA integrity_check;"));
+		sqlt3::exec<void>(other, "COMMIT;");
+	});
+	done.set_value();
+	writer.join();
+
+	EXPECT_EQ("ok", sqlt3::exec<std::string>(other, "PRAGMA integrity_check;"));
+	sqlt3::close(other);
+	std::remove("uring.db");
+}
+
+TEST_F(sqlt3cpp_test, readahead_vfs_advises_sequential_scans) {
+	std::remove("readahead.db");
+	sqlt3::open_options options;
+	options.vfs = sqlt3::readahead_vfs;
+	options.mmap_size = 0;
+	auto other = sqlt3::open("readahead.db", options);
+	sqlt3::exec<void>(other, "DROP TABLE IF EXISTS readahead; CREATE TABLE readahead (value BLOB);");
+	sqlt3::exec<void>(other, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO readahead SELECT zeroblob(2000) FROM n;");
+	sqlt3::close(other);
+
+	auto before = sqlt3::readahead_status();
+	other = sqlt3::open("readahead.db", options);
+	EXPECT_EQ(200, sqlt3::exec<int>(other, "SELECT COUNT(*) FROM readahead WHERE length(value) = 2000;"));
+#if !defined(_WIN32)
+	auto after = sqlt3::readahead_status();
+	EXPECT_LT(before.advices, after.advices);
+#endif
+	sqlt3::close(other);
+#if !defined(_WIN32)
+	EXPECT_LT(before.used_bytes, sqlt3::readahead_status().used_bytes);
+#endif
+	std::remove("readahead.db");
+}
+
+TEST_F(sqlt3cpp_test, io_status_counts_per_file_kind) {
+	std::remove("accounting.db");
+	sqlt3::open_options options;
+	options.vfs = sqlt3::accounting_vfs;
+	options.journal_mode = sqlt3::open_options::journal_delete;
+	auto other = sqlt3::open("accounting.db", options);
+
+	sqlt3::exec<void>(other, "DROP TABLE IF EXISTS accounting; CREATE TABLE accounting (value TEXT);");
+	auto before = sqlt3::io_status(other);
+	sqlt3::exec<void>(other, "INSERT INTO accounting VALUES ('x');");
+	auto after = sqlt3::io_status(other);
+
+	EXPECT_LT(before.main.write.calls, after.main.write.calls);
+	EXPECT_LT(before.main.write.bytes, after.main.write.bytes);
+	EXPECT_LT(before.journal.write.calls, after.journal.write.calls);
+	EXPECT_EQ(0, after.wal.write.calls);
+	EXPECT_EQ(0, sqlt3::io_status(database).main.read.calls);
+
+	// the counters can be read while the connection is busy in another thread
+	std::thread writer([&] {
+		for (int i = 0; i < 50; ++i) {
+			sqlt3::exec<void>(other, "INSERT INTO accounting VALUES ('y');");
+		}
+	});
+	auto calls = after.main.write.calls;
+	for (int i = 0; i < 1000; ++i) {
+		auto current = sqlt3::io_status(other).main.write.calls;
+		EXPECT_LE(calls, current);
+		calls = current;
+	}
+	writer.join();
+	EXPECT_LT(after.main.write.calls, sqlt3::io_status(other).main.write.calls);
+
+	sqlt3::close(other);
+	std::remove("accounting.db");
+}
+
+TEST_F(sqlt3cpp_test, memory_vfs_is_shared_between_connections) {
+	sqlt3::open_options options;
+	options.vfs = sqlt3::memory_vfs;
+	options.journal_mode = sqlt3::open_options::journal_wal;
+	auto writer = sqlt3::open("shared.db", options);
+	auto reader = sqlt3::open("shared.db", options);
+
+	sqlt3::exec<void>(writer, "CREATE TABLE shared (value INTEGER); INSERT INTO shared VALUES (42);");
+	EXPECT_EQ(42, sqlt3::exec<int>(reader, "SELECT value FROM shared;"));
+	EXPECT_LT(0, sqlt3::memory_vfs_status().bytes);
+
+	sqlt3::close(writer);
+	sqlt3::close(reader);
+	auto other = sqlt3::open("shared.db", options);
+	EXPECT_EQ(0, sqlt3::exec<int>(other, "SELECT COUNT(*) FROM sqlite_master;"));
+}
+
+TEST_F(sqlt3cpp_test, compress_vfs_round_trip) {
+	std::remove("compressed.db");
+	sqlt3::open_options options;
+	options.vfs = sqlt3::compress_vfs;
+	auto other = sqlt3::open("compressed.db", options);
+	sqlt3::exec<void>(other, "CREATE TABLE compressed (value TEXT);");
+	sqlt3::exec<void>(other, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 500) INSERT INTO compressed SELECT 'row ' || i || ' of a very repetitive archive table' FROM n;");
+	EXPECT_EQ("delete", sqlt3::exec<std::string>(other, "PRAGMA journal_mode = WAL;"));
+	sqlt3::close(other);
+
+	other = sqlt3::open("compressed.db", options);
+	EXPECT_EQ(500, sqlt3::exec<int>(other, "SELECT COUNT(*) FROM compressed;"));
+	EXPECT_EQ("ok", sqlt3::exec<std::string>(other, "PRAGMA integrity_check;"));
+	auto status = sqlt3::compression_status(other);
+	EXPECT_LT(2.0, status.ratio);
+	EXPECT_LT(0, status.pages_decompressed);
+
+	// the freed blocks at the end of the file are given back
+	sqlt3::exec<void>(other, "DELETE FROM compressed; VACUUM;");
+	auto shrunk = sqlt3::compression_status(other);
+	EXPECT_GT(status.file_size, shrunk.file_size);
+	EXPECT_GT(16 * 1024, shrunk.file_size);
+	EXPECT_EQ("ok", sqlt3::exec<std::string>(other, "PRAGMA integrity_check;"));
+	sqlt3::close(other);
+
+	other = sqlt3::open("compressed.db", options);
+	EXPECT_EQ(0, sqlt3::exec<int>(other, "SELECT COUNT(*) FROM compressed;"));
+	sqlt3::close(other);
+	std::remove("compressed.db");
+}
+
+TEST_F(sqlt3cpp_test, direct_vfs_serves_reads_from_pool) {
+	std::remove("direct.db");
+	sqlt3::open_options options;
+	options.vfs = sqlt3::direct_vfs;
+	auto opened = sqlt3::direct_io_status();
+	auto other = sqlt3::open("direct.db", options);
+	sqlt3::exec<void>(other, "CREATE TABLE direct (value TEXT); INSERT INTO direct VALUES ('x');");
+
+	auto before = sqlt3::direct_io_status();
+	sqlt3::exec<void>(other, "PRAGMA cache_size = 0;");
+	EXPECT_EQ("x", sqlt3::exec<std::string>(other, "SELECT value FROM direct;"));
+	auto after = sqlt3::direct_io_status();
+
+	if (after.fallback_files != opened.fallback_files) {
+		std::cout << "[  SKIPPED ] no direct I/O for direct.db on this platform or file system" << std::endl;
+	}
+	else {
+		EXPECT_LT(before.hits, after.hits);
+		EXPECT_LT(0, after.frames_in_use);
+
+		// a change made without direct_vfs must not be served from the pool
+		auto plain = sqlt3::open("direct.db");
+		sqlt3::exec<void>(plain, "UPDATE direct SET value = 'y';");
+		sqlt3::close(plain);
+		EXPECT_EQ("y", sqlt3::exec<std::string>(other, "SELECT value FROM direct;"));
+	}
+	sqlt3::close(other);
+	std::remove("direct.db");
+}
+
+long long file_size(const char* path) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	return file ? static_cast<long long>(file.tellg()) : 0;
+}
+
+TEST_F(sqlt3cpp_test, background_checkpoints_bound_wal) {
+	std::remove("wal.db");
+	sqlt3::open_options options;
+	options.journal_mode = sqlt3::open_options::journal_wal;
+	options.checkpoint_policy = sqlt3::open_options::checkpoint_background;
+	options.checkpoint_pages = 10;
+	auto other = sqlt3::open("wal.db", options);
+	sqlt3::exec<void>(other, "CREATE TABLE wal (value BLOB);");
+	for (int i = 0; i < 50; ++i) {
+		sqlt3::exec<void>(other, "INSERT INTO wal VALUES (randomblob(8192));");
+	}
+	sqlt3::close(other);
+
+	// each insert adds about three frames, the WAL starts over once the thread caught up
+	other = sqlt3::open("wal.db", options);
+	EXPECT_EQ(50, sqlt3::exec<int>(other, "SELECT COUNT(*) FROM wal;"));
+	auto page_size = sqlt3::exec<long long>(other, "PRAGMA page_size;");
+	long long largest = 0;
+	for (int i = 0; i < 200; ++i) {
+		sqlt3::exec<void>(other, "INSERT INTO wal VALUES (randomblob(8192));");
+		if (i % 10 == 9) {
+			auto checkpoints = sqlt3::wal_status(other).checkpoints;
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (sqlt3::wal_status(other).checkpoints == checkpoints && std::chrono::steady_clock::now() < deadline) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		largest = std::max(largest, file_size("wal.db-wal"));
+	}
+	auto status = sqlt3::wal_status(other);
+	EXPECT_LT(0, status.checkpoints);
+	EXPECT_LT(0, status.frames_checkpointed);
+	EXPECT_LT(200, status.frames_checkpointed);
+	// a checkpoint that overlapped a commit leaves the WAL to the next one, unbounded it grows to 600 frames
+	EXPECT_GT(256 * (page_size + 24), largest);
+
+	sqlt3::close(other);
+	std::remove("wal.db");
+}
+
+TEST_F(sqlt3cpp_test, checkpoint_hook_escalates_past_readers) {
+	std::remove("wal.db");
+	sqlt3::open_options options;
+	options.journal_mode = sqlt3::open_options::journal_wal;
+	options.checkpoint_policy = sqlt3::open_options::checkpoint_hook;
+	options.checkpoint_pages = 10;
+	options.checkpoint_restart_pages = 40;
+	options.checkpoint_truncate_pages = 80;
+	options.journal_size_limit = 0;
+	options.busy_timeout = 10;
+	auto writer = sqlt3::open("wal.db", options);
+	sqlt3::exec<void>(writer, "CREATE TABLE wal (value BLOB);");
+	auto page_size = sqlt3::exec<long long>(writer, "PRAGMA page_size;");
+
+	// checkpoints from the committing thread keep the WAL at about checkpoint_pages frames
+	long long largest = 0;
+	for (int i = 0; i < 50; ++i) {
+		sqlt3::exec<void>(writer, "INSERT INTO wal VALUES (randomblob(8192));");
+		largest = std::max(largest, file_size("wal.db-wal"));
+	}
+	auto status = sqlt3::wal_status(writer);
+	EXPECT_LT(0, status.checkpoints);
+	EXPECT_EQ(0, status.busy);
+	EXPECT_GT(20 * (page_size + 24), largest);
+	EXPECT_EQ(32 + status.wal_frames * (page_size + 24), status.wal_bytes);
+
+	// a reader pins the WAL, passive checkpoints fall behind and the writer escalates
+	auto reader = sqlt3::open("wal.db");
+	sqlt3::exec<void>(reader, "BEGIN;");
+	EXPECT_EQ(50, sqlt3::exec<int>(reader, "SELECT COUNT(*) FROM wal;"));
+	for (int i = 0; i < 40; ++i) {
+		sqlt3::exec<void>(writer, "INSERT INTO wal VALUES (randomblob(8192));");
+	}
+	status = sqlt3::wal_status(writer);
+	EXPECT_LT(0, status.busy);
+	EXPECT_LT(0, status.restarts + status.truncates);
+	EXPECT_LE(80, status.wal_frames);
+
+	// without the reader the next checkpoint starts the WAL over
+	sqlt3::exec<void>(reader, "COMMIT;");
+	for (int i = 0; i < 40 && sqlt3::wal_status(writer).wal_frames >= 80; ++i) {
+		sqlt3::exec<void>(writer, "INSERT INTO wal VALUES (randomblob(8192));");
+	}
+	sqlt3::exec<void>(writer, "INSERT INTO wal VALUES (randomblob(8192));");
+	EXPECT_GT(10, sqlt3::wal_status(writer).wal_frames);
+	EXPECT_GT(20 * (page_size + 24), file_size("wal.db-wal"));
+
+	sqlt3::close(reader);
+	sqlt3::close(writer);
+	std::remove("wal.db");
+}
+
+TEST_F(sqlt3cpp_test, statement_watchdog_resets_abandoned_statements) {
+	const char* tail = nullptr;
+	auto abandoned = sqlt3::prepare(database, "SELECT 1 UNION ALL SELECT 2;", tail);
+	EXPECT_EQ(sqlt3::row, sqlt3::step(abandoned));
+
+	auto statements = sqlt3::live_statements(database);
+	ASSERT_EQ(1u, statements.size());
+	EXPECT_EQ("SELECT 1 UNION ALL SELECT 2;", statements[0].sql);
+	EXPECT_TRUE(statements[0].stepping);
+
+	std::remove("watchdog.log");
+	sqlt3::statement_watchdog(database, std::chrono::milliseconds(50), sqlt3::watchdog_reset, "watchdog.log");
+	auto looped = sqlt3::prepare(database, "SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3;", tail);
+	EXPECT_EQ(sqlt3::row, sqlt3::step(looped));
+	std::this_thread::sleep_for(std::chrono::milliseconds(60));
+
+	// looped is older than the threshold but still stepped between the statements exec prepares
+	EXPECT_EQ(sqlt3::row, sqlt3::step(looped));
+	EXPECT_EQ(4, sqlt3::exec<int>(database, "SELECT 4;"));
+	EXPECT_EQ(sqlt3::row, sqlt3::step(looped));
+	EXPECT_EQ(3, sqlt3::column<int>(looped, 0));
+
+	statements = sqlt3::live_statements(database);
+	ASSERT_EQ(2u, statements.size());
+	for (auto& statement : statements) {
+		EXPECT_EQ(statement.sql != "SELECT 1 UNION ALL SELECT 2;", statement.stepping);
+	}
+
+	std::ifstream file("watchdog.log");
+	std::string log((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	file.close();
+	EXPECT_NE(std::string::npos, log.find(", reset\nSELECT 1 UNION ALL SELECT 2;\n"));
+	EXPECT_EQ(std::string::npos, log.find("SELECT 3"));
+	std::remove("watchdog.log");
+
+	// turning the watchdog off drops the tracker, the next call times the statements anew
+	sqlt3::statement_watchdog_off(database);
+	statements = sqlt3::live_statements(database);
+	ASSERT_EQ(2u, statements.size());
+	for (auto& statement : statements) {
+		EXPECT_GT(std::chrono::milliseconds(50), statement.age);
+	}
+	sqlt3::statement_tracking_off(database);
+	EXPECT_EQ(sqlt3::done, sqlt3::step(looped));
+}
+
+TEST_F(sqlt3cpp_test, backup_async_copies_in_steps) {
+	std::remove("backup.db");
+	auto source = sqlt3::open(":memory:");
+	sqlt3::exec<void>(source, "CREATE TABLE backup (value BLOB);");
+	sqlt3::exec<void>(source, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO backup SELECT randomblob(1000) FROM n;");
+
+	sqlt3::backup_options options;
+	options.pages_per_step = 8;
+	options.pause = std::chrono::milliseconds(0);
+	long long calls = 0;
+	options.progress = [&](long long remaining, long long pagecount) {
+		EXPECT_LE(remaining, pagecount);
+		++calls;
+	};
+	auto backup = sqlt3::backup_async(source, "backup.db", options);
+	// the copy only depends on the connection, not on the handle it was started with
+	auto moved = std::move(source);
+	auto result = backup.get();
+	sqlt3::close(moved);
+	EXPECT_LT(1, result.steps);
+	EXPECT_EQ(result.steps, calls);
+
+	auto copy = sqlt3::open("backup.db");
+	EXPECT_EQ(200, sqlt3::exec<int>(copy, "SELECT COUNT(*) FROM backup;"));
+	EXPECT_EQ(result.pages, sqlt3::exec<long long>(copy, "PRAGMA page_count;"));
+	sqlt3::close(copy);
+	std::remove("backup.db");
+}
+
+TEST_F(sqlt3cpp_test, preload_persists_changes) {
+	std::remove("preload.db");
+	sqlt3::open_options options;
+	options.preload = true;
+	options.persist_interval = std::chrono::milliseconds(0);
+	options.persist_pages = 0;
+	auto other = sqlt3::open("preload.db", options);
+	sqlt3::exec<void>(other, "CREATE TABLE preload (value INTEGER); INSERT INTO preload VALUES (1);");
+	EXPECT_LT(0, sqlt3::persist_status(other).dirty_pages);
+
+	auto disk = sqlt3::open("preload.db");
+	EXPECT_EQ(0, sqlt3::exec<int>(disk, "SELECT COUNT(*) FROM sqlite_master;"));
+	sqlt3::persist_now(other);
+	EXPECT_EQ(0, sqlt3::persist_status(other).dirty_pages);
+	EXPECT_EQ(1, sqlt3::exec<int>(disk, "SELECT COUNT(*) FROM preload;"));
+
+	sqlt3::exec<void>(other, "INSERT INTO preload VALUES (2);");
+	sqlt3::close(other);
+	EXPECT_EQ(2, sqlt3::exec<int>(disk, "SELECT COUNT(*) FROM preload;"));
+
+	sqlt3::close(disk);
+	std::remove("preload.db");
+}
+
+TEST_F(sqlt3cpp_test, preload_persists_after_interval) {
+	std::remove("preload_interval.db");
+	sqlt3::open_options options;
+	options.preload = true;
+	options.persist_interval = std::chrono::milliseconds(50);
+	options.persist_pages = 0;
+	auto other = sqlt3::open("preload_interval.db", options);
+	sqlt3::exec<void>(other, "CREATE TABLE preload (value INTEGER); INSERT INTO preload VALUES (1);");
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (sqlt3::persist_status(other).persists == 0 && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	auto status = sqlt3::persist_status(other);
+	EXPECT_EQ(1, status.persists);
+	EXPECT_EQ(0, status.dirty_pages);
+	auto disk = sqlt3::open("preload_interval.db");
+	EXPECT_EQ(1, sqlt3::exec<int>(disk, "SELECT COUNT(*) FROM preload;"));
+
+	sqlt3::close(disk);
+	sqlt3::close(other);
+	std::remove("preload_interval.db");
+}
+
+TEST_F(sqlt3cpp_test, preload_persists_after_pages) {
+	std::remove("preload_pages.db");
+	sqlt3::open_options options;
+	options.preload = true;
+	options.persist_interval = std::chrono::milliseconds(0);
+	options.persist_pages = 20;
+	auto other = sqlt3::open("preload_pages.db", options);
+	sqlt3::exec<void>(other, "CREATE TABLE preload (value BLOB); INSERT INTO preload VALUES (1);");
+
+	// the thread checks every 100 ms, a few pages stay in memory
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	EXPECT_EQ(0, sqlt3::persist_status(other).persists);
+	EXPECT_LT(0, sqlt3::persist_status(other).dirty_pages);
+
+	sqlt3::exec<void>(other, "INSERT INTO preload VALUES (randomblob(200000));");
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (sqlt3::persist_status(other).persists == 0 && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	EXPECT_EQ(1, sqlt3::persist_status(other).persists);
+	auto disk = sqlt3::open("preload_pages.db");
+	EXPECT_EQ(2, sqlt3::exec<int>(disk, "SELECT COUNT(*) FROM preload;"));
+
+	sqlt3::close(disk);
+	sqlt3::close(other);
+	std::remove("preload_pages.db");
+}
+
+TEST_F(sqlt3cpp_test, clone_database_copies_template) {
+	auto seed = sqlt3::build_template("CREATE TABLE tenant (name TEXT); INSERT INTO tenant VALUES ('seed');");
+	std::remove("clone.db");
+	auto first = sqlt3::clone_database(seed, "clone.db");
+	auto second = sqlt3::clone_database(seed, ":memory:");
+	sqlt3::exec<void>(second, "INSERT INTO tenant VALUES ('other');");
+
+	EXPECT_EQ(1, sqlt3::exec<int>(first, "SELECT COUNT(*) FROM tenant;"));
+	EXPECT_EQ(2, sqlt3::exec<int>(second, "SELECT COUNT(*) FROM tenant;"));
+	auto status = sqlt3::clone_status(seed);
+	EXPECT_EQ(2, status.clones);
+	EXPECT_LT(0, status.pages);
+
+	sqlt3::close(first);
+	std::remove("clone.db");
+}
+
+TEST_F(sqlt3cpp_test, busy_policy_waits_and_gives_up) {
+	std::remove("busy.db");
+	auto holder = sqlt3::open("busy.db");
+	auto other = sqlt3::open("busy.db");
+	sqlt3::busy_policy policy;
+	policy.max_wait = std::chrono::milliseconds(20);
+	policy.initial_delay = std::chrono::microseconds(500);
+	sqlt3::set_busy_policy(other, policy);
+
+	sqlt3::exec<void>(holder, "BEGIN EXCLUSIVE;");
+	// the counters can be read while the handler waits in another thread
+	std::thread waiter([&] {
+		EXPECT_THROW(sqlt3::exec<void>(other, "CREATE TABLE busy (value INTEGER);"), sqlt3::busy_error);
+	});
+	long long retries = 0;
+	for (int i = 0; i < 1000; ++i) {
+		auto current = sqlt3::busy_status(other).retries;
+		EXPECT_LE(retries, current);
+		retries = current;
+	}
+	waiter.join();
+	sqlt3::exec<void>(holder, "COMMIT;");
+
+	auto status = sqlt3::busy_status(other);
+	EXPECT_EQ(1, status.events);
+	EXPECT_EQ(1, status.timeouts);
+	EXPECT_LT(0, status.retries);
+	EXPECT_LE(std::chrono::milliseconds(15), status.waited);
+
+	sqlt3::close(other);
+	sqlt3::close(holder);
+	std::remove("busy.db");
+}
+
+TEST_F(sqlt3cpp_test, query_limit_interrupts_runaway_queries) {
+	const char* runaway = "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n) SELECT COUNT(*) FROM n;";
+	{
+		sqlt3::query_limit limit(database, std::chrono::milliseconds(10));
+		EXPECT_THROW(sqlt3::exec<long long>(database, runaway), sqlt3::interrupt_error);
+	}
+
+	sqlt3::cancel_token token;
+	std::thread canceller([&] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		token.cancel();
+	});
+	{
+		sqlt3::query_limit limit(database, std::chrono::hours(1), &token);
+		EXPECT_THROW(sqlt3::exec<long long>(database, runaway), sqlt3::interrupt_error);
+	}
+	canceller.join();
+	EXPECT_TRUE(token.cancelled());
+	EXPECT_EQ(1, sqlt3::exec<int>(database, "SELECT 1;"));
+}
+
+// Arguments are checked before anything is configured, so these run in the initialized process.
+TEST_F(sqlt3cpp_test, configure_memory_rejects_invalid_options) {
+	auto rejected = [](const sqlt3::memory_options& options) -> std::string {
+		try {
+			sqlt3::configure_memory(options);
+		}
+		catch (const std::invalid_argument& e) {
+			return e.what();
+		}
+		catch (const sqlt3::sqlite_error&) {
+			return "configured";
+		}
+		return "";
+	};
+	static long long buffer[1 << 13];
+
+	sqlt3::memory_options options;
+	options.heap_size = 1024;
+	EXPECT_EQ("heap_size", rejected(options));
+	options.heap_size = 1 << 20;
+	options.min_allocation = 48;
+	EXPECT_EQ("min_allocation", rejected(options));
+	options.min_allocation = 64;
+	options.heap = reinterpret_cast<char*>(buffer) + 4;
+	options.heap_size = 1 << 16;
+	EXPECT_EQ("heap", rejected(options));
+
+	options = sqlt3::memory_options();
+	options.page_count = 10;
+	options.page_size = 100;
+	EXPECT_EQ("page_size", rejected(options));
+	options.page_size = 4096 + 64;
+	options.page_count = std::numeric_limits<size_t>::max() / 2;
+	EXPECT_EQ("page_count", rejected(options));
+
+	options = sqlt3::memory_options();
+	options.scratch_count = 1;
+	options.scratch_size = 12;
+	EXPECT_EQ("scratch_size", rejected(options));
+
+	// a valid heap does not get configured when a later section is invalid
+	options = sqlt3::memory_options();
+	options.heap_size = 1 << 20;
+	options.lookaside_count = 10;
+	options.lookaside_size = 4;
+	EXPECT_EQ("lookaside_size", rejected(options));
+	options.lookaside_size = 64;
+	options.lookaside_count = std::numeric_limits<size_t>::max() / 2;
+	EXPECT_EQ("lookaside_count", rejected(options));
+
+	// valid options reach SQLite, which refuses them once it is initialized
+	options.lookaside_count = 10;
+	EXPECT_EQ("configured", rejected(options));
+}
+
+// Process-wide configuration has to come before SQLite is initialized, these tests run it in a
+// fresh process: the threadsafe death test style re-executes the binary for the statement.
+struct sqlt3cpp_configure_DeathTest : public ::testing::Test {
+	sqlt3cpp_configure_DeathTest() {
+		::testing::FLAGS_gtest_death_test_style = "threadsafe";
+	}
+};
+
+#define SQLT3_CHECK(condition) if (!(condition)) { std::cerr << __LINE__ << ": " #condition << std::endl; std::exit(1); }
+
+void page_cache_child() {
+	std::remove("pagecache.db");
+	sqlt3::page_cache_options cache;
+	cache.page_count = 64;
+	sqlt3::configure_page_cache(cache);
+
+	sqlt3::open_options options;
+	options.journal_mode = sqlt3::open_options::journal_wal;
+	options.busy_timeout = 10000;
+	auto setup = sqlt3::open("pagecache.db", options);
+	sqlt3::exec<void>(setup, "CREATE TABLE cache (id INTEGER PRIMARY KEY, value BLOB);");
+	sqlt3::exec<void>(setup, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 400) INSERT INTO cache SELECT i, randomblob(1000) FROM n;");
+
+	// the connections evict each other's frames all the time, only 64 are shared between them
+	std::vector<sqlt3::database> connections;
+	for (int i = 0; i < 4; ++i) {
+		connections.push_back(sqlt3::open("pagecache.db", options));
+	}
+	std::atomic<int> failures(0);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i) {
+		threads.emplace_back([&, i] {
+			try {
+				for (int round = 0; round < 50; ++round) {
+					if (sqlt3::exec<long long>(connections[i], "SELECT SUM(LENGTH(value)) FROM cache;") != 400000) {
+						++failures;
+					}
+					sqlt3::exec<void>(connections[i], "UPDATE cache SET value = randomblob(1000) WHERE id = ?;", (round * 4 + i) % 400 + 1);
+				}
+			}
+			catch (const std::exception& e) {
+				std::cerr << e.what() << std::endl;
+				++failures;
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	SQLT3_CHECK(failures == 0);
+	SQLT3_CHECK(sqlt3::exec<std::string>(setup, "PRAGMA integrity_check;") == "ok");
+
+	// live pages only: what the caches report fits into the pool and their private pages
+	auto status = sqlt3::page_cache_status();
+	long long used = 0;
+	for (auto& connection : connections) {
+		used += sqlt3::db_status(connection).cache_used;
+	}
+	SQLT3_CHECK(0 < status.evictions);
+	SQLT3_CHECK(0 < status.hits);
+	SQLT3_CHECK(status.frames_in_use <= status.frames);
+	SQLT3_CHECK(used <= (status.frames + status.private_pages + 8) * 6 * 1024);
+
+	connections.clear();
+	sqlt3::close(setup);
+	std::remove("pagecache.db");
+	std::remove("pagecache.db-wal");
+	std::remove("pagecache.db-shm");
+	std::exit(0);
+}
+
+TEST_F(sqlt3cpp_configure_DeathTest, page_cache_shared_between_connections) {
+	EXPECT_EXIT(page_cache_child(), ::testing::ExitedWithCode(0), "");
+}
+
+void mmap_clamp_child() {
+	std::remove("mmap.db");
+	SQLT3_CHECK(sqlite3_config(SQLITE_CONFIG_MMAP_SIZE, sqlite3_int64(0), sqlite3_int64(64 * 1024)) == SQLITE_OK);
+	sqlt3::open_options options;
+	options.mmap_policy = sqlt3::open_options::mmap_file_size;
+	auto other = sqlt3::open("mmap.db", options);
+	sqlt3::exec<void>(other, "CREATE TABLE mmap (value BLOB);");
+	sqlt3::exec<void>(other, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO mmap SELECT randomblob(1000) FROM n;");
+
+	// the file outgrew the largest possible mapping, which is not requested over and over
+	for (int i = 0; i < 4 * 64; ++i) {
+		sqlt3::exec<int>(other, "SELECT 1;");
+	}
+	auto status = sqlt3::mmap_status(other);
+	SQLT3_CHECK(status.file_size > 64 * 1024);
+	SQLT3_CHECK(status.size == 64 * 1024);
+	SQLT3_CHECK(status.resizes == 0);
+
+	sqlt3::close(other);
+	std::remove("mmap.db");
+	std::exit(0);
+}
+
+TEST_F(sqlt3cpp_configure_DeathTest, mmap_size_stays_clamped) {
+	EXPECT_EXIT(mmap_clamp_child(), ::testing::ExitedWithCode(0), "");
+}
+
+void allocator_child() {
+	sqlt3::allocator_options options;
+	options.max_pooled_size = 4096;
+	options.thread_cache_size = 8192;
+	sqlt3::configure_allocator(options);
+	SQLT3_CHECK(sqlite3_initialize() == SQLITE_OK);
+
+	// SQLite accounts the size xSize reports: quarter steps between powers of two, larger requests
+	// are rounded to 8 bytes
+	auto base = sqlite3_memory_used();
+	int sizes[][2] = { { 1, 16 }, { 17, 20 }, { 33, 40 }, { 100, 112 }, { 4096, 4096 }, { 4097, 4104 }, { 5000, 5000 } };
+	for (auto& size : sizes) {
+		auto pointer = sqlite3_malloc(size[0]);
+		SQLT3_CHECK(pointer != nullptr);
+		SQLT3_CHECK(sqlite3_memory_used() - base == size[1]);
+		sqlite3_free(pointer);
+	}
+
+	// a freed block is handed out again without asking the system
+	auto before = sqlt3::allocator_status();
+	auto first = sqlite3_malloc(100);
+	sqlite3_free(first);
+	auto second = sqlite3_malloc(100);
+	SQLT3_CHECK(second == first);
+	sqlite3_free(second);
+	auto oversized = sqlite3_malloc(5000);
+	sqlite3_free(oversized);
+	SQLT3_CHECK(sqlt3::allocator_status().system_allocations == before.system_allocations + 1);
+
+	// growing, shrinking and leaving the pool keep the contents
+	auto pointer = static_cast<unsigned char*>(sqlite3_malloc(16));
+	for (int i = 0; i < 16; ++i) {
+		pointer[i] = static_cast<unsigned char>(i);
+	}
+	pointer = static_cast<unsigned char*>(sqlite3_realloc(pointer, 1000));
+	SQLT3_CHECK(sqlite3_memory_used() - base == 1024);
+	pointer = static_cast<unsigned char*>(sqlite3_realloc(pointer, 10000));
+	SQLT3_CHECK(sqlite3_memory_used() - base == 10000);
+	auto unpooled = pointer;
+	pointer = static_cast<unsigned char*>(sqlite3_realloc(pointer, 9000));
+	SQLT3_CHECK(pointer == unpooled);
+	SQLT3_CHECK(sqlite3_memory_used() - base == 10000);
+	pointer = static_cast<unsigned char*>(sqlite3_realloc(pointer, 20));
+	SQLT3_CHECK(sqlite3_memory_used() - base == 20);
+	for (int i = 0; i < 16; ++i) {
+		SQLT3_CHECK(pointer[i] == i);
+	}
+	SQLT3_CHECK(sqlite3_realloc(pointer, 0) == nullptr);
+	SQLT3_CHECK(sqlite3_memory_used() == base);
+	pointer = static_cast<unsigned char*>(sqlite3_realloc(nullptr, 40));
+	SQLT3_CHECK(pointer != nullptr);
+	SQLT3_CHECK(sqlite3_memory_used() - base == 40);
+	sqlite3_free(pointer);
+
+	// blocks beyond the thread cache limit and those of finished threads go to the global pool
+	std::vector<void*> blocks;
+	for (int i = 0; i < 64; ++i) {
+		blocks.push_back(sqlite3_malloc(1024));
+	}
+	for (auto block : blocks) {
+		sqlite3_free(block);
+	}
+	std::thread([] {
+		void* blocks[4];
+		for (auto& block : blocks) {
+			block = sqlite3_malloc(3072);
+		}
+		for (auto block : blocks) {
+			sqlite3_free(block);
+		}
+	}).join();
+	before = sqlt3::allocator_status();
+	for (auto& block : blocks) {
+		block = sqlite3_malloc(1024);
+	}
+	void* reused[4];
+	for (auto& block : reused) {
+		block = sqlite3_malloc(3072);
+	}
+	SQLT3_CHECK(sqlt3::allocator_status().system_allocations == before.system_allocations);
+	for (auto block : blocks) {
+		sqlite3_free(block);
+	}
+	for (auto block : reused) {
+		sqlite3_free(block);
+	}
+
+	// in_use moves in batches of at most 64 KiB, a large block is published right away
+	before = sqlt3::allocator_status();
+	auto large = sqlite3_malloc(1 << 20);
+	auto during = sqlt3::allocator_status();
+	SQLT3_CHECK(std::abs(during.in_use - before.in_use - (1 << 20)) < 64 * 1024);
+	SQLT3_CHECK(during.peak >= during.in_use);
+	sqlite3_free(large);
+	auto after = sqlt3::allocator_status();
+	SQLT3_CHECK(std::abs(after.in_use - before.in_use) < 64 * 1024);
+	SQLT3_CHECK(after.peak == during.peak);
+
+	auto db = sqlt3::open(":memory:");
+	sqlt3::exec<void>(db, "CREATE TABLE pool (value BLOB);");
+	sqlt3::exec<void>(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) INSERT INTO pool SELECT randomblob(i % 300) FROM n;");
+	SQLT3_CHECK(sqlt3::exec<long long>(db, "SELECT COUNT(*) FROM pool;") == 1000);
+	SQLT3_CHECK(sqlt3::allocator_status().in_use > 0);
+	sqlt3::close(db);
+	std::exit(0);
+}
+
+TEST_F(sqlt3cpp_configure_DeathTest, allocator_pools_size_classes) {
+	EXPECT_EXIT(allocator_child(), ::testing::ExitedWithCode(0), "");
+}
+
+void memory_child() {
+	std::remove("memory.db");
+	sqlt3::memory_options options;
+	options.page_size = 4096 + 256;
+	options.page_count = 32;
+	options.lookaside_size = 128;
+	options.lookaside_count = 64;
+	sqlt3::configure_memory(options);
+
+	auto other = sqlt3::open("memory.db");
+	sqlt3::exec<void>(other, "PRAGMA page_size = 4096; CREATE TABLE memory (value BLOB);");
+	sqlt3::exec<void>(other, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) INSERT INTO memory SELECT randomblob(1000) FROM n;");
+	SQLT3_CHECK(sqlt3::exec<int>(other, "SELECT COUNT(*) FROM memory;") == 100);
+
+	// the pages of the cache come from the reserved slots
+	auto status = sqlt3::memory_status();
+	SQLT3_CHECK(0 < status.pagecache_used.highwater);
+	SQLT3_CHECK(status.pagecache_used.highwater <= 32);
+	SQLT3_CHECK(0 < status.memory_used.highwater);
+
+	// the highwater marks start over from the current values
+	sqlt3::close(other);
+	SQLT3_CHECK(sqlt3::memory_status(true).pagecache_used.highwater == status.pagecache_used.highwater);
+	status = sqlt3::memory_status();
+	SQLT3_CHECK(status.pagecache_used.highwater == status.pagecache_used.current);
+	SQLT3_CHECK(status.memory_used.highwater == status.memory_used.current);
+
+	std::remove("memory.db");
+	std::exit(0);
+}
+
+TEST_F(sqlt3cpp_configure_DeathTest, memory_status_reports_reserved_sections) {
+	EXPECT_EXIT(memory_child(), ::testing::ExitedWithCode(0), "");
+}
+
 int main(int argc, char **argv) {
 	testing::InitGoogleTest(&argc, argv);
 	auto result = RUN_ALL_TESTS();